@@ -0,0 +1,189 @@
+/*
+  ==============================================================================
+
+    CpuDispatch.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+// The kernels are built for several instruction sets with per-function target attributes, which only GCC and Clang
+// have, and only x86 has instruction sets to choose from. Everything else builds the portable kernels alone.
+#if (defined (__GNUC__) || defined (__clang__)) && (defined (__x86_64__) || defined (__i386__))
+ #define STONEMISTRESS_MULTI_ISA 1
+ // flatten inlines the whole kernel into the function, so all of it is compiled for the target.
+ #define STONEMISTRESS_TARGET(isa) __attribute__((target (isa), flatten))
+#else
+ #define STONEMISTRESS_MULTI_ISA 0
+#endif
+
+/*
+ * Runtime selection of the instruction set the hot loops run with: the phaser chain, the chorus reads and
+ * interpolation, the modulation generator, and the dry/wet mixes inside them.
+ * A unit hands its loop to run() as a generic lambda. On x86 with GCC or Clang, run() has one copy of it per
+ * instruction set (SSE4.2, AVX2 + FMA, AVX-512) next to the portable one the project flags give, and calls the copy
+ * the CPU supports. It's picked once at load time and can be overridden, e.g. by a benchmark comparing them.
+ * The lambda gets the register width in bytes as a std::integral_constant, for loops that size their groups of
+ * channels to it. The state of every unit is laid out the same for all of them, so the choice can change between
+ * two blocks.
+ *
+ * The instruction sets differ in rounding: AVX2 and AVX-512 fuse multiplications and additions. Deterministic mode
+ * runs the portable copy on every CPU, so the output of a build is bit-identical on every machine it runs on.
+*/
+class CpuDispatch
+{
+public:
+
+    enum InstructionSet
+    {
+        portable = 0, // SSE2 on x86-64, NEON on ARM, or whatever the project flags ask for.
+        sse42,
+        avx2,
+        avx512
+    };
+
+    /** The widest instruction set both this build and the CPU support. */
+    static InstructionSet detect()
+    {
+       #if STONEMISTRESS_MULTI_ISA
+        // Checks that the OS saves the wide registers too, not only that the CPU has them.
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq"))
+            return avx512;
+
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return avx2;
+
+        if (__builtin_cpu_supports("sse4.2"))
+            return sse42;
+       #endif
+
+        return portable;
+    }
+
+    static InstructionSet getInstructionSet()
+    {
+        return static_cast<InstructionSet>(active.load(std::memory_order_relaxed));
+    }
+
+    /** Anything the CPU doesn't support falls back to what detect() returns. Takes effect on the next block. */
+    static void setInstructionSet(InstructionSet newInstructionSet)
+    {
+        active.store(jmin(newInstructionSet, detect()), std::memory_order_relaxed);
+    }
+
+    /** Pins every unit to the portable kernels, for output that is bit-identical across machines. */
+    static void setDeterministic(bool shouldBeDeterministic)
+    {
+        setInstructionSet(shouldBeDeterministic ? portable : detect());
+    }
+
+    static bool isDeterministic() { return getInstructionSet() == portable; }
+
+    static const char* getName(InstructionSet instructionSet)
+    {
+        switch (instructionSet)
+        {
+            case sse42:     return "sse4.2";
+            case avx2:      return "avx2";
+            case avx512:    return "avx512";
+            case portable:
+            default:        return "portable";
+        }
+    }
+
+    /** Parses getName(), returns false if the name isn't one of them. */
+    static bool fromName(const String& name, InstructionSet& result)
+    {
+        for (auto instructionSet : { portable, sse42, avx2, avx512 })
+        {
+            if (name.equalsIgnoreCase(getName(instructionSet)))
+            {
+                result = instructionSet;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /** Calls kernel(registerSize) compiled for the active instruction set. registerSize is a std::integral_constant
+        holding the width of one vector register in bytes: 16 for SSE4.2, 32 for AVX2, 64 for AVX-512, and the width of
+        dsp::SIMDRegister for the portable kernels (16 unless the project is built for AVX2).
+    */
+    template <typename Kernel>
+    static void run(Kernel&& kernel)
+    {
+       #if STONEMISTRESS_MULTI_ISA
+        switch (getInstructionSet())
+        {
+            case avx512:    runAVX512(kernel); return;
+            case avx2:      runAVX2(kernel); return;
+            case sse42:     runSSE42(kernel); return;
+            case portable:  break;
+        }
+       #endif
+
+        kernel(std::integral_constant<int, static_cast<int>(dsp::SIMDRegister<float>::SIMDRegisterSize)>());
+    }
+
+private:
+
+   #if STONEMISTRESS_MULTI_ISA
+    template <typename Kernel>
+    STONEMISTRESS_TARGET("sse4.2") static void runSSE42(Kernel& kernel)                                { kernel(std::integral_constant<int, 16>()); }
+
+    template <typename Kernel>
+    STONEMISTRESS_TARGET("avx2,fma") static void runAVX2(Kernel& kernel)                               { kernel(std::integral_constant<int, 32>()); }
+
+    template <typename Kernel>
+    STONEMISTRESS_TARGET("avx512f,avx512vl,avx512dq,avx2,fma") static void runAVX512(Kernel& kernel)   { kernel(std::integral_constant<int, 64>()); }
+   #endif
+
+    inline static std::atomic<int> active { detect() };
+};
+
+#if STONEMISTRESS_MULTI_ISA
+/*
+ * A register of numLanes values with the interface of dsp::SIMDRegister, for the widths it doesn't have. It's built on
+ * the GCC/Clang vector extensions, so every kernel compiles it for its own instruction set.
+*/
+template <typename SampleType, int numLanes>
+struct WideRegister
+{
+    typedef SampleType Vector __attribute__((vector_size(numLanes * sizeof(SampleType))));
+
+    static WideRegister expand(SampleType value)                    { return { Vector{} + value }; }
+
+    static WideRegister fromRawArray(const SampleType* source)
+    {
+        WideRegister result;
+        std::memcpy(&result.value, source, sizeof(Vector));
+        return result;
+    }
+
+    void copyToRawArray(SampleType* destination) const             { std::memcpy(destination, &value, sizeof(Vector)); }
+    SampleType get(size_t index) const                              { return value[index]; }
+
+    WideRegister operator+ (WideRegister other) const               { return { value + other.value }; }
+    WideRegister operator- (WideRegister other) const               { return { value - other.value }; }
+    WideRegister operator* (WideRegister other) const               { return { value * other.value }; }
+    WideRegister operator* (SampleType scalar) const                { return { value * scalar }; }
+    WideRegister& operator+= (WideRegister other)                   { value += other.value; return *this; }
+
+    Vector value;
+};
+#else
+template <typename SampleType, int numLanes>
+struct WideRegister;
+#endif
+
+/** numLanes values in one register: dsp::SIMDRegister at its own width, which every build has, and WideRegister for
+    the other widths, which only the kernels built for other instruction sets use.
+*/
+template <typename SampleType, int numLanes>
+using LaneRegister = typename std::conditional<numLanes == static_cast<int>(dsp::SIMDRegister<SampleType>::SIMDNumElements),
+                                               dsp::SIMDRegister<SampleType>, WideRegister<SampleType, numLanes>>::type;
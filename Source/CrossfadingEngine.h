@@ -0,0 +1,170 @@
+/*
+  ==============================================================================
+
+    CrossfadingEngine.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "StoneMistressEngine.h"
+
+#define PRESET_CROSSFADE_TIME 0.05
+
+/*
+ * A StoneMistressEngine that can switch to a whole new set of parameters without a click, e.g. a preset.
+ * Most parameters glide on their own, but Color and the oversampling jump, and a preset may change several of them at
+ * once. startCrossfade() makes the spare engine a copy of the running one, state included, and hands it the parameters
+ * from then on: the old one carries on with the old settings while the new one fades in over PRESET_CROSSFADE_TIME.
+ * Both run for that long only, the spare one costs memory but no CPU otherwise.
+ * Both engines are prepared together, so the switch doesn't allocate and can happen on the audio thread.
+*/
+template <typename SampleType>
+class CrossfadingEngine
+{
+public:
+
+    CrossfadingEngine(double defaultRate, double defaultPhaserDepth, double defaultChorusDepth)
+        : engines{ { defaultRate, defaultPhaserDepth, defaultChorusDepth },
+                   { defaultRate, defaultPhaserDepth, defaultChorusDepth } }
+    {
+    }
+
+    ~CrossfadingEngine() {}
+
+    void prepareToPlay(double sampleRate, int samplesPerBlock, int numChannels = 2)
+    {
+        for (auto& engine : engines)
+            engine.prepareToPlay(sampleRate, samplesPerBlock, numChannels);
+
+        fadeBuffer.setSize(numChannels, samplesPerBlock);
+        maxBlockSize = samplesPerBlock;
+        fadeLength = jmax(1, roundToInt(PRESET_CROSSFADE_TIME * sampleRate));
+        fadeRemaining = 0;
+    }
+
+    void releaseResources()
+    {
+        for (auto& engine : engines)
+            engine.releaseResources();
+
+        fadeBuffer.setSize(0, 0);
+        maxBlockSize = 0;
+        fadeRemaining = 0;
+    }
+
+    /** The engine that takes the parameters, the incoming one during a crossfade. Only the audio thread may touch it
+        once prepared.
+    */
+    StoneMistressEngine<SampleType>& getEngine() { return engines[current]; }
+
+    /** Goes to the engine that produces the sound, the incoming one during a crossfade. */
+    void setTelemetry(Telemetry* newTelemetry)
+    {
+        telemetry = newTelemetry;
+        engines[current].setTelemetry(telemetry);
+        engines[1 - current].setTelemetry(nullptr);
+    }
+
+    /** See StoneMistressEngine::setParallelProcessing(), for both engines. */
+    void setParallelProcessing(bool shouldBeParallel)
+    {
+        for (auto& engine : engines)
+            engine.setParallelProcessing(shouldBeParallel);
+    }
+
+    /** See StoneMistressEngine::setChorusInterpolation(), for both engines. */
+    void setChorusInterpolation(ChorusInterpolation::Kernel newKernel)
+    {
+        for (auto& engine : engines)
+            engine.setChorusInterpolation(newKernel);
+    }
+
+    int getLatencyInSamples() const { return engines[current].getLatencyInSamples(); }
+
+    /** See StoneMistressEngine::getLatencyInSamples(int, bool). Both engines are prepared alike, either one knows. */
+    int getLatencyInSamples(int factor, bool linearPhase) const { return engines[0].getLatencyInSamples(factor, linearPhase); }
+
+    bool isCrossfading() const { return fadeRemaining > 0; }
+
+    /** Call before handing the new parameters to getEngine(). Nothing to fade while the engine sleeps or while a
+        crossfade is already running (the caller should wait for it to end), the parameters then go in directly.
+    */
+    void startCrossfade()
+    {
+        if (maxBlockSize == 0 || isCrossfading() || engines[current].isSleeping())
+            return;
+
+        engines[1 - current].copyStateFrom(engines[current]);
+        current = 1 - current;
+        setTelemetry(telemetry);
+        fadeRemaining = fadeLength;
+    }
+
+    /** See StoneMistressEngine::processBlock(). */
+    void processBlock(AudioBuffer<SampleType>& buffer)
+    {
+        const auto numSamples = buffer.getNumSamples();
+
+        if (! isCrossfading())
+        {
+            engines[current].processBlock(buffer);
+            return;
+        }
+
+        auto& incoming = engines[current];
+        auto& outgoing = engines[1 - current];
+        const auto numChannels = jmin(buffer.getNumChannels(), fadeBuffer.getNumChannels());
+
+        // Slices of samplesPerBlock, which is what fadeBuffer holds. The outgoing engine runs on a copy of the input.
+        for (int startSample = 0; startSample < numSamples; startSample += maxBlockSize)
+        {
+            const auto numThisTime = jmin(maxBlockSize, numSamples - startSample);
+
+            if (! isCrossfading())
+            {
+                incoming.processBlock(buffer, startSample, numSamples - startSample);
+                return;
+            }
+
+            for (int ch = 0; ch < numChannels; ++ch)
+                fadeBuffer.copyFrom(ch, 0, buffer, ch, startSample, numThisTime);
+
+            outgoing.processBlock(fadeBuffer, 0, numThisTime);
+            incoming.processBlock(buffer, startSample, numThisTime);
+
+            // Both engines process the same input, so the outputs are correlated and a linear fade keeps the level.
+            const auto numFading = jmin(numThisTime, fadeRemaining);
+            const auto step = SampleType(1) / static_cast<SampleType>(fadeLength);
+            const auto startGain = static_cast<SampleType>(fadeLength - fadeRemaining) * step;
+
+            for (int ch = 0; ch < numChannels; ++ch)
+            {
+                auto* output = buffer.getWritePointer(ch, startSample);
+                const auto* old = fadeBuffer.getReadPointer(ch);
+
+                for (int smp = 0; smp < numFading; ++smp)
+                {
+                    const auto gain = startGain + static_cast<SampleType>(smp) * step;
+                    output[smp] = old[smp] + gain * (output[smp] - old[smp]);
+                }
+            }
+
+            fadeRemaining -= numFading;
+        }
+    }
+
+private:
+
+    StoneMistressEngine<SampleType> engines[2];
+    int current = 0;
+
+    AudioBuffer<SampleType> fadeBuffer; // The outgoing engine's output, one slice.
+    Telemetry* telemetry = nullptr;
+    int maxBlockSize = 0;
+    int fadeLength = 1;
+    int fadeRemaining = 0; // Samples left until the incoming engine is alone.
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CrossfadingEngine)
+};
@@ -10,9 +10,35 @@
 
 #pragma once
 #include <JuceHeader.h>
+#include "CpuDispatch.h"
+#include "DryWet.h"
+#include "Interpolators.h"
+#include "Profiling.h"
 
 #define MAX_DELAY_TIME 0.050
+#define CHORUS_GUARD_SIZE 16 // Samples mirrored past the end of the ring, enough for the widest SIMD register.
+#define CHORUS_MAX_VOICES 8
+#define CHORUS_READ_OFFSET (CHORUS_SINC_TAPS / 2 - 1) // Samples every kernel reads further back than the delay asks for.
 
+/* Modulated delay line with fractional delay interpolation.
+ * The delay memory is a power-of-two ring buffer, indexed with a mask. The first CHORUS_GUARD_SIZE samples are mirrored
+ * right after its end, so that a read starting anywhere in the ring never has to wrap. Every block is written with one
+ * or two contiguous copies, before any of it is read, and the read index and interpolation coefficient of the whole block
+ * are computed in one loop that vectorises. The interpolation kernel is one of ChorusInterpolation, picked at run time.
+ * The all-pass, the default, is recursive and runs sample by sample, all channels in one loop. The FIR kernels run over
+ * the whole block one channel at a time, with the interpolation of consecutive samples side by side in the registers.
+ * Both mix the delayed signal over the dry one as they go.
+ * Every kernel reads CHORUS_READ_OFFSET samples further back than the delay asks for, the most the widest one needs so
+ * that it never reads a tap that isn't written yet. The delay is then the same whatever the kernel: switching kernels,
+ * e.g. from playback to a bounce, changes how accurate the chorus is and not where it sounds.
+ * Any number of channels up to MAX_CHANNELS, each with its own ring and its own modulation channel.
+ * Every channel can read its ring with up to CHORUS_MAX_VOICES voices, each with a modulation channel of its own (see
+ * ModulationGenerator for the layout). A voice adds a read position and an interpolation per sample, computed in the
+ * same loops as the first one: the voices are summed and the sum mixed over the dry signal once.
+ * Read positions are computed in double on the float path too: they run up to twice the ring length, around 2^17 at high
+ * sample rates, where a float only resolves 1/64 of a sample.
+*/
+template <typename SampleType>
 class Chorus
 {
 public:
@@ -24,68 +50,347 @@ public:
 
     ~Chorus() {}
 
-    void prepareToPlay(double newSampleRate, int maxBlockSize)
+    void prepareToPlay(double newSampleRate, int maxBlockSize, int numChannels = 2)
     {
+        jassert(numChannels > 0 && numChannels <= MAX_CHANNELS);
+
         sampleRate = newSampleRate;
-        memorySize = roundToInt(maxDelayTime * sampleRate) + maxBlockSize;
-        delayMemory.setSize(2, memorySize);
+
+        // The block is written ahead of the reads, so the ring holds the longest delay plus one block, and the taps of
+        // the widest kernel.
+        memorySize = nextPowerOfTwo(roundToInt(maxDelayTime * sampleRate) + maxBlockSize + 2 * CHORUS_SINC_TAPS);
+        mask = memorySize - 1;
+        writeIndex = 0;
+
+        delayMemory.setSize(numChannels, memorySize + CHORUS_GUARD_SIZE);
         delayMemory.clear();
+
+        // Every read (voice of a channel) gets room for the most voices, so the count can change without allocating.
+        const auto numReads = numChannels * CHORUS_MAX_VOICES;
+
+        readIndices.resize(static_cast<size_t>(numReads));
+
+        for (auto& indices : readIndices)
+            indices.assign(static_cast<size_t>(maxBlockSize), 0);
+
+        fractions.setSize(numReads, maxBlockSize);
+        mixGains.setSize(2, maxBlockSize);
+        voiceSum.setSize(1, maxBlockSize);
+
+        oldSample.assign(static_cast<size_t>(numReads), SampleType(0));
+
+        ChorusInterpolation::Sinc<SampleType>::prepareTable();
+
+        drywet.prepareToPlay(sampleRate);
     }
 
     void releaseResources()
     {
         delayMemory.setSize(0, 0);
+        readIndices.clear();
+        oldSample.clear();
+
+        fractions.setSize(0, 0);
+        mixGains.setSize(0, 0);
+        voiceSum.setSize(0, 0);
         memorySize = 0;
     }
 
-    void processBlock(AudioBuffer<float>& buffer, AudioBuffer<double>& modulationBuffer)
+    /** @param newMix   0 is dry only, 1 is delayed signal only. */
+    void setMix(double newMix)
     {
-        const auto numSamples = buffer.getNumSamples();
-        const auto numCh = buffer.getNumChannels();
+        drywet.setMix(newMix);
+    }
+
+    /** Takes effect with the next block, from where the previous kernel was and at the same delay (see above). */
+    void setInterpolation(ChorusInterpolation::Kernel newKernel)
+    {
+        jassert(newKernel >= 0 && newKernel < ChorusInterpolation::numKernels);
+        interpolation = newKernel;
+    }
+
+    ChorusInterpolation::Kernel getInterpolation() const { return interpolation; }
+
+    /** Voices read from every channel's delay line, each at its own LFO phase, from the next block on. Their sum is
+        scaled by 1 / numVoices, so the wet signal never gets louder than one voice. The modulation then needs
+        newNumVoices groups of channels. Doesn't allocate.
+    */
+    void setNumVoices(int newNumVoices)
+    {
+        jassert(newNumVoices > 0 && newNumVoices <= CHORUS_MAX_VOICES);
+        newNumVoices = jlimit(1, CHORUS_MAX_VOICES, newNumVoices);
+
+        // Voices that come in start their all-pass from silence.
+        for (size_t read = 0; read < oldSample.size(); ++read)
+            if (static_cast<int>(read % CHORUS_MAX_VOICES) >= numVoices)
+                oldSample[read] = SampleType(0);
+
+        numVoices = newNumVoices;
+    }
+
+    int getNumVoices() const { return numVoices; }
+
+    /** Carries on from where other is, with its mix and kernel: same delay line, same position. Both must have been
+        prepared alike. Doesn't allocate.
+    */
+    void copyStateFrom(const Chorus& other)
+    {
+        jassert(other.memorySize == memorySize && other.delayMemory.getNumChannels() == delayMemory.getNumChannels());
+
+        for (int ch = 0; ch < delayMemory.getNumChannels(); ++ch)
+            FloatVectorOperations::copy(delayMemory.getWritePointer(ch), other.delayMemory.getReadPointer(ch), delayMemory.getNumSamples());
+
+        writeIndex = other.writeIndex;
+        interpolation = other.interpolation;
+        numVoices = other.numVoices;
+        std::copy(other.oldSample.begin(), other.oldSample.end(), oldSample.begin());
+        drywet.copyStateFrom(other.drywet);
+    }
+
+    /** Processes numSamples of the buffer from startSample on, against the first numSamples of the modulation. The
+        chorus' channel 0 is firstChannel of both buffers, so that several can share them (see StoneMistressEngine).
+        With several voices, the modulation holds one group of channels per voice.
+    */
+    void processBlock(AudioBuffer<SampleType>& buffer, AudioBuffer<SampleType>& modulationBuffer, int startSample, int numSamples, int firstChannel = 0)
+    {
+        STONEMISTRESS_TRACE_SCOPE("Chorus::processBlock");
+
+        // The index computation and the FIR kernels vectorise and the all-pass overlaps the channels, all of them gain
+        // from wider registers.
+        CpuDispatch::run([&](auto)
+        {
+            switch (interpolation)
+            {
+                case ChorusInterpolation::linear:   process<ChorusInterpolation::Linear>(buffer, modulationBuffer, startSample, numSamples, firstChannel); break;
+                case ChorusInterpolation::hermite:  process<ChorusInterpolation::Hermite>(buffer, modulationBuffer, startSample, numSamples, firstChannel); break;
+                case ChorusInterpolation::lagrange: process<ChorusInterpolation::Lagrange>(buffer, modulationBuffer, startSample, numSamples, firstChannel); break;
+                case ChorusInterpolation::sinc:     process<ChorusInterpolation::Sinc>(buffer, modulationBuffer, startSample, numSamples, firstChannel); break;
+                case ChorusInterpolation::allPass:
+                case ChorusInterpolation::numKernels:
+                default:                            process<ChorusInterpolation::AllPass>(buffer, modulationBuffer, startSample, numSamples, firstChannel); break;
+            }
+        });
+    }
+
+private:
+
+    template <template <typename> class Kernel>
+    void process(AudioBuffer<SampleType>& buffer, AudioBuffer<SampleType>& modulationBuffer, int startSample, int numSamples, int firstChannel)
+    {
+        static_assert(Kernel<SampleType>::numTaps <= CHORUS_SINC_TAPS, "The read offset is sized for the sinc's taps");
+
+        // The taps start this far before the sample the fraction is counted from, which is itself CHORUS_READ_OFFSET
+        // samples further back than the delay asks for.
+        constexpr int tapOffset = CHORUS_READ_OFFSET + Kernel<SampleType>::numTaps / 2 - 1;
+
+        const auto numCh = jmin(buffer.getNumChannels() - firstChannel, delayMemory.getNumChannels());
+        const auto numModCh = modulationBuffer.getNumChannels();
+        const auto voiceStride = jmax(1, numModCh / numVoices); // Modulation channels per voice.
+
+        jassert(numSamples <= fractions.getNumSamples());
+        jassert(numModCh % numVoices == 0);
+
+        for (int ch = 0; ch < numCh; ++ch)
+        {
+            const auto start = static_cast<double>(writeIndex + memorySize);
+
+            writeBlock(delayMemory.getWritePointer(ch), buffer.getReadPointer(firstChannel + ch, startSample), numSamples);
+
+            for (int voice = 0; voice < numVoices; ++voice)
+            {
+                const auto read = ch * CHORUS_MAX_VOICES + voice;
+                auto indices = readIndices[read].data();
+                auto fraction = fractions.getWritePointer(read);
+                auto modData = modulationBuffer.getReadPointer(jmin(voice * voiceStride + jmin(firstChannel + ch, voiceStride - 1), numModCh - 1));
 
-        auto bufferData = buffer.getArrayOfWritePointers();
+                // Read position of every sample: writeIndex + smp - dt * sampleRate, offset by one ring length so it's never negative.
+                for (int smp = 0; smp < numSamples; ++smp)
+                {
+                    const auto position = start + smp - modData[smp] * sampleRate;
+                    const auto integerPart = static_cast<int>(position);
+                    const auto fractionalPart = static_cast<SampleType>(position - integerPart);
+
+                    indices[smp] = (integerPart - tapOffset) & mask; // The last taps may land in the guard region.
+                    fraction[smp] = Kernel<SampleType>::fromFraction(fractionalPart);
+                }
+            }
+        }
+
+        if constexpr (Kernel<SampleType>::isRecursive)
+            interpolateRecursive<Kernel>(buffer, startSample, numSamples, firstChannel, numCh);
+        else
+            interpolate<Kernel>(buffer, startSample, numSamples, firstChannel, numCh);
+
+        writeIndex = (writeIndex + numSamples) & mask;
+    }
+
+    template <template <typename> class Kernel>
+    void interpolateRecursive(AudioBuffer<SampleType>& buffer, int startSample, int numSamples, int firstChannel, int numCh)
+    {
+        const Kernel<SampleType> kernel;
+        const auto voices = numVoices;
+        const auto voiceGain = SampleType(1) / static_cast<SampleType>(voices);
+        SampleType* bufferData[MAX_CHANNELS];
         auto delayData = delayMemory.getArrayOfWritePointers();
-        auto modData = modulationBuffer.getArrayOfWritePointers();
 
-        auto numModCh = modulationBuffer.getNumChannels();
+        // Reads packed by channel, voices of a channel side by side. Locals, so the stores to the buffer can't alias them.
+        const int* indices[MAX_CHANNELS * CHORUS_MAX_VOICES];
+        const SampleType* coefficient[MAX_CHANNELS * CHORUS_MAX_VOICES];
+        SampleType previous[MAX_CHANNELS * CHORUS_MAX_VOICES];
+
+        for (int ch = 0; ch < numCh; ++ch)
+        {
+            bufferData[ch] = buffer.getWritePointer(firstChannel + ch, startSample);
+
+            for (int voice = 0; voice < voices; ++voice)
+            {
+                indices[ch * voices + voice] = readIndices[ch * CHORUS_MAX_VOICES + voice].data();
+                coefficient[ch * voices + voice] = fractions.getReadPointer(ch * CHORUS_MAX_VOICES + voice);
+                previous[ch * voices + voice] = oldSample[ch * CHORUS_MAX_VOICES + voice];
+            }
+        }
+
+        const auto mixIsSmoothing = drywet.isSmoothing();
+        auto gains = drywet.getCurrentGains();
 
+        // The interpolation is recursive, all channels are kept in one loop so that their dependency chains overlap.
         for (int smp = 0; smp < numSamples; ++smp)
         {
+            if (mixIsSmoothing)
+                gains = drywet.getNextGains();
+
             for (int ch = 0; ch < numCh; ++ch)
             {
-                auto dt = modData[jmin(ch, numModCh - 1)][smp];
+                const auto first = ch * voices;
+                auto sampleValue = kernel(delayData[ch] + indices[first][smp], coefficient[first][smp], previous[first]);
+                previous[first] = sampleValue;
 
-                auto readIndex = writeIndex - (dt * sampleRate);
+                for (int read = first + 1; read < first + voices; ++read)
+                {
+                    const auto voiceValue = kernel(delayData[ch] + indices[read][smp], coefficient[read][smp], previous[read]);
+                    previous[read] = voiceValue;
+                    sampleValue += voiceValue;
+                }
 
-                auto integerPart = static_cast<int>(readIndex);
-                auto fractionalPart = readIndex - integerPart;
+                bufferData[ch][smp] = bufferData[ch][smp] * gains.dry + sampleValue * (gains.wet * voiceGain);
+            }
+        }
 
-                auto A = (integerPart + memorySize) % memorySize;
-                auto B = (A + 1) % memorySize;
-                auto alpha = fractionalPart / (2.0 - fractionalPart);
+        for (int ch = 0; ch < numCh; ++ch)
+            for (int voice = 0; voice < voices; ++voice)
+                oldSample[ch * CHORUS_MAX_VOICES + voice] = previous[ch * voices + voice];
+    }
 
-                delayData[ch][writeIndex] = bufferData[ch][smp];
+    // The gains of a smoothing mix are taken once for the block, then every channel runs over it on its own. A single
+    // voice is mixed straight from the kernel, several are summed voice by voice first.
+    template <template <typename> class Kernel>
+    void interpolate(AudioBuffer<SampleType>& buffer, int startSample, int numSamples, int firstChannel, int numCh)
+    {
+        const Kernel<SampleType> kernel;
+        const auto voiceGain = SampleType(1) / static_cast<SampleType>(numVoices);
+        const auto mixIsSmoothing = drywet.isSmoothing();
+        auto gains = drywet.getCurrentGains();
+        auto dryGains = mixGains.getWritePointer(0);
+        auto wetGains = mixGains.getWritePointer(1);
+        auto sum = voiceSum.getWritePointer(0);
 
-                auto sampleValue = alpha * (delayData[ch][B] - oldSample[ch]) + delayData[ch][A];
-                oldSample[ch] = sampleValue;
+        gains.wet *= voiceGain;
 
-                bufferData[ch][smp] = static_cast<float>(sampleValue);
+        if (mixIsSmoothing)
+        {
+            for (int smp = 0; smp < numSamples; ++smp)
+            {
+                const auto next = drywet.getNextGains();
+                dryGains[smp] = next.dry;
+                wetGains[smp] = next.wet * voiceGain;
             }
+        }
 
-            ++writeIndex %= memorySize;
+        for (int ch = 0; ch < numCh; ++ch)
+        {
+            const auto* delayData = delayMemory.getReadPointer(ch);
+            auto* bufferData = buffer.getWritePointer(firstChannel + ch, startSample);
+
+            auto mix = [&](auto&& wetSample)
+            {
+                if (mixIsSmoothing)
+                {
+                    for (int smp = 0; smp < numSamples; ++smp)
+                        bufferData[smp] = bufferData[smp] * dryGains[smp] + wetSample(smp) * wetGains[smp];
+                }
+                else
+                {
+                    for (int smp = 0; smp < numSamples; ++smp)
+                        bufferData[smp] = bufferData[smp] * gains.dry + wetSample(smp) * gains.wet;
+                }
+            };
+
+            if (numVoices == 1)
+            {
+                const auto* indices = readIndices[ch * CHORUS_MAX_VOICES].data();
+                const auto* fraction = fractions.getReadPointer(ch * CHORUS_MAX_VOICES);
+
+                mix([&](int smp) { return kernel(delayData + indices[smp], fraction[smp]); });
+            }
+            else
+            {
+                for (int voice = 0; voice < numVoices; ++voice)
+                {
+                    const auto* indices = readIndices[ch * CHORUS_MAX_VOICES + voice].data();
+                    const auto* fraction = fractions.getReadPointer(ch * CHORUS_MAX_VOICES + voice);
+
+                    if (voice == 0)
+                        for (int smp = 0; smp < numSamples; ++smp)
+                            sum[smp] = kernel(delayData + indices[smp], fraction[smp]);
+                    else
+                        for (int smp = 0; smp < numSamples; ++smp)
+                            sum[smp] += kernel(delayData + indices[smp], fraction[smp]);
+                }
+
+                mix([sum](int smp) { return sum[smp]; });
+            }
+
+            // Where the all-pass picks up if it's switched to.
+            for (int voice = 0; numSamples > 0 && voice < numVoices; ++voice)
+            {
+                const auto read = ch * CHORUS_MAX_VOICES + voice;
+                oldSample[read] = kernel(delayData + readIndices[read][numSamples - 1], fractions.getSample(read, numSamples - 1));
+            }
         }
     }
 
-private:
+    // Copies one block into the ring at writeIndex, in two pieces if it crosses the end, and refreshes the guard region.
+    void writeBlock(SampleType* delayData, const SampleType* source, int numSamples)
+    {
+        const auto firstPart = jmin(numSamples, memorySize - writeIndex);
+
+        FloatVectorOperations::copy(delayData + writeIndex, source, firstPart);
+
+        if (firstPart < numSamples)
+        {
+            FloatVectorOperations::copy(delayData, source + firstPart, numSamples - firstPart);
+        }
+
+        FloatVectorOperations::copy(delayData + memorySize, delayData, CHORUS_GUARD_SIZE);
+    }
+
+    AudioBuffer<SampleType> delayMemory; // memorySize + CHORUS_GUARD_SIZE samples per channel.
+    std::vector<std::vector<int>> readIndices; // One per read: CHORUS_MAX_VOICES per channel, voice v of channel ch at ch * CHORUS_MAX_VOICES + v.
+    AudioBuffer<SampleType> fractions; // Fraction of every read, or what the kernel makes of it (see fromFraction()).
+    AudioBuffer<SampleType> mixGains; // Dry and wet gains of every sample, while the mix is smoothing.
+    AudioBuffer<SampleType> voiceSum; // The voices of one channel added up, with more than one.
 
-    AudioBuffer<float> delayMemory;
-    
     double sampleRate = 1.0;
     double maxDelayTime;
     int memorySize = 0;
+    int mask = 0;
     int writeIndex = 0;
 
-    float oldSample[2] = { 0.0f, 0.0f };
+    std::vector<SampleType> oldSample; // Last interpolated sample of every read.
+    ChorusInterpolation::Kernel interpolation = ChorusInterpolation::allPass;
+    int numVoices = 1;
+
+    DryWet<SampleType> drywet;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Chorus)
 
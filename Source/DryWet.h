@@ -11,59 +11,78 @@
 #pragma once
 #include <JuceHeader.h>
 
+#define MIX_LEVEL 1.2 // Dry gain + wet gain. At the default 50 % mix both are 0.6, the fixed level the units used to have.
+#define MIX_RAMP_TIME 0.05
+#define MAX_CHANNELS 64 // Widest bus the units process: 7.1.4 is 12 channels, a 7th order Ambisonic bed is 64.
+
+/* Smoothed dry/wet balance of one unit.
+ * The unit mixes inside its own processing loop: it reads the dry sample, computes the wet one and writes
+ * dry * dryGain + wet * wetGain over it. No copy of the dry signal is kept and the buffer is touched once.
+*/
+template <typename SampleType>
 class DryWet
 {
 public:
 
-    DryWet()
+    struct Gains
+    {
+        SampleType dry;
+        SampleType wet;
+    };
+
+    DryWet(double defaultMix = 0.5)
     {
+        mix.setCurrentAndTargetValue(static_cast<SampleType>(defaultMix));
     }
 
     ~DryWet() {}
 
-    void prepareToPlay(int maxBlockSize)
+    /** @param sampleRate   The rate getNextGains() is called at, which is the oversampled one for the phaser. */
+    void prepareToPlay(double sampleRate)
+    {
+        mix.reset(sampleRate, MIX_RAMP_TIME);
+    }
+
+    /** @param newMix   0 is dry only, 1 is wet only. */
+    void setMix(double newMix)
     {
-        drySignal.setSize(2, maxBlockSize);
-        drySignal.clear();
+        mix.setTargetValue(static_cast<SampleType>(jlimit(0.0, 1.0, newMix)));
     }
 
-    void copyDrySignal(AudioBuffer<float>& sourceBuffer)
+    /** Takes over the mix of another unit, ramp included. */
+    void copyStateFrom(const DryWet& other)
     {
-        const int numCh = sourceBuffer.getNumChannels();
-        const int numSamples = sourceBuffer.getNumSamples();
-        for (int ch = 0; ch < numCh; ++ch)
-        {
-            drySignal.copyFrom(ch, 0, sourceBuffer, ch, 0, numSamples);
-        }
+        mix = other.mix;
     }
 
-    /** Mixes dry and wet signal buffers.
-    *  output = (drySignal + outputBuffer) * mixLevel
-    
-        @param outputBuffer     Wet signal.
+    /** While the mix isn't moving the units take getCurrentGains() once per block and keep them in registers, and only
+        call getNextGains() every sample otherwise.
     */
-    void mixDrySignal(AudioBuffer<float>& outputBuffer)
+    bool isSmoothing() const
+    {
+        return mix.isSmoothing();
+    }
+
+    Gains getCurrentGains() const
     {
-        auto numCh = outputBuffer.getNumChannels();
-        auto numSamples = outputBuffer.getNumSamples();
-
-        for (int ch = 0; ch < numCh; ++ch)
-        {
-            outputBuffer.addFrom(ch, 0, drySignal, ch, 0, numSamples);
-        }
-        outputBuffer.applyGain(mixLevel);
+        return toGains(mix.getCurrentValue());
     }
 
-    void releaseResources()
+    /** Gains of the next sample, advances the smoothing by one. */
+    Gains getNextGains()
     {
-        drySignal.setSize(0, 0);
+        return toGains(mix.getNextValue());
     }
 
 private:
 
-    AudioBuffer<float> drySignal;
+    static Gains toGains(SampleType mixValue)
+    {
+        const auto wet = mixValue * static_cast<SampleType>(MIX_LEVEL);
+        return { static_cast<SampleType>(MIX_LEVEL) - wet, wet };
+    }
 
-    float mixLevel = 0.6;
+    SmoothedValue<SampleType> mix;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(DryWet)
 
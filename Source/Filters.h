@@ -10,61 +10,153 @@
 
 #pragma once
 #include <JuceHeader.h>
+#include "CpuDispatch.h"
 
-/* 
- * Creates a simple stereo All Pass Filter with 90° phase shift at selected Break Frequency. The terms "Center Frequency" and 
- * "Cutoff Frequency" are synonyms.
- * AllPass = a*x[n] + x[n - 1] - a*y[n - 1]
+/*
+ * Evaluates the All Pass coefficient a1 = (tan(pi*fb/fs) - 1) / (tan(pi*fb/fs) + 1) for a modulated Break Frequency
+ * without calling tan(). Two identical stages share one coefficient, so the Small Stone only needs one per pair.
+ *
+ * tan(x) is replaced by its [3/2] Pade approximant x*(15 - x^2) / (15 - 6x^2). Substituting it into a1 leaves a single
+ * division: a1 = (N - D) / (N + D), N = x*(15 - x^2), D = 15 - 6x^2.
+ * Maximum absolute error of a1 against the exact double precision formula for fb + modValue in [25, 3050] Hz,
+ * evaluated in float as below:
+ *
+ *      fs [Hz]     44100     48000     88200     96000     176400    192000    352800    384000
+ *      error       1.2e-7    1.1e-7    1.0e-7    1.0e-7    9.7e-8    9.7e-8    9.4e-8    9.4e-8
+ *
+ * The approximation itself contributes 2.0e-8 at 44.1 kHz and less than 2e-10 from 88.2 kHz up, the rest is float
+ * rounding (the previous tan() path was off by 3.8e-8 because of the float pi constant). Evaluated in double, only the
+ * approximation error is left.
 */
-class AllPass {
+class AllPassCoefficient {
 public:
     /*
     * @param defaultBreakFrequency The frequency at which a phase shift of 90° occurs.
     */
-    AllPass(double defaultBreakFrequency = 1000)
+    AllPassCoefficient(double defaultBreakFrequency = 1000)
         : breakFrequency(defaultBreakFrequency)
     {
     }
 
-    ~AllPass() {}
+    ~AllPassCoefficient() {}
+
+    void setBreakFrequency(double newBreakFrequency)
+    {
+        breakFrequency = newBreakFrequency;
+    }
 
-    /** Division is an expensive operation when it comes to machine computation power. Since the All Pass Coefficient calculation
-        involves a division by 1/sampleRate = samplePeriod, it is reasonable to  turn that division into a multiplication.
-        For this reason, the sample period is stored instead.
+    /** Stores pi * samplePeriod, so that the per-sample work is one multiplication before the approximation.
 
         @param newSamplePeriod  New sample period.
     */
     void setSamplePeriod(double newSamplePeriod)
     {
-        samplePeriod = newSamplePeriod;
+        piSamplePeriod = MathConstants<double>::pi * newSamplePeriod;
     }
 
-    float processSample(float x, int ch, double modulation)
+    /** Evaluated in the precision of the modulation signal, float or double. */
+    template <typename SampleType>
+    SampleType getCoefficient(SampleType modValue = 0) const
     {
-        float modCoefficient = calculateCoefficient(modulation);
-
-        float y = modCoefficient * x + x1[ch] - modCoefficient * y1[ch];
+        return fromAngle(static_cast<SampleType>(piSamplePeriod) * (static_cast<SampleType>(breakFrequency) + modValue));
+    }
 
-        x1[ch] = x;
-        y1[ch] = y;
+    /** getCoefficient() for numValues modulation values, in a flat loop that vectorises, division included. The
+        destination may be the source.
+    */
+    template <typename SampleType>
+    void getCoefficients(const SampleType* modValues, SampleType* destination, int numValues) const
+    {
+        // Copied out of the members, which the stores could otherwise alias.
+        const auto scale = static_cast<SampleType>(piSamplePeriod);
+        const auto offset = static_cast<SampleType>(breakFrequency);
 
-        return y;
+        for (int i = 0; i < numValues; ++i)
+            destination[i] = fromAngle(scale * (offset + modValues[i]));
     }
 
-    float calculateCoefficient(float modValue = 0)
+    /** Reference implementation with tan(), kept to measure the approximation against. */
+    double getExactCoefficient(double modValue = 0) const
     {
-        auto tangent = tan(MathConstants<float>::pi * (breakFrequency + modValue) * samplePeriod);
+        auto tangent = std::tan(piSamplePeriod * (breakFrequency + modValue));
         return ((tangent - 1) / (tangent + 1));
     }
 
-
 private:
 
-    std::array<float, 2> y1 = { 0.0f, 0.0f }; // y[n - 1]
-    std::array<float, 2> x1 = { 0.0f, 0.0f }; // x[n - 1]
+    // a1 for x = pi*fb/fs.
+    template <typename SampleType>
+    static SampleType fromAngle(SampleType x)
+    {
+        const auto x2 = x * x;
+
+        const auto numerator = x * (SampleType(15) - x2);
+        const auto denominator = SampleType(15) - SampleType(6) * x2;
 
-    double samplePeriod = 1.0;
+        return (numerator - denominator) / (numerator + denominator);
+    }
+
+    double piSamplePeriod = MathConstants<double>::pi;
     double breakFrequency;
 
-    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AllPass)
-};
\ No newline at end of file
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AllPassCoefficient)
+};
+
+/* 
+ * Creates numLanes pairs of identical All Pass Filters in series, with 90° phase shift each at the Break Frequency set
+ * by their shared coefficient (see AllPassCoefficient), one pair per channel. The terms "Center Frequency" and "Cutoff
+ * Frequency" are synonyms.
+ * AllPass = a*x[n] + x[n - 1] - a*y[n - 1] = a*(x[n] - y[n - 1]) + x[n - 1]
+ *
+ * The pair is one second-order section: with m the output of the first filter and d = x[n] - m[n - 1],
+ *      m[n] = a*d + x[n - 1]
+ *      y[n] = a*(m[n] - y[n - 1]) + m[n - 1] = a^2*d + (a*(x[n - 1] - y[n - 1]) + m[n - 1])
+ * The bracket only depends on the previous sample, so the new input reaches the output in a subtraction and a
+ * multiply-add, half the chain of two filters one after the other. It keeps the state and the rounding of the two
+ * filters though: the direct form a^2*x[n] + 2a*x[n - 1] + x[n - 2] - 2a*y[n - 1] - a^2*y[n - 2] puts a double pole
+ * next to z = 1 at low Break Frequencies, where the float rounding would be amplified by a few thousand.
+ *
+ * The channels are independent recurrences, so each channel is one lane of a register: the state, the input and the
+ * coefficient of all of them are processed with a single instruction per operation. How many lanes depends on the
+ * instruction set the kernel runs with (see CpuDispatch), so the state is loaded from and stored to one slot per
+ * channel around every block, and is only kept in the register in between.
+*/
+template <typename SampleType, int numLanes>
+class AllPassPair {
+public:
+    using Lanes = LaneRegister<SampleType, numLanes>;
+
+    /** All arrays hold one value per lane and are aligned to the register. */
+    void load(const SampleType* inputs, const SampleType* middles, const SampleType* outputs)
+    {
+        x1 = Lanes::fromRawArray(inputs);
+        m1 = Lanes::fromRawArray(middles);
+        y1 = Lanes::fromRawArray(outputs);
+    }
+
+    void store(SampleType* inputs, SampleType* middles, SampleType* outputs) const
+    {
+        x1.copyToRawArray(inputs);
+        m1.copyToRawArray(middles);
+        y1.copyToRawArray(outputs);
+    }
+
+    Lanes processSample(Lanes x, Lanes coefficient)
+    {
+        const auto d = x - m1;
+        const auto m = coefficient * d + x1;
+        const auto y = (coefficient * coefficient) * d + (coefficient * (x1 - y1) + m1);
+
+        x1 = x;
+        m1 = m;
+        y1 = y;
+
+        return y;
+    }
+
+private:
+
+    Lanes x1; // x[n - 1], one lane per channel
+    Lanes m1; // m[n - 1], the output of the first filter
+    Lanes y1; // y[n - 1]
+};
@@ -0,0 +1,181 @@
+/*
+  ==============================================================================
+
+    FrontPanel.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "PanelArtwork.h"
+#include "Theme.h"
+
+#define PANEL_WIDTH 401
+#define PANEL_HEIGHT 477
+
+/*
+ * The pedal face: background artwork, the three knobs and the Color switch, laid out on the 72 dpi grid of the
+ * artwork. It doesn't know the processor, the editor attaches the parameters to its controls.
+ *
+ * Painting is kept cheap for hosts with many editors open:
+ * - The artwork is several times the panel size. It's decoded and rescaled once per display scale factor, with high
+ *   quality, for all the panels of the process (see PanelArtwork). Every frame after that copies the pixels of the
+ *   dirty area only. Until the artwork is decoded, the panel is a plain face with working controls.
+ * - The knobs and the switch are buffered components: each one is redrawn only when it changes, and a change
+ *   repaints its own bounds rather than the whole panel.
+*/
+class FrontPanel : public Component, private ChangeListener
+{
+public:
+
+    explicit FrontPanel(PanelArtwork& sharedArtwork)
+        : artwork(sharedArtwork), switchLayer(colorSwitch, artwork)
+    {
+        setOpaque(true);
+        setLookAndFeel(&myTheme);
+
+        setupSlider(rateSlider, 343.5, 114.8, 51.4);
+        setupSlider(phaserDepthSlider, 93.2, 166.2, 51.4);
+        setupSlider(chorusDepthSlider, 100, 263.9, 51.4);
+
+        // The switch picture is drawn under an invisible button, so that the button keeps the click area it always had.
+        addAndMakeVisible(switchLayer);
+        setupToggle(colorSwitch, 132.6, 325.76, 33.16);
+
+        // Only the switch picture changes, host automation goes through here too.
+        colorSwitch.onClick = [this]()
+            {
+                switchLayer.repaint();
+            };
+
+        setSize(PANEL_WIDTH, PANEL_HEIGHT);
+
+        artwork.addChangeListener(this);
+        artwork.load();
+    }
+
+    ~FrontPanel() override
+    {
+        artwork.removeChangeListener(this);
+        setLookAndFeel(nullptr);
+    }
+
+    void paint(Graphics& g) override
+    {
+        const auto scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+
+        if (scale != backgroundScale && artwork.isLoaded())
+        {
+            backgroundScale = scale;
+            scaledBackground = artwork.getScaledBackground(roundToInt(getWidth() * scale), roundToInt(getHeight() * scale));
+        }
+
+        if (scaledBackground.isNull())
+        {
+            g.fillAll(getLookAndFeel().findColour(ResizableWindow::backgroundColourId));
+            return;
+        }
+
+        // One physical pixel per image pixel: a plain copy, clipped to the dirty area.
+        g.drawImageTransformed(scaledBackground, AffineTransform::scale(static_cast<float>(getWidth()) / static_cast<float>(scaledBackground.getWidth()),
+                                                                         static_cast<float>(getHeight()) / static_cast<float>(scaledBackground.getHeight())));
+    }
+
+    /** What a click on the Color switch repaints. */
+    Rectangle<int> getColorSwitchArea() const
+    {
+        return switchLayer.getBounds().getUnion(colorSwitch.getBounds());
+    }
+
+    void resized() override
+    {
+        backgroundScale = 0.0f; // Rescaled on the next paint.
+    }
+
+    Slider rateSlider;
+    Slider phaserDepthSlider;
+    Slider chorusDepthSlider;
+    ToggleButton colorSwitch;
+
+private:
+
+    // The picture of the Color switch, up or down with the toggle state. Its bounds cover both positions.
+    class SwitchLayer : public Component
+    {
+    public:
+        SwitchLayer(const ToggleButton& toggle, const PanelArtwork& sharedArtwork)
+            : button(toggle), artwork(sharedArtwork)
+        {
+            setInterceptsMouseClicks(false, false);
+            setBufferedToImage(true);
+            setBounds(onArea.getUnion(offArea).getSmallestIntegerContainer());
+        }
+
+        void paint(Graphics& g) override
+        {
+            if (! artwork.isLoaded())
+                return;
+
+            const auto isOn = button.getToggleState();
+            const auto& image = isOn ? artwork.getImages().switchOn : artwork.getImages().switchOff;
+
+            if (image.isValid())
+                g.drawImage(image, (isOn ? onArea : offArea) - getPosition().toFloat());
+        }
+
+    private:
+
+        const ToggleButton& button;
+        const PanelArtwork& artwork;
+
+        // Where the two pictures sit on the panel.
+        const Rectangle<float> onArea { 134.76f, 320.8f, 26.13f, 35.4f };
+        const Rectangle<float> offArea { 132.6f, 333.43f, 28.23f, 28.46f };
+
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SwitchLayer)
+    };
+
+    // The artwork is in: the switch layer caches what it drew without it.
+    void changeListenerCallback(ChangeBroadcaster*) override
+    {
+        backgroundScale = 0.0f;
+        switchLayer.repaint();
+        repaint();
+    }
+
+    // x, y: centre of the knob on the artwork. side: its diameter on the artwork.
+    void setupSlider(Slider& slider, int x, int y, int side)
+    {
+        float dpiScale = 300 / 72;
+
+        int correctedSide = side * dpiScale * 0.38;
+
+        int correctedX = x - (correctedSide * 0.5);
+        int correctedY = y - (correctedSide * 0.5);
+
+        slider.setSliderStyle(Slider::SliderStyle::RotaryVerticalDrag);
+        slider.setTextBoxStyle(Slider::NoTextBox, false, 80, 20);
+        slider.setBufferedToImage(true);
+        addAndMakeVisible(slider);
+
+        slider.setBounds(correctedX, correctedY, correctedSide, correctedSide);
+    }
+
+    void setupToggle(ToggleButton& toggle, int x, int y, int side)
+    {
+        toggle.setClickingTogglesState(true);
+        toggle.setBounds(x + 8, y, side, side);
+        addAndMakeVisible(toggle);
+    }
+
+    MyLookAndFeel myTheme;
+
+    PanelArtwork& artwork;
+    Image scaledBackground; // The artwork's background at the physical size of the panel.
+    float backgroundScale = 0.0f;
+
+    SwitchLayer switchLayer;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(FrontPanel)
+};
@@ -0,0 +1,263 @@
+/*
+  ==============================================================================
+
+    Interpolators.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+#define CHORUS_SINC_TAPS 8
+#define CHORUS_SINC_PHASES 256 // Fractions the sinc weights are tabulated for, the ones in between are interpolated.
+#define CHORUS_SINC_BETA 6.0 // Kaiser window, the flattest error up to a quarter of the sample rate for 8 taps.
+
+/*
+ * The fractional delay interpolators the Chorus reads its delay line with, from the cheapest to the most accurate.
+ * Each kernel is a policy the chorus loop is compiled for: it reads numTaps samples from taps[0] on and returns the
+ * value fraction past taps[numTaps / 2 - 1]. The chorus picks one at run time (see Chorus::setInterpolation()).
+ *
+ * All but the all-pass are FIR: the output only depends on the taps, so the chorus runs them over the whole block in
+ * one loop that vectorises. They are interpolating too, a fraction of 0 returns the tap exactly and ignores the others,
+ * which is what lets the chorus read taps it hasn't written yet at zero delay. The all-pass is recursive, its output
+ * depends on the previous one, and is the one the chorus always had.
+*/
+struct ChorusInterpolation
+{
+    enum Kernel
+    {
+        linear,
+        allPass,
+        hermite,
+        lagrange,
+        sinc,
+        numKernels
+    };
+
+    /** The worst error against an ideal fractional delay over every fraction and up to an eighth of the sample rate
+        (6 kHz at 48 kHz), in dB below the signal. The kernels are listed by cost, each one is more accurate too.
+        Measured by StoneMistressBenchmark, which fails if they no longer match, and rounded up to the next 0.1 dB so
+        that no kernel is less accurate than stated.
+    */
+    static double getError(Kernel kernel)
+    {
+        static constexpr double errors[numKernels] = { -22.3, -35.8, -40.6, -41.4, -59.9 };
+        return errors[kernel];
+    }
+
+    /** The cheapest kernel whose error is at most maxError dB, the sinc if none is that accurate. */
+    static Kernel pick(double maxError)
+    {
+        for (int kernel = 0; kernel < numKernels; ++kernel)
+            if (getError(static_cast<Kernel>(kernel)) <= maxError)
+                return static_cast<Kernel>(kernel);
+
+        return sinc;
+    }
+
+    static const char* getName(Kernel kernel)
+    {
+        static const char* const names[numKernels] = { "linear", "allpass", "hermite", "lagrange", "sinc" };
+        return names[kernel];
+    }
+
+    static bool fromName(const String& name, Kernel& result)
+    {
+        for (int kernel = 0; kernel < numKernels; ++kernel)
+        {
+            if (name.equalsIgnoreCase(getName(static_cast<Kernel>(kernel))))
+            {
+                result = static_cast<Kernel>(kernel);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    //==============================================================================
+    template <typename SampleType>
+    struct Linear
+    {
+        static constexpr int numTaps = 2;
+        static constexpr bool isRecursive = false;
+
+        static SampleType fromFraction(SampleType fraction) { return fraction; }
+
+        SampleType operator()(const SampleType* taps, SampleType fraction) const
+        {
+            return taps[0] + fraction * (taps[1] - taps[0]);
+        }
+    };
+
+    // First order, with unity gain at every frequency. The coefficient comes from the fraction, the chorus keeps the
+    // previous output of every channel.
+    template <typename SampleType>
+    struct AllPass
+    {
+        static constexpr int numTaps = 2;
+        static constexpr bool isRecursive = true;
+
+        static SampleType fromFraction(SampleType fraction) { return fraction / (SampleType(2) - fraction); }
+
+        SampleType operator()(const SampleType* taps, SampleType alpha, SampleType previous) const
+        {
+            return alpha * (taps[1] - previous) + taps[0];
+        }
+    };
+
+    // Catmull-Rom spline: third order, with a continuous slope from one sample to the next.
+    template <typename SampleType>
+    struct Hermite
+    {
+        static constexpr int numTaps = 4;
+        static constexpr bool isRecursive = false;
+
+        static SampleType fromFraction(SampleType fraction) { return fraction; }
+
+        SampleType operator()(const SampleType* taps, SampleType t) const
+        {
+            const auto c1 = SampleType(0.5) * (taps[2] - taps[0]);
+            const auto c2 = taps[0] - SampleType(2.5) * taps[1] + SampleType(2) * taps[2] - SampleType(0.5) * taps[3];
+            const auto c3 = SampleType(0.5) * (taps[3] - taps[0]) + SampleType(1.5) * (taps[1] - taps[2]);
+
+            return ((c3 * t + c2) * t + c1) * t + taps[1];
+        }
+    };
+
+    // The third order polynomial through the four taps.
+    template <typename SampleType>
+    struct Lagrange
+    {
+        static constexpr int numTaps = 4;
+        static constexpr bool isRecursive = false;
+
+        static SampleType fromFraction(SampleType fraction) { return fraction; }
+
+        SampleType operator()(const SampleType* taps, SampleType d) const
+        {
+            const auto dPlusOne = d + SampleType(1);
+            const auto dMinusOne = d - SampleType(1);
+            const auto dMinusTwo = d - SampleType(2);
+
+            return (- d * dMinusOne * dMinusTwo * taps[0] + dPlusOne * d * dMinusOne * taps[3]) * SampleType(1.0 / 6.0)
+                 + (dPlusOne * dMinusOne * dMinusTwo * taps[1] - dPlusOne * d * dMinusTwo * taps[2]) * SampleType(0.5);
+        }
+    };
+
+    // Kaiser windowed sinc, with the weights of CHORUS_SINC_PHASES + 1 fractions tabulated and blended linearly. The
+    // taps are summed in two halves a register wide, so that the products vectorise without reordering the additions.
+    template <typename SampleType>
+    struct Sinc
+    {
+        static_assert(CHORUS_SINC_TAPS == 8, "The sum below is written out for 8 taps");
+
+        static constexpr int numTaps = CHORUS_SINC_TAPS;
+        static constexpr bool isRecursive = false;
+
+        static SampleType fromFraction(SampleType fraction) { return fraction; }
+
+        SampleType operator()(const SampleType* taps, SampleType fraction) const
+        {
+            const auto position = fraction * static_cast<SampleType>(CHORUS_SINC_PHASES);
+            const auto phase = jmin(static_cast<int>(position), CHORUS_SINC_PHASES - 1); // A fraction rounded up to 1 in float.
+            const auto blend = position - static_cast<SampleType>(phase);
+            const auto* lower = table.weights[phase];
+            const auto* upper = table.weights[phase + 1];
+
+            SampleType halves[numTaps / 2];
+
+            for (int k = 0; k < numTaps / 2; ++k)
+            {
+                const auto first = lower[k] + blend * (upper[k] - lower[k]);
+                const auto second = lower[k + numTaps / 2] + blend * (upper[k + numTaps / 2] - lower[k + numTaps / 2]);
+                halves[k] = taps[k] * first + taps[k + numTaps / 2] * second;
+            }
+
+            return (halves[0] + halves[1]) + (halves[2] + halves[3]);
+        }
+
+        /** Builds the table, once per process. Call it before the audio thread first runs the kernel. */
+        static void prepareTable() { getTable(); }
+
+    private:
+
+        struct Table
+        {
+            Table()
+            {
+                for (int phase = 0; phase <= CHORUS_SINC_PHASES; ++phase)
+                {
+                    const auto fraction = static_cast<double>(phase) / CHORUS_SINC_PHASES;
+                    const auto sine = sinPi(fraction);
+                    double raw[numTaps];
+                    double sum = 0.0;
+
+                    for (int k = 0; k < numTaps; ++k)
+                    {
+                        const auto x = fraction + (numTaps / 2 - 1) - k; // Distance from tap k to the fractional position.
+                        const auto u = x / (numTaps / 2);
+                        const auto window = std::abs(u) < 1.0 ? besselI0(CHORUS_SINC_BETA * std::sqrt(1.0 - u * u)) / besselI0(CHORUS_SINC_BETA) : 0.0;
+
+                        // sin(pi (fraction + n)) is (-1)^n sin(pi fraction).
+                        const auto sineOfX = (numTaps / 2 - 1 - k) % 2 == 0 ? sine : -sine;
+
+                        raw[k] = (x == 0.0 ? 1.0 : sineOfX / (MathConstants<double>::pi * x)) * window;
+                        sum += raw[k];
+                    }
+
+                    // Unity gain at DC. Whole fractions get exactly one tap, so the kernel stays interpolating.
+                    for (int k = 0; k < numTaps; ++k)
+                    {
+                        if (phase == 0 || phase == CHORUS_SINC_PHASES)
+                            raw[k] = (k == numTaps / 2 - 1 + phase / CHORUS_SINC_PHASES) ? 1.0 : 0.0;
+                        else
+                            raw[k] /= sum;
+
+                        weights[phase][k] = static_cast<SampleType>(raw[k]);
+                    }
+                }
+            }
+
+            // sin(pi x) for x in [0, 1], summed as its Taylor series rather than taken from std::sin, whose result glibc
+            // picks by CPU: the table, and the renders read through it, come out the same on every machine.
+            static double sinPi(double x)
+            {
+                const auto t = MathConstants<double>::pi * jmin(x, 1.0 - x);
+                auto sum = t, term = t;
+
+                for (int k = 1; k < 12; ++k)
+                {
+                    term *= -t * t / ((2 * k) * (2 * k + 1));
+                    sum += term;
+                }
+
+                return sum;
+            }
+
+            static double besselI0(double x)
+            {
+                auto sum = 1.0, term = 1.0;
+
+                for (int k = 1; k < 32; ++k)
+                {
+                    term *= (x * 0.5 / k) * (x * 0.5 / k);
+                    sum += term;
+                }
+
+                return sum;
+            }
+
+            alignas(64) SampleType weights[CHORUS_SINC_PHASES + 1][numTaps];
+        };
+
+        static const Table& getTable()
+        {
+            static const Table instance;
+            return instance;
+        }
+
+        const Table& table = getTable();
+    };
+};
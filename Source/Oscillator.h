@@ -10,23 +10,45 @@
 
 #pragma once
 #include <JuceHeader.h>
+#include "Delays.h"
+#include "Profiling.h"
 #define CHORUS_DELAY_TIME 0.010
 
-class LFO
+/*
+ * The triangle LFO, the phaser and chorus depths and the chorus clamp in one pass: every sample of both modulation
+ * signals is written at once, straight from the LFO phase.
+ * For phase p in [0, 1) the triangle scaled to [0, +1] is 1 - 2|p - 0.5|, so no floor() is needed. While the rate is
+ * steady the phase of sample n is p0 + n * increment, and the depth ramps are linear with a closed form too, so no
+ * sample depends on the previous one and the loop vectorises. Only while the rate itself is gliding the phase is
+ * accumulated sample by sample.
+ * Every channel reads the LFO at its own phase offset. By default they are spread evenly around the cycle, so stereo
+ * keeps left and right half a cycle apart and wider beds get a sweep that travels around the speakers.
+ * The chorus modulation may hold several voices per channel (see Chorus::setNumVoices()): a whole number of groups of
+ * channels, voice v of every channel in group v. The voices of a channel are spread evenly over the gap to the next
+ * channel, so that in stereo two voices per side sweep at four phases a quarter of a cycle apart.
+*/
+template <typename SampleType>
+class ModulationGenerator
 {
 public:
-	LFO(double defaultRate = 7.0, double defaultPhaseDelta = 0.5)
+	ModulationGenerator(double defaultRate = 7.0, double defaultPhaserDepth = 0.030, double defaultChorusDepth = 0.0)
 	{
-		rate.setTargetValue(defaultRate);
-		phaseDelta = defaultPhaseDelta;
+		rate.setCurrentAndTargetValue(defaultRate);
+		phaserDepth.setCurrentAndTargetValue(static_cast<SampleType>(defaultPhaserDepth));
+		chorusDepth.setCurrentAndTargetValue(static_cast<SampleType>(defaultChorusDepth));
+		spreadPhaseOffsets(2);
 	}
 
-	~LFO() {}
+	~ModulationGenerator() {}
 
-	void prepareToPlay(double sampleRate)
+	/** Also spreads the phase offsets of numChannels evenly, channel ch starts at ch / numChannels of the cycle. */
+	void prepareToPlay(double sampleRate, int numChannels = 2)
 	{
 		rate.reset(sampleRate, 0.02);
+		phaserDepth.reset(sampleRate, 0.02);
+		chorusDepth.reset(sampleRate, 0.2);
 		samplePeriod = 1.0 / sampleRate;
+		spreadPhaseOffsets(numChannels);
 	}
 
 	void setRate(double newValue)
@@ -36,102 +58,250 @@ public:
 		rate.setTargetValue(newValue);
 	}
 
-	/* Left Channel/Channel 0 = Chorus Unit.
-	   Right Channel/Channel 1 = Phaser Unit.
+	void setPhaserDepth(double newValue)	{ phaserDepth.setTargetValue(static_cast<SampleType>(newValue)); }
+	void setChorusDepth(double newValue)	{ chorusDepth.setTargetValue(static_cast<SampleType>(newValue)); }
+
+	/** @param channel	Modulation channel, below MAX_CHANNELS.
+		@param offset	Fraction of the LFO cycle the channel is ahead of channel 0, in [0, 1).
 	*/
-	void getNextAudioBlock(AudioBuffer<double>& buffer, const int numSamples)
+	void setPhaseOffset(int channel, double offset)
 	{
-		auto data = buffer.getArrayOfWritePointers();
-
-		for (int smp = 0; smp < numSamples; ++smp)
-		{
-			double leftSample = 0.0f;
-			double rightSample = 0.0f;
-
-			getNextAudioSample(leftSample, rightSample);
+		jassert(isPositiveAndBelow(channel, MAX_CHANNELS));
+		phaseOffsets[channel] = static_cast<SampleType>(offset - std::floor(offset));
+	}
 
-			data[0][smp] = leftSample;
-			data[1][smp] = rightSample;
-		}
+	/** Carries on from where other is: same phase, rate, depths and ramps. */
+	void copyStateFrom(const ModulationGenerator& other)
+	{
+		rate = other.rate;
+		phaserDepth = other.phaserDepth;
+		chorusDepth = other.chorusDepth;
+		currentPhase = other.currentPhase;
+		samplePeriod = other.samplePeriod;
+		std::copy(std::begin(other.phaseOffsets), std::end(other.phaseOffsets), std::begin(phaseOffsets));
+		numSpreadChannels = other.numSpreadChannels;
 	}
 
-	void getNextAudioSample(double& leftSample, double& rightSample)
+	/** Writes numSamples of both modulation signals, one channel per audio channel, each at its own phase offset.
+
+		@param phaserModulation		LFO scaled by the phaser depth, in Hz.
+		@param chorusModulation		LFO scaled by the chorus depth and clamped to MAX_DELAY_TIME, in seconds. With a
+									multiple of the phaser's channels, one group of them per chorus voice.
+	*/
+	void getNextAudioBlock(AudioBuffer<SampleType>& phaserModulation, AudioBuffer<SampleType>& chorusModulation, const int numSamples)
 	{
-		// Small Stone LFO Is a Triangle Wave
-		leftSample = 4.0 * abs(currentPhase - std::floor(currentPhase + 0.5)) - 1.0;
-		rightSample = 4.0 * abs((currentPhase + phaseDelta) - std::floor(currentPhase + phaseDelta + 0.5)) - 1.0;
+		STONEMISTRESS_TRACE_SCOPE("ModulationGenerator::getNextAudioBlock");
 
-		phaseIncrement = rate.getNextValue() * samplePeriod;
-		currentPhase += phaseIncrement;
-		currentPhase -= static_cast<int>(currentPhase);
-	}
+		const auto numChannels = jmin(phaserModulation.getNumChannels(), chorusModulation.getNumChannels(), MAX_CHANNELS);
+		const auto numVoices = chorusModulation.getNumChannels() / jmax(1, numChannels);
+		const auto voiceSpacing = SampleType(1) / static_cast<SampleType>(numVoices * numSpreadChannels);
+		auto phaserData = phaserModulation.getArrayOfWritePointers();
+		auto chorusData = chorusModulation.getArrayOfWritePointers();
 
-private:
-	SmoothedValue<double, ValueSmoothingTypes::Multiplicative> rate;
+		// Local copies, so the compiler can tell that writing the output doesn't change them.
+		const Block block{ phaserDepth, chorusDepth };
 
-	double currentPhase = 0;
-	double phaseIncrement = 0;
-	double samplePeriod = 1.0;
-	double phaseDelta = 0.5;
+		if (! rate.isSmoothing())
+		{
+			const auto phaseIncrement = rate.getTargetValue() * samplePeriod;
+			const auto startPhase = static_cast<SampleType>(currentPhase);
+			const auto increment = static_cast<SampleType>(phaseIncrement);
 
-	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LFO)
-};
+			// One channel at a time, so the inner loop only has two output streams and still vectorises, as wide as
+			// the CPU allows.
+			CpuDispatch::run([&](auto)
+			{
+				for (int ch = 0; ch < numChannels; ++ch)
+				{
+					const auto phaser = phaserData[ch];
+					const auto chorus = chorusData[ch];
+					const auto offset = phaseOffsets[ch];
 
-class ParameterModulation {
-public:
+					for (int smp = 0; smp < numSamples; ++smp)
+					{
+						auto phase = startPhase + increment * smp;
+						phase -= static_cast<int>(phase);
 
-	ParameterModulation(const double defaultPhaserDepth = 0.030, const double defaultChorusDepth = 0.0)
-	{
-		phaserDepth.setCurrentAndTargetValue(defaultPhaserDepth);
-		chorusDepth.setCurrentAndTargetValue(defaultChorusDepth);
-	}
+						block.writeSample(phaser, chorus, smp, phase, offset);
+					}
 
-	~ParameterModulation() {}
+					// Further voices only add a chorus stream each.
+					for (int voice = 1; voice < numVoices; ++voice)
+					{
+						const auto voiceChorus = chorusData[voice * numChannels + ch];
+						const auto voiceOffset = getVoiceOffset(offset, voice, voiceSpacing);
 
-	void prepareToPlay(double sampleRate)
-	{
-		phaserDepth.reset(sampleRate, 0.02);
-		chorusDepth.reset(sampleRate, 0.2);
+						for (int smp = 0; smp < numSamples; ++smp)
+						{
+							auto phase = startPhase + increment * smp;
+							phase -= static_cast<int>(phase);
+
+							block.writeChorusSample(voiceChorus, smp, phase, voiceOffset);
+						}
+					}
+				}
+			});
+
+			// The phase itself is carried in double from block to block, so it doesn't drift on the float path.
+			currentPhase += phaseIncrement * numSamples;
+			currentPhase -= static_cast<int>(currentPhase);
+		}
+		else
+		{
+			for (int smp = 0; smp < numSamples; ++smp)
+			{
+				for (int ch = 0; ch < numChannels; ++ch)
+				{
+					block.writeSample(phaserData[ch], chorusData[ch], smp, static_cast<SampleType>(currentPhase), phaseOffsets[ch]);
+
+					for (int voice = 1; voice < numVoices; ++voice)
+						block.writeChorusSample(chorusData[voice * numChannels + ch], smp, static_cast<SampleType>(currentPhase),
+												getVoiceOffset(phaseOffsets[ch], voice, voiceSpacing));
+				}
+
+				currentPhase += rate.getNextValue() * samplePeriod;
+				currentPhase -= static_cast<int>(currentPhase);
+			}
+		}
+
+		phaserDepth.skip(numSamples);
+		chorusDepth.skip(numSamples);
 	}
 
-	void setPhaserDepth(const double newValue)
+	/** The LFO of channel 0, from 0 to 1, numSamples into the next block at the current rate: negative values look back
+		into the block just generated. For displays, a rate change still being smoothed isn't followed.
+	*/
+	double getLfoValue(int numSamples) const
 	{
-		phaserDepth.setTargetValue(newValue);
+		auto phase = currentPhase + rate.getCurrentValue() * samplePeriod * numSamples;
+		phase -= std::floor(phase);
+
+		return 1.0 - 2.0 * std::abs(phase - 0.5);
 	}
 
-	void setChorusDepth(const double newValue)
+	/** Advances the generator by numSamples without writing anything, so that the sweep stays in time while the
+		engine sleeps. Only a rate change still being smoothed is stepped through, the rest is one multiplication.
+	*/
+	void skip(int numSamples)
 	{
-		chorusDepth.setTargetValue(newValue);
+		int smp = 0;
+
+		for (; smp < numSamples && rate.isSmoothing(); ++smp)
+			currentPhase += rate.getNextValue() * samplePeriod;
+
+		currentPhase += rate.getTargetValue() * samplePeriod * (numSamples - smp);
+		currentPhase -= std::floor(currentPhase);
+
+		phaserDepth.skip(numSamples);
+		chorusDepth.skip(numSamples);
 	}
 
-	void processBlock(AudioBuffer<double>& buffer, const int numSamples, const String unit)
+private:
+
+	// Linear SmoothedValue that can be evaluated at any sample of the block: value(n) is what the n+1-th
+	// getNextValue() call would return.
+	struct LinearRamp
 	{
-		auto data = buffer.getArrayOfWritePointers();
-		const auto numCh = buffer.getNumChannels();
+		void reset(double sampleRate, double rampLengthInSeconds)
+		{
+			stepsToTarget = static_cast<int>(std::floor(rampLengthInSeconds * sampleRate));
+			setCurrentAndTargetValue(target);
+		}
 
-		for (int ch = 0; ch < numCh; ++ch)
+		void setCurrentAndTargetValue(SampleType newValue)
 		{
-			FloatVectorOperations::add(data[ch], 1.0, numSamples); // At this stage, LFO is in range [0, +2]
-			FloatVectorOperations::multiply(data[ch], 0.5, numSamples); // At this stage, LFO is in range [0, +1]
+			current = target = newValue;
+			countdown = 0;
 		}
 
-		if (unit == "p")
+		void setTargetValue(SampleType newValue)
 		{
-			phaserDepth.applyGain(data[0], numSamples);
-			phaserDepth.applyGain(data[1], numSamples);
+			if (newValue == target)
+				return;
+
+			if (stepsToTarget <= 0)
+			{
+				setCurrentAndTargetValue(newValue);
+				return;
+			}
+
+			target = newValue;
+			countdown = stepsToTarget;
+			step = (target - current) / countdown;
 		}
-		else if (unit == "c")
+
+		SampleType value(int smp) const { return smp < countdown - 1 ? current + step * (smp + 1) : target; }
+
+		void skip(int numSamples)
 		{
-			chorusDepth.applyGain(data[0], numSamples);
-			chorusDepth.applyGain(data[1], numSamples);
+			if (numSamples >= countdown)
+			{
+				setCurrentAndTargetValue(target);
+				return;
+			}
+
+			current += step * numSamples;
+			countdown -= numSamples;
 		}
+
+		SampleType current = 0, target = 0, step = 0;
+		int countdown = 0;
+		int stepsToTarget = 0;
+	};
+
+	// The depth ramps as they stand at the start of the block, everything one sample of the fused pass needs.
+	struct Block
+	{
+		void writeSample(SampleType* phaser, SampleType* chorus, int smp, SampleType phase, SampleType offset) const
+		{
+			auto shiftedPhase = phase + offset;
+			shiftedPhase -= static_cast<int>(shiftedPhase);
+
+			const auto triangle = SampleType(1) - SampleType(2) * std::abs(shiftedPhase - SampleType(0.5));
+
+			phaser[smp] = triangle * phaserDepth.value(smp);
+			chorus[smp] = jmin(triangle * chorusDepth.value(smp), static_cast<SampleType>(MAX_DELAY_TIME));
+		}
+
+		void writeChorusSample(SampleType* chorus, int smp, SampleType phase, SampleType offset) const
+		{
+			auto shiftedPhase = phase + offset;
+			shiftedPhase -= static_cast<int>(shiftedPhase);
+
+			const auto triangle = SampleType(1) - SampleType(2) * std::abs(shiftedPhase - SampleType(0.5));
+
+			chorus[smp] = jmin(triangle * chorusDepth.value(smp), static_cast<SampleType>(MAX_DELAY_TIME));
+		}
+
+		LinearRamp phaserDepth;
+		LinearRamp chorusDepth;
+	};
+
+	// In [0, 1), like the channel offsets.
+	static SampleType getVoiceOffset(SampleType channelOffset, int voice, SampleType voiceSpacing)
+	{
+		const auto offset = channelOffset + voiceSpacing * static_cast<SampleType>(voice);
+		return offset - static_cast<SampleType>(static_cast<int>(offset));
 	}
 
-private:
+	void spreadPhaseOffsets(int numChannels)
+	{
+		jassert(numChannels > 0 && numChannels <= MAX_CHANNELS);
+
+		numSpreadChannels = numChannels;
+
+		for (int ch = 0; ch < MAX_CHANNELS; ++ch)
+			phaseOffsets[ch] = static_cast<SampleType>(static_cast<double>(ch % numChannels) / numChannels);
+	}
 
-	SmoothedValue<double, ValueSmoothingTypes::Linear> phaserDepth;
-	SmoothedValue<double, ValueSmoothingTypes::Linear> chorusDepth;
+	SmoothedValue<double, ValueSmoothingTypes::Multiplicative> rate;
+	LinearRamp phaserDepth;
+	LinearRamp chorusDepth;
 
-	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ParameterModulation)
+	double currentPhase = 0;
+	double samplePeriod = 1.0;
+	SampleType phaseOffsets[MAX_CHANNELS]; // Fraction of the cycle every channel is ahead of channel 0.
+	int numSpreadChannels = 2; // Channels the offsets were last spread over, the voices of each fill the gap between two.
 
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ModulationGenerator)
 };
\ No newline at end of file
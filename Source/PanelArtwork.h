@@ -0,0 +1,132 @@
+/*
+  ==============================================================================
+
+    PanelArtwork.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+/*
+ * The pictures of the pedal face, shared by every FrontPanel of the process.
+ * Decoding them takes longer than building the rest of an editor, so it happens once, on a background thread, when the
+ * first panel asks for them. Panels paint a plain face until then, and are told when the pictures are in.
+ * The backgrounds rescaled for the screen (see FrontPanel) are kept here as well, one per size, so that further
+ * editors at the same display scale have their first frame ready.
+ * Everything but the decoding happens on the message thread.
+*/
+class PanelArtwork : public ChangeBroadcaster
+{
+public:
+
+    struct Images
+    {
+        Image background;
+        Image switchOn;
+        Image switchOff;
+    };
+
+    /** Called once, on the background thread. */
+    using Decoder = std::function<Images()>;
+
+    explicit PanelArtwork(Decoder decoderToUse)
+        : decoder(std::move(decoderToUse)), decodeThread(*this)
+    {
+    }
+
+    ~PanelArtwork() override
+    {
+        decodeThread.stopThread(-1);
+    }
+
+    /** Starts decoding, unless it was started before. A change message is sent when it's done. */
+    void load()
+    {
+        if (started)
+            return;
+
+        started = true;
+        decodeThread.startThread();
+    }
+
+    /** Starts decoding if needed and blocks until it's done, for tools and tests. */
+    bool waitUntilLoaded(int timeOutMilliseconds = -1)
+    {
+        load();
+        return decodeThread.waitForThreadToExit(timeOutMilliseconds) && isLoaded();
+    }
+
+    bool isLoaded() const { return loaded.load(std::memory_order_acquire); }
+
+    /** Only once isLoaded(). */
+    const Images& getImages() const
+    {
+        jassert(isLoaded());
+        return images;
+    }
+
+    /** The background resampled with high quality to width x height pixels, made once per size. Null until loaded. */
+    Image getScaledBackground(int width, int height)
+    {
+        if (! isLoaded() || ! images.background.isValid() || width <= 0 || height <= 0)
+            return {};
+
+        for (auto& scaled : scaledBackgrounds)
+            if (scaled.getWidth() == width && scaled.getHeight() == height)
+                return scaled;
+
+        scaledBackgrounds.push_back(images.background.rescaled(width, height, Graphics::highResamplingQuality));
+        return scaledBackgrounds.back();
+    }
+
+private:
+
+    class DecodeThread : public Thread
+    {
+    public:
+        explicit DecodeThread(PanelArtwork& owner) : Thread("StoneMistress artwork"), artwork(owner) {}
+
+        void run() override
+        {
+            artwork.images = artwork.decoder();
+            artwork.loaded.store(true, std::memory_order_release);
+            artwork.sendChangeMessage();
+        }
+
+    private:
+        PanelArtwork& artwork;
+    };
+
+    Decoder decoder;
+    Images images; // Written once by the decode thread, read only after loaded.
+    std::atomic<bool> loaded { false };
+    bool started = false;
+
+    std::vector<Image> scaledBackgrounds;
+
+    DecodeThread decodeThread; // Last, it's stopped before the rest goes.
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PanelArtwork)
+};
+
+#if JUCE_TARGET_HAS_BINARY_DATA
+/*
+ * The artwork of the plugin, from its binary resources. Meant for a SharedResourcePointer: the processor holds one as
+ * well, so the pictures are decoded once for as long as the plugin is loaded, not again every time an editor opens.
+*/
+struct PluginArtwork : public PanelArtwork
+{
+    PluginArtwork()
+        : PanelArtwork([]
+          {
+              // Straight from the PNGs: the ImageCache would only keep them for a while, and this is the one copy.
+              return Images { ImageFileFormat::loadFrom(BinaryData::StoneMistressGUI3D7_png, BinaryData::StoneMistressGUI3D7_pngSize),
+                              ImageFileFormat::loadFrom(BinaryData::ToggleSwitchUp_png, BinaryData::ToggleSwitchUp_pngSize),
+                              ImageFileFormat::loadFrom(BinaryData::ToggleSwitchDown_png, BinaryData::ToggleSwitchDown_pngSize) };
+          })
+    {
+    }
+};
+#endif
@@ -15,19 +15,61 @@ namespace Parameters
 {
     //CONSTANTS
     static const double maxDelayTime = 0.050;
+    static const int maxChorusVoices = 8;
 
     // PARAMETER IDs
     static const String nameRate = "RT";
     static const String namePhaserDepth = "PD";
     static const String nameChorusDepth = "CD";
     static const String nameColor = "CLR";
+    static const String nameOversampling = "OS";
+    static const String nameLinearPhase = "LP";
+    static const String namePhaserMix = "PM";
+    static const String nameChorusMix = "CM";
+    static const String nameChorusVoices = "CV";
+
+    // PARAMETER INDICES, in the order of ids below. The audio thread dispatches on these instead of comparing IDs.
+    enum Index
+    {
+        indexRate = 0,
+        indexPhaserDepth,
+        indexChorusDepth,
+        indexColor,
+        indexOversampling,
+        indexLinearPhase,
+        indexPhaserMix,
+        indexChorusMix,
+        indexChorusVoices,
+        numParameters
+    };
+
+    static const String ids[numParameters] = { nameRate, namePhaserDepth, nameChorusDepth, nameColor,
+                                               nameOversampling, nameLinearPhase, namePhaserMix, nameChorusMix,
+                                               nameChorusVoices };
 
     // PARAMETER DEFAULTS
     static const float defaultRate = 0.09f;
     static const float defaultPhaserDepth = 2000.0f;
     static const float defaultChorusDepth = 0.0050f;
     static const bool defaultColor = false;
+    static const int defaultOversampling = 0; // Index into oversamplingChoices.
+    static const bool defaultLinearPhase = false;
+    static const float defaultPhaserMix = 0.5f;
+    static const float defaultChorusMix = 0.5f;
+    static const int defaultChorusVoices = 1; // The pedal's single delay line.
+
+    static const StringArray oversamplingChoices = { "Off", "2x", "4x" };
+
+    // One value per parameter, indexed by Index, in the units of the parameter (not normalised). Presets and the
+    // saved state are made of these.
+    using Values = std::array<float, numParameters>;
+
+    static const Values defaults = { defaultRate, defaultPhaserDepth, defaultChorusDepth, defaultColor ? 1.0f : 0.0f,
+                                     static_cast<float>(defaultOversampling), defaultLinearPhase ? 1.0f : 0.0f,
+                                     defaultPhaserMix, defaultChorusMix, static_cast<float>(defaultChorusVoices) };
 
+   #if JUCE_MODULE_AVAILABLE_juce_audio_processors
+    // The layout is only needed by the plugin, the command line tools use the constants above.
     static AudioProcessorValueTreeState::ParameterLayout createParameterLayout()
     {
         std::vector<std::unique_ptr<RangedAudioParameter>> parameters;
@@ -36,19 +78,13 @@ namespace Parameters
         parameters.push_back(std::make_unique<AudioParameterFloat>(namePhaserDepth, "Phaser Depth", NormalisableRange<float>(0.000f, 2000.0f, 1.0f), defaultPhaserDepth));
         parameters.push_back(std::make_unique<AudioParameterFloat>(nameChorusDepth, "Chorus Depth", NormalisableRange<float>(0.0000f, 0.04000f, 0.00001f), defaultChorusDepth));
         parameters.push_back(std::make_unique<AudioParameterBool>(nameColor, "Color", defaultColor));
+        parameters.push_back(std::make_unique<AudioParameterChoice>(nameOversampling, "Oversampling", oversamplingChoices, defaultOversampling));
+        parameters.push_back(std::make_unique<AudioParameterBool>(nameLinearPhase, "Linear Phase", defaultLinearPhase));
+        parameters.push_back(std::make_unique<AudioParameterFloat>(namePhaserMix, "Phaser Mix", NormalisableRange<float>(0.0f, 1.0f, 0.01f), defaultPhaserMix));
+        parameters.push_back(std::make_unique<AudioParameterFloat>(nameChorusMix, "Chorus Mix", NormalisableRange<float>(0.0f, 1.0f, 0.01f), defaultChorusMix));
+        parameters.push_back(std::make_unique<AudioParameterInt>(nameChorusVoices, "Chorus Voices", 1, maxChorusVoices, defaultChorusVoices));
 
         return { parameters.begin(), parameters.end() };
     }
-
-    static void addListenerToAllParameters(AudioProcessorValueTreeState& valueTreeState, AudioProcessorValueTreeState::Listener* listener)
-    {
-        std::unique_ptr<XmlElement> xml(valueTreeState.copyState().createXml());
-
-        for (auto* element : xml->getChildWithTagNameIterator("PARAM"))
-        {
-            const String& id = element->getStringAttribute("id");
-
-            valueTreeState.addParameterListener(id, listener);
-        }
-    }
+   #endif
 };
\ No newline at end of file
@@ -1,42 +1,77 @@
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
 #include "Parameters.h"
+#include "StateFormat.h"
+
+#define LATENCY_POLL_RATE 10 // Hz, how often the message thread looks for oversampling changes made on other threads.
 
 //==============================================================================
 StoneMistressAudioProcessor::StoneMistressAudioProcessor()
-    : parameters(*this, nullptr, "STONEMISTRESS_PARAMS", Parameters::createParameterLayout()),
-    lfo(Parameters::defaultRate),
-    modulator(Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth),
-    phaser()
+    : AudioProcessor(BusesProperties().withInput("Input", AudioChannelSet::stereo(), true)
+                                      .withOutput("Output", AudioChannelSet::stereo(), true)),
+    parameters(*this, nullptr, "STONEMISTRESS_PARAMS", Parameters::createParameterLayout()),
+    floatEngine(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth),
+    doubleEngine(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth),
+    presets([this](const Parameters::Values& values) { applyValues(values, true); })
 {
-    Parameters::addListenerToAllParameters(parameters, this);
+    for (int index = 0; index < Parameters::numParameters; ++index)
+    {
+        rawValues[index] = parameters.getRawParameterValue(Parameters::ids[index]);
+        jassert(rawValues[index] != nullptr);
+    }
+
+    forEachEngine([this](auto& engine) { engine.setTelemetry(&telemetry); });
+
+    parameters.addParameterListener(Parameters::ids[Parameters::indexOversampling], this);
+    parameters.addParameterListener(Parameters::ids[Parameters::indexLinearPhase], this);
+    startTimerHz(LATENCY_POLL_RATE);
 }
 
 StoneMistressAudioProcessor::~StoneMistressAudioProcessor()
 {
+    stopTimer();
+    parameters.removeParameterListener(Parameters::ids[Parameters::indexOversampling], this);
+    parameters.removeParameterListener(Parameters::ids[Parameters::indexLinearPhase], this);
 }
 
 //==============================================================================
 void StoneMistressAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
-    drywetPhaser.prepareToPlay(samplesPerBlock);
-    drywetChorus.prepareToPlay(samplesPerBlock);
-    lfo.prepareToPlay(sampleRate);
-    phaserModulationBuffer.setSize(2, samplesPerBlock);
-    chorusModulationBuffer.setSize(2, samplesPerBlock);
-    modulator.prepareToPlay(sampleRate);
-    //smallStoneBuffer.setSize(2, samplesPerBlock);
-    //smallStoneBuffer.clear();
-    phaser.prepareToPlay(sampleRate);
-    chorus.prepareToPlay(sampleRate, samplesPerBlock);
+    // A mono input is spread over every output, so the engine runs one channel per output.
+    const auto numChannels = jmax(getTotalNumInputChannels(), getTotalNumOutputChannels());
+
+    // Half a preset would be finished, and crossfaded, by the first block.
+    Parameters::Values values;
+    readParameters(values, appliedGeneration);
+
+    // Bounces run the channels on the worker threads. Waking them and waiting for them isn't real-time safe, so playback
+    // never does, whatever the block size. Hosts switch to offline before preparing.
+    const auto parallel = isNonRealtime();
+    forEachEngine([parallel](auto& engine) { engine.setParallelProcessing(parallel); });
+
+    // The cheapest chorus kernel that is accurate enough, a bounce can afford the most accurate one.
+    const auto interpolation = ChorusInterpolation::pick(isNonRealtime() ? CHORUS_OFFLINE_ERROR : CHORUS_REALTIME_ERROR);
+    forEachEngine([interpolation](auto& engine) { engine.setChorusInterpolation(interpolation); });
+
+    if (isUsingDoublePrecision())
+    {
+        floatEngine.releaseResources();
+        updateParameters(doubleEngine.getEngine(), values, true);
+        doubleEngine.prepareToPlay(sampleRate, samplesPerBlock, numChannels);
+        setLatencySamples(doubleEngine.getLatencyInSamples());
+    }
+    else
+    {
+        doubleEngine.releaseResources();
+        updateParameters(floatEngine.getEngine(), values, true);
+        floatEngine.prepareToPlay(sampleRate, samplesPerBlock, numChannels);
+        setLatencySamples(floatEngine.getLatencyInSamples());
+    }
 }
 
 void StoneMistressAudioProcessor::releaseResources()
 {
-    phaserModulationBuffer.setSize(0, 0);
-    chorusModulationBuffer.setSize(0, 0);
-    //smallStoneBuffer.setSize(0, 0);
-    chorus.releaseResources();
+    forEachEngine([](auto& engine) { engine.releaseResources(); });
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -46,81 +81,130 @@ bool StoneMistressAudioProcessor::isBusesLayoutSupported (const BusesLayout& lay
     juce::ignoreUnused (layouts);
     return true;
   #else
-    // This is the place where you check if the layout is supported.
-    // In this template code we only support mono or stereo.
-    // Some plugin hosts, such as certain GarageBand versions, will only
-    // load plugins that support stereo bus layouts.
-    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono()
-     && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
-        return false;
+    // Any layout the engine has lanes for: mono, stereo, surround (5.1, 7.1.4...) or Ambisonic beds.
+    const auto& output = layouts.getMainOutputChannelSet();
+    const auto& input = layouts.getMainInputChannelSet();
 
-    // This checks if the input layout matches the output layout
-   #if ! JucePlugin_IsSynth
-    if (layouts.getMainOutputChannelSet() != layouts.getMainInputChannelSet())
+    if (output.isDisabled() || output.size() > MAX_CHANNELS)
         return false;
-   #endif
 
-    return true;
+    // Every output processes its own input, except for a mono input, which feeds all of them.
+    return input == output || input == AudioChannelSet::mono();
   #endif
 }
 #endif
 
-void StoneMistressAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
+bool StoneMistressAudioProcessor::readParameters(Parameters::Values& values, uint32& generation) const
 {
+    generation = presetGeneration.load(std::memory_order_acquire);
+
+    for (int index = 0; index < Parameters::numParameters; ++index)
+        values[static_cast<size_t>(index)] = rawValues[index]->load(std::memory_order_relaxed);
+
+    // Unchanged and even: no preset was written meanwhile, the values are all from the same one.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (generation & 1) == 0 && presetGeneration.load(std::memory_order_relaxed) == generation;
+}
+
+template <typename SampleType>
+void StoneMistressAudioProcessor::updateParameters(StoneMistressEngine<SampleType>& engine, const Parameters::Values& values, bool forceAll)
+{
+    for (int index = 0; index < Parameters::numParameters; ++index)
+    {
+        const auto value = values[static_cast<size_t>(index)];
+
+        if (value == appliedValues[index] && ! forceAll)
+            continue;
+
+        appliedValues[index] = value;
+
+        switch (index)
+        {
+            case Parameters::indexRate:         engine.setRate(value); break;
+            case Parameters::indexPhaserDepth:  engine.setPhaserDepth(value); break;
+            case Parameters::indexChorusDepth:  engine.setChorusDepth(value); break;
+            case Parameters::indexColor:        engine.setColor(value >= 0.5f); break;
+            case Parameters::indexPhaserMix:    engine.setPhaserMix(value); break;
+            case Parameters::indexChorusMix:    engine.setChorusMix(value); break;
+            case Parameters::indexChorusVoices: engine.setChorusVoices(roundToInt(value)); break;
+
+            // Both parameters describe one setting. When both change in the same block, the second call wins.
+            case Parameters::indexOversampling:
+            case Parameters::indexLinearPhase:
+                engine.setOversampling(1 << roundToInt(appliedValues[Parameters::indexOversampling]),
+                                       appliedValues[Parameters::indexLinearPhase] >= 0.5f);
+                break;
+
+            default: jassertfalse; break;
+        }
+    }
+}
+
+template <typename SampleType>
+void StoneMistressAudioProcessor::process(AudioBuffer<SampleType>& buffer, CrossfadingEngine<SampleType>& engine)
+{
+    STONEMISTRESS_TRACE_SCOPE("StoneMistressAudioProcessor::processBlock");
+
     juce::ScopedNoDenormals noDenormals;
     auto inCh  = getTotalNumInputChannels();
     auto outCh = getTotalNumOutputChannels();
 
     auto const numSamples = buffer.getNumSamples();
-    auto const numCh = buffer.getNumChannels();
-
-    // In case we have more outputs than inputs, this code clears any output
-    // channels that didn't contain input data, (because these aren't
-    // guaranteed to be empty - they may contain garbage).
-    // This is here to avoid people getting screaming feedback
-    // when they first compile a plugin, but obviously you don't need to keep
-    // this code if your algorithm always overwrites all the output channels.
-    for (auto i = inCh; i < outCh; ++i)
-        buffer.clear (i, 0, numSamples);
 
-    // TO DO LIST.
-
-    // 1. Generate the LFO Signal.
-    lfo.getNextAudioBlock(phaserModulationBuffer, numSamples);
-
-    // 2. Copy the same LFO signal into another buffer.
-    for (int ch = 0; ch < 2; ++ch)
+    // A mono input goes to every output, each of them is then modulated at its own LFO phase. Other layouts have as
+    // many inputs as outputs, this only clears garbage if a host hands over something else.
+    for (auto i = inCh; i < outCh; ++i)
     {
-        chorusModulationBuffer.copyFrom(ch, 0, phaserModulationBuffer, ch, 0, numSamples);
+        if (inCh == 1)
+            buffer.copyFrom(i, 0, buffer, 0, 0, numSamples);
+        else
+            buffer.clear(i, 0, numSamples);
     }
 
-    // 3. LFO Signal is scaled accordingly.
-    modulator.processBlock(phaserModulationBuffer, numSamples, "p");
-    modulator.processBlock(chorusModulationBuffer, numSamples, "c");
+    {
+        STONEMISTRESS_TRACE_SCOPE("Parameters");
 
-    // 4. Set modulation bounds for the Chorus buffer.
-    FloatVectorOperations::min(chorusModulationBuffer.getWritePointer(0), chorusModulationBuffer.getWritePointer(0), Parameters::maxDelayTime, numSamples);
-    FloatVectorOperations::min(chorusModulationBuffer.getWritePointer(1), chorusModulationBuffer.getWritePointer(1), Parameters::maxDelayTime, numSamples);
-    
-    // 5. Make copy of the dry signal before it enters the phaser unit.
-    drywetPhaser.copyDrySignal(buffer);
+        Parameters::Values values;
+        uint32 generation;
 
-    // 6. Feed the buffer into the phaser unit.
-    phaser.processBlock(buffer, phaserModulationBuffer, numSamples);
+        // A new preset fades in from a copy of the running engine, unless the last one is still fading in: it then
+        // waits, together with any other change, for the next block.
+        if (readParameters(values, generation))
+        {
+            if (generation != appliedGeneration && ! engine.isCrossfading())
+            {
+                engine.startCrossfade();
+                appliedGeneration = generation;
+            }
 
-    // 7. Mix dry and wet signal.
-    drywetPhaser.mixDrySignal(buffer);
+            if (generation == appliedGeneration)
+                updateParameters(engine.getEngine(), values, false);
+        }
+    }
 
-    // 8. Make copy of the phase shifted signal. 
-    drywetChorus.copyDrySignal(buffer);
+    // The whole LFO -> Phaser -> Chorus chain lives in the engine, two of them during a crossfade. The host learns
+    // about the latency of a new oversampling setting from the message thread, see updateLatency().
+    engine.processBlock(buffer);
+}
 
-    // 9. Feed the buffer into the chorus unit.
-    chorus.processBlock(buffer, chorusModulationBuffer);
+void StoneMistressAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
+{
+    process(buffer, floatEngine);
+}
 
-    // 10. Last mix before final output.
-    drywetChorus.mixDrySignal(buffer);
+void StoneMistressAudioProcessor::processBlock (juce::AudioBuffer<double>& buffer, juce::MidiBuffer& midiMessages)
+{
+    process(buffer, doubleEngine);
+}
+double StoneMistressAudioProcessor::getTailLengthSeconds() const
+{
+    // Color is read from the parameter, the engines only learn about it on the audio thread.
+    const auto colorIsOn = rawValues[Parameters::indexColor]->load() >= 0.5f;
+    const auto latency = getSampleRate() > 0.0 ? getLatencySamples() / getSampleRate() : 0.0;
 
+    return StoneMistressEngine<float>::getTailLengthSeconds(colorIsOn) + latency;
 }
+
 //==============================================================================
 bool StoneMistressAudioProcessor::hasEditor() const
 {
@@ -135,40 +219,90 @@ juce::AudioProcessorEditor* StoneMistressAudioProcessor::createEditor()
 //==============================================================================
 void StoneMistressAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
-    auto state = parameters.copyState();
-    std::unique_ptr<XmlElement> xml(state.createXml());
-    copyXmlToBinary(*xml, destData);
+    Parameters::Values values;
+
+    for (int index = 0; index < Parameters::numParameters; ++index)
+        values[static_cast<size_t>(index)] = rawValues[index]->load();
+
+    StateFormat::write(values, presets.getCurrentIndex(), destData);
 }
 
 void StoneMistressAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
 {
-    std::unique_ptr<XmlElement> xmlState(getXmlFromBinary(data, sizeInBytes));
-    if (xmlState.get() != nullptr)
-        if (xmlState->hasTagName(parameters.state.getType()))
-            parameters.replaceState(ValueTree::fromXml(*xmlState));
-}
+    // Parameters missing from the state, e.g. added since it was saved, go back to their defaults.
+    auto values = Parameters::defaults;
+    int presetIndex = -1;
 
-void StoneMistressAudioProcessor::parameterChanged(const String& paramID, float newValue)
-{
-    if (paramID == Parameters::nameRate)
+    if (StateFormat::read(data, sizeInBytes, values, presetIndex))
     {
-        lfo.setRate(newValue);
+        presets.setCurrentIndex(presetIndex);
+        applyValues(values, false);
+        return;
     }
 
-    if (paramID == Parameters::namePhaserDepth)
+    // Sessions saved before StateFormat hold the XML of the value tree, and no preset index.
+    std::unique_ptr<XmlElement> xmlState(getXmlFromBinary(data, sizeInBytes));
+    if (xmlState.get() != nullptr && StateFormat::readXml(*xmlState, parameters.state.getType(), values))
     {
-        modulator.setPhaserDepth(newValue);
+        presets.setCurrentIndex(-1);
+        applyValues(values, false);
     }
+}
 
-    if (paramID == Parameters::nameChorusDepth)
-    {
-        modulator.setChorusDepth(newValue);
-    }
+void StoneMistressAudioProcessor::applyValues(const Parameters::Values& values, bool isPreset)
+{
+    const ScopedLock lock(applyLock);
 
-    if (paramID == Parameters::nameColor)
+    presetGeneration.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (int index = 0; index < Parameters::numParameters; ++index)
     {
-        phaser.setColor();
+        auto* parameter = parameters.getParameter(Parameters::ids[index]);
+        const auto value = parameter->convertTo0to1(values[static_cast<size_t>(index)]);
+
+        // A preset is an edit, the host records it like a knob being turned. A restored state is not.
+        if (isPreset)
+            parameter->beginChangeGesture();
+
+        parameter->setValueNotifyingHost(value);
+
+        if (isPreset)
+            parameter->endChangeGesture();
     }
+
+    presetGeneration.fetch_add(1, std::memory_order_release);
+    requestLatencyUpdate();
+}
+
+void StoneMistressAudioProcessor::parameterChanged(const String&, float)
+{
+    requestLatencyUpdate();
+}
+
+void StoneMistressAudioProcessor::requestLatencyUpdate()
+{
+    if (MessageManager::existsAndIsCurrentThread())
+        updateLatency();
+    else
+        latencyNeedsUpdate = true;
+}
+
+void StoneMistressAudioProcessor::timerCallback()
+{
+    if (latencyNeedsUpdate.exchange(false))
+        updateLatency();
+}
+
+void StoneMistressAudioProcessor::updateLatency()
+{
+    const auto factor = 1 << roundToInt(rawValues[Parameters::indexOversampling]->load());
+    const auto linearPhase = rawValues[Parameters::indexLinearPhase]->load() >= 0.5f;
+    const auto latency = isUsingDoublePrecision() ? doubleEngine.getLatencyInSamples(factor, linearPhase)
+                                                  : floatEngine.getLatencyInSamples(factor, linearPhase);
+
+    if (latency != getLatencySamples())
+        setLatencySamples(latency);
 }
 
 //==============================================================================
@@ -1,12 +1,14 @@
 #pragma once
 
 #include <JuceHeader.h>
-#include "Delays.h"
-#include "DryWet.h"
-#include "Oscillator.h"
-#include "SmallStone.h"
-
-class StoneMistressAudioProcessor  : public juce::AudioProcessor, public AudioProcessorValueTreeState::Listener
+#include "CrossfadingEngine.h"
+#include "PanelArtwork.h"
+#include "Parameters.h"
+#include "PresetBank.h"
+
+class StoneMistressAudioProcessor  : public juce::AudioProcessor,
+                                     private juce::AudioProcessorValueTreeState::Listener,
+                                     private juce::Timer
 {
 public:
     //==============================================================================
@@ -22,6 +24,8 @@ public:
    #endif
 
     void processBlock (juce::AudioBuffer<float>&, juce::MidiBuffer&) override;
+    void processBlock (juce::AudioBuffer<double>&, juce::MidiBuffer&) override;
+    bool supportsDoublePrecisionProcessing() const override { return true; }
 
     //==============================================================================
     juce::AudioProcessorEditor* createEditor() override;
@@ -33,34 +37,83 @@ public:
     bool acceptsMidi() const override { return false; }
     bool producesMidi() const override { return false; }
     bool isMidiEffect() const override { return false; }
-    double getTailLengthSeconds() const override { return 0.0; }
+    double getTailLengthSeconds() const override;
 
     //==============================================================================
-    int getNumPrograms() override { return 1; }
-    int getCurrentProgram() override { return 0; }
-    void setCurrentProgram(int index) override {}
-    const juce::String getProgramName(int index) override { return {}; }
+    // The factory presets. Selecting one returns at once, it is applied in the background and crossfaded in.
+    int getNumPrograms() override { return PresetBank::getNumPresets(); }
+    int getCurrentProgram() override { return jmax(0, presets.getCurrentIndex()); }
+    void setCurrentProgram(int index) override { presets.select(index); }
+    const juce::String getProgramName(int index) override { return PresetBank::getName(index); }
     void changeProgramName(int index, const juce::String& newName) override {}
 
     //==============================================================================
     void getStateInformation (juce::MemoryBlock& destData) override;
     void setStateInformation (const void* data, int sizeInBytes) override;
 
+    /** Filled by the audio thread while the editor has it enabled. */
+    Telemetry& getTelemetry() { return telemetry; }
+
 private:
 
-    void parameterChanged(const String& paramID, float newValue) override;
+    bool readParameters(Parameters::Values& values, uint32& generation) const;
+
+    template <typename SampleType>
+    void updateParameters(StoneMistressEngine<SampleType>& engine, const Parameters::Values& values, bool forceAll);
+
+    template <typename SampleType>
+    void process(AudioBuffer<SampleType>& buffer, CrossfadingEngine<SampleType>& engine);
+
+    // Writes a whole set of values to the parameters, from a preset or a saved state. Any thread but the audio one.
+    void applyValues(const Parameters::Values& values, bool isPreset);
+
+    // The latency depends on Oversampling and Linear Phase only, so the host is told as soon as they change rather than
+    // when the audio thread picks them up: setLatencySamples() notifies the host, which locks and posts messages.
+    // Changes from other threads, automation on the audio thread included, are handed to the timer.
+    void parameterChanged(const String& parameterID, float newValue) override;
+    void timerCallback() override;
+    void requestLatencyUpdate();
+    void updateLatency(); // Message thread only.
+
+    template <typename Function>
+    void forEachEngine(Function&& function)
+    {
+        function(floatEngine);
+        function(doubleEngine);
+    }
 
     AudioProcessorValueTreeState parameters;
 
-    AudioBuffer<double> phaserModulationBuffer;
-    AudioBuffer<double> chorusModulationBuffer;
+    // Declared before the engines, which hold a pointer to it.
+    Telemetry telemetry;
+
+   #if STONEMISTRESS_PROFILING
+    // Records while any instance exists, the trace is written when the last one goes. See Profiling.h.
+    Profiler::Session profilerSession;
+   #endif
+
+    // The host sets the precision before prepareToPlay(), only the matching engine is prepared and run.
+    CrossfadingEngine<float> floatEngine;
+    CrossfadingEngine<double> doubleEngine;
+
+    // The audio thread reads every parameter once per block and only hands the changed ones to the engine, so the
+    // engine is never touched from another thread. Indexed by Parameters::Index.
+    std::atomic<float>* rawValues[Parameters::numParameters] = {};
+    float appliedValues[Parameters::numParameters] = {};
+
+    // Odd while applyValues() writes the parameters, one more when it is done. The audio thread crossfades when it
+    // moves and drops reads that overlapped a write, so a preset arrives whole, in one block.
+    std::atomic<uint32> presetGeneration { 0 };
+    uint32 appliedGeneration = 0;
+    CriticalSection applyLock; // One applyValues() at a time.
+
+    std::atomic<bool> latencyNeedsUpdate { false };
+
+    // Keeps the editor pictures decoded while the plugin is loaded, they're only decoded when an editor first opens.
+    SharedResourcePointer<PluginArtwork> artwork;
 
-    DryWet drywetPhaser;
-    DryWet drywetChorus;
-    LFO lfo;
-    ParameterModulation modulator;
-    SmallStone phaser;
-    Chorus chorus;
+    // Last, its destructor waits for a preset that is being applied.
+    PresetBank presets;
 
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (StoneMistressAudioProcessor)
@@ -0,0 +1,145 @@
+/*
+  ==============================================================================
+
+    PresetBank.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "Parameters.h"
+
+/*
+ * The factory presets, offered to the host as programs.
+ * select() returns at once from any thread, the preset is applied on a thread shared by all instances, which hands the
+ * values to the function given to the constructor. Selecting several presets in a row applies the last one only.
+ * The processor writes them to its parameters, the audio thread then crossfades to them (see CrossfadingEngine).
+*/
+class PresetBank
+{
+public:
+
+    using ApplyFunction = std::function<void(const Parameters::Values&)>;
+
+    explicit PresetBank(ApplyFunction functionToApply)
+        : apply(std::move(functionToApply))
+    {
+    }
+
+    ~PresetBank()
+    {
+        // A job still queued or running would call into an owner that is going away.
+        JobsOf jobs(*this);
+        thread->removeAllJobs(true, -1, &jobs);
+    }
+
+    static int getNumPresets() { return static_cast<int>(getPresets().size()); }
+
+    static String getName(int index)
+    {
+        return isPositiveAndBelow(index, getNumPresets()) ? String(getPresets()[static_cast<size_t>(index)].name) : String();
+    }
+
+    static const Parameters::Values& getValues(int index)
+    {
+        jassert(isPositiveAndBelow(index, getNumPresets()));
+        return getPresets()[static_cast<size_t>(index)].values;
+    }
+
+    /** The last preset selected or restored, -1 if none. */
+    int getCurrentIndex() const { return currentIndex.load(); }
+
+    /** Sets the index restored with a session, the values come with it and are not applied again. */
+    void setCurrentIndex(int index) { currentIndex = isPositiveAndBelow(index, getNumPresets()) ? index : -1; }
+
+    void select(int index)
+    {
+        if (! isPositiveAndBelow(index, getNumPresets()))
+            return;
+
+        currentIndex = index;
+        ++requestedGeneration;
+        thread->addJob(new Job(*this), true);
+    }
+
+private:
+
+    struct Preset
+    {
+        const char* name;
+        Parameters::Values values;
+    };
+
+    // Rate, phaser depth, chorus depth, color, oversampling, linear phase, phaser mix, chorus mix, chorus voices.
+    static const std::vector<Preset>& getPresets()
+    {
+        static const std::vector<Preset> presets =
+        {
+            { "Default",        Parameters::defaults },
+            { "Slow Sweep",     { 0.06f, 2000.0f, 0.0030f, 0.0f, 0.0f, 0.0f, 0.6f, 0.3f, 1.0f } },
+            { "Jet",            { 0.12f, 2000.0f, 0.0080f, 1.0f, 1.0f, 0.0f, 0.6f, 0.6f, 1.0f } },
+            { "Shimmer Chorus", { 0.60f,  800.0f, 0.0120f, 0.0f, 0.0f, 0.0f, 0.2f, 0.7f, 3.0f } },
+            { "Vibe",           { 3.50f, 1500.0f, 0.0020f, 1.0f, 1.0f, 0.0f, 0.5f, 0.3f, 1.0f } }
+        };
+
+        return presets;
+    }
+
+    // One background thread for every instance, presets are applied in the order they were selected.
+    struct PresetThread : public ThreadPool
+    {
+        PresetThread() : ThreadPool(1) {}
+    };
+
+    struct Job : public ThreadPoolJob
+    {
+        explicit Job(PresetBank& owner) : ThreadPoolJob("StoneMistress preset"), bank(owner) {}
+
+        JobStatus runJob() override
+        {
+            bank.applyRequested();
+            return jobHasFinished;
+        }
+
+        PresetBank& bank;
+    };
+
+    struct JobsOf : public ThreadPool::JobSelector
+    {
+        explicit JobsOf(PresetBank& owner) : bank(owner) {}
+
+        bool isJobSuitable(ThreadPoolJob* job) override
+        {
+            auto* presetJob = dynamic_cast<Job*>(job);
+            return presetJob != nullptr && &presetJob->bank == &bank;
+        }
+
+        PresetBank& bank;
+    };
+
+    // Only the preset thread gets here. Jobs queued behind a newer selection find nothing left to do.
+    void applyRequested()
+    {
+        const auto generation = requestedGeneration.load();
+
+        if (generation == appliedGeneration)
+            return;
+
+        appliedGeneration = generation;
+
+        const auto index = currentIndex.load();
+
+        if (isPositiveAndBelow(index, getNumPresets()))
+            apply(getValues(index));
+    }
+
+    ApplyFunction apply;
+    SharedResourcePointer<PresetThread> thread;
+
+    std::atomic<int> currentIndex { -1 };
+    std::atomic<uint32> requestedGeneration { 0 };
+    uint32 appliedGeneration = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PresetBank)
+};
@@ -0,0 +1,381 @@
+/*
+  ==============================================================================
+
+    Profiling.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "CpuDispatch.h"
+
+// Instrumentation build switches, off unless the build defines them (the Profile configuration of the tools does).
+#ifndef STONEMISTRESS_PROFILING
+ #define STONEMISTRESS_PROFILING 0
+#endif
+
+// Hardware counters per event, on top of the timings. Only Linux has perf_event.
+#if ! defined (STONEMISTRESS_PERF_COUNTERS) || ! STONEMISTRESS_PROFILING || ! JUCE_LINUX
+ #undef STONEMISTRESS_PERF_COUNTERS
+ #define STONEMISTRESS_PERF_COUNTERS 0
+#endif
+
+#if STONEMISTRESS_PERF_COUNTERS
+ #include <linux/perf_event.h>
+ #include <sys/ioctl.h>
+ #include <sys/syscall.h>
+ #include <unistd.h>
+#endif
+
+#define PROFILER_EVENTS (1 << 18) // Events a trace holds, later ones are dropped. 64 bytes each.
+
+/** Times the rest of the enclosing scope as one trace event. name must be a string literal. Compiles to nothing
+    unless STONEMISTRESS_PROFILING is set.
+*/
+#if STONEMISTRESS_PROFILING
+ #define STONEMISTRESS_TRACE_SCOPE(name) const Profiler::Scope JUCE_JOIN_MACRO(profilerScope, __LINE__) (name)
+#else
+ #define STONEMISTRESS_TRACE_SCOPE(name)
+#endif
+
+#if STONEMISTRESS_PROFILING
+
+/*
+ * Records scoped trace events from any thread and writes them as a Chrome trace, which chrome://tracing and
+ * ui.perfetto.dev open: one track per thread, the scopes nested on it.
+ * Recording runs while a Session exists, and the trace is written when the last one ends. The plugin holds one per
+ * instance, the tools one for --trace.
+ *
+ * Recording an event is wait-free: a slot is claimed with one atomic increment in a buffer allocated when recording
+ * starts, so any number of audio threads can record at once. With STONEMISTRESS_PERF_COUNTERS, every event also
+ * carries the cycles, instructions, L1 data cache and last level cache misses of its thread, read from a perf_event
+ * group the thread opens on its first event.
+ *
+ * This is not a real-time safe build: the counters take a system call at both ends of a scope, and the first event
+ * of a thread opens them (and, in a plugin, may allocate its thread-local storage). Audit the regular build.
+*/
+class Profiler
+{
+public:
+
+    enum Counter
+    {
+        cycles,
+        instructions,
+        l1dMisses,
+        llcMisses,
+        numCounters
+    };
+
+    /** Records one event from construction to destruction, see STONEMISTRESS_TRACE_SCOPE. */
+    class Scope
+    {
+    public:
+        explicit Scope(const char* eventName)
+            : name(getInstance().isRecording() ? eventName : nullptr)
+        {
+            if (name == nullptr)
+                return;
+
+           #if STONEMISTRESS_PERF_COUNTERS
+            counting = getThreadCounters().read(startCounts);
+           #endif
+            startTicks = Time::getHighResolutionTicks();
+        }
+
+        ~Scope()
+        {
+            if (name == nullptr)
+                return;
+
+            const auto endTicks = Time::getHighResolutionTicks();
+            uint64 counts[numCounters] = {};
+
+           #if STONEMISTRESS_PERF_COUNTERS
+            counting = counting && getThreadCounters().read(counts);
+
+            for (int counter = 0; counter < numCounters; ++counter)
+                counts[counter] -= startCounts[counter];
+           #endif
+
+            getInstance().record(name, startTicks, endTicks, counting ? counts : nullptr);
+        }
+
+    private:
+        const char* const name;
+        int64 startTicks = 0;
+        uint64 startCounts[numCounters] = {};
+        bool counting = false;
+
+        JUCE_DECLARE_NON_COPYABLE(Scope)
+    };
+
+    /** Records for as long as it exists. When the last session ends, the trace goes to its file, or if that's
+        empty, to $STONEMISTRESS_TRACE_FILE, or to a new file in the temporary folder.
+    */
+    class Session
+    {
+    public:
+        explicit Session(const File& traceFile = {})
+            : file(traceFile)
+        {
+            getInstance().beginSession();
+        }
+
+        ~Session()
+        {
+            getInstance().endSession(file);
+        }
+
+    private:
+        const File file;
+
+        JUCE_DECLARE_NON_COPYABLE(Session)
+    };
+
+    static Profiler& getInstance()
+    {
+        static Profiler instance;
+        return instance;
+    }
+
+    bool isRecording() const { return recording.load(std::memory_order_acquire); }
+
+private:
+
+    struct Event
+    {
+        std::atomic<const char*> name { nullptr }; // Stored last, an event without a name is still being written.
+        int64 startTicks = 0;
+        int64 endTicks = 0;
+        uint32 thread = 0;
+        bool hasCounts = false;
+        uint64 counts[numCounters] = {};
+    };
+
+   #if STONEMISTRESS_PERF_COUNTERS
+    // The counters of the calling thread, in one group so they're read together and always count the same code.
+    class PerfCounters
+    {
+    public:
+        PerfCounters()
+        {
+            const std::pair<uint32, uint64> events[] = {
+                { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+                { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+                { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+                { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES }, // Last level cache.
+            };
+
+            for (int counter = 0; counter < numCounters; ++counter)
+            {
+                perf_event_attr attributes {};
+                attributes.size = sizeof(attributes);
+                attributes.type = events[counter].first;
+                attributes.config = events[counter].second;
+                attributes.read_format = PERF_FORMAT_GROUP;
+                attributes.disabled = counter == 0 ? 1 : 0; // The leader starts the whole group.
+                attributes.exclude_kernel = 1; // Allowed at the default perf_event_paranoid level.
+                attributes.exclude_hv = 1;
+
+                descriptors[counter] = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, counter == 0 ? -1 : descriptors[0], 0));
+
+                if (descriptors[counter] < 0)
+                {
+                    // No PMU (e.g. some virtual machines) or not permitted: the events go without counts.
+                    close(counter);
+                    return;
+                }
+            }
+
+            ioctl(descriptors[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+
+        ~PerfCounters()
+        {
+            close(numCounters);
+        }
+
+        // Returns false if the counters couldn't be opened or read.
+        bool read(uint64* counts) const
+        {
+            struct { uint64 numValues; uint64 values[numCounters]; } group;
+
+            if (descriptors[0] < 0 || ::read(descriptors[0], &group, sizeof(group)) != static_cast<ssize_t>(sizeof(group)))
+                return false;
+
+            std::copy(group.values, group.values + numCounters, counts);
+            return true;
+        }
+
+    private:
+        // Closes the first numOpen counters.
+        void close(int numOpen)
+        {
+            for (int counter = 0; counter < numOpen; ++counter)
+            {
+                if (descriptors[counter] >= 0)
+                    ::close(descriptors[counter]);
+
+                descriptors[counter] = -1;
+            }
+        }
+
+        int descriptors[numCounters] = { -1, -1, -1, -1 };
+
+        JUCE_DECLARE_NON_COPYABLE(PerfCounters)
+    };
+
+    static PerfCounters& getThreadCounters()
+    {
+        thread_local PerfCounters counters;
+        return counters;
+    }
+   #endif
+
+    Profiler() {}
+
+    // Small numbers are easier to tell apart in a trace viewer than thread handles.
+    uint32 getThreadIndex()
+    {
+        thread_local const uint32 index = ++numThreads;
+        return index;
+    }
+
+    // counts is null if the thread has no counters.
+    void record(const char* name, int64 startTicks, int64 endTicks, const uint64* counts)
+    {
+        if (! isRecording())
+            return;
+
+        const auto index = numEvents.fetch_add(1, std::memory_order_relaxed);
+
+        if (index >= PROFILER_EVENTS)
+            return;
+
+        auto& event = events[static_cast<size_t>(index)];
+        event.startTicks = startTicks;
+        event.endTicks = endTicks;
+        event.thread = getThreadIndex();
+        event.hasCounts = counts != nullptr;
+
+        if (counts != nullptr)
+            std::copy(counts, counts + numCounters, event.counts);
+        event.name.store(name, std::memory_order_release);
+    }
+
+    void beginSession()
+    {
+        const ScopedLock sl(sessionLock);
+
+        if (numSessions++ > 0)
+            return;
+
+        if (events == nullptr)
+            events = std::make_unique<Event[]>(PROFILER_EVENTS);
+
+        for (int i = 0; i < PROFILER_EVENTS; ++i)
+            events[static_cast<size_t>(i)].name.store(nullptr, std::memory_order_relaxed);
+
+        numEvents.store(0, std::memory_order_relaxed);
+        originTicks = Time::getHighResolutionTicks();
+        recording.store(true, std::memory_order_release);
+    }
+
+    void endSession(const File& sessionFile)
+    {
+        const ScopedLock sl(sessionLock);
+
+        if (--numSessions > 0)
+            return;
+
+        recording.store(false, std::memory_order_release);
+
+        auto file = sessionFile;
+
+        if (file == File())
+        {
+            const auto path = SystemStats::getEnvironmentVariable("STONEMISTRESS_TRACE_FILE", {});
+            file = path.isNotEmpty() ? File::getCurrentWorkingDirectory().getChildFile(path)
+                                     : File::getSpecialLocation(File::tempDirectory)
+                                           .getChildFile("StoneMistress-" + Time::getCurrentTime().formatted("%Y%m%d-%H%M%S") + ".json");
+        }
+
+        if (writeChromeTrace(file))
+            Logger::writeToLog("Trace written to " + file.getFullPathName());
+        else
+            Logger::writeToLog("Could not write the trace to " + file.getFullPathName());
+    }
+
+    // Complete ("X") events with microsecond timestamps, see the Trace Event Format. A scope still open on an audio
+    // thread while the last session ends is left out.
+    bool writeChromeTrace(const File& file) const
+    {
+        file.deleteFile();
+        FileOutputStream out(file);
+
+        if (! out.openedOk())
+            return false;
+
+        const auto numRecorded = jmin(numEvents.load(), static_cast<int64>(PROFILER_EVENTS));
+        const auto ticksToMicroseconds = 1.0e6 / static_cast<double>(Time::getHighResolutionTicksPerSecond());
+        const char* counterNames[numCounters] = { "cycles", "instructions", "l1dMisses", "llcMisses" };
+
+        out << "{\"displayTimeUnit\":\"ns\",\"otherData\":{"
+            << "\"instructionSet\":\"" << CpuDispatch::getName(CpuDispatch::getInstructionSet()) << "\","
+            << "\"perfCounters\":" << (STONEMISTRESS_PERF_COUNTERS ? "true" : "false") << ","
+            << "\"droppedEvents\":" << String(numEvents.load() - numRecorded) << "},\n"
+            << "\"traceEvents\":[\n"
+            << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"StoneMistress\"}}";
+
+        uint32 maxThread = 0;
+
+        for (int64 i = 0; i < numRecorded; ++i)
+        {
+            const auto& event = events[static_cast<size_t>(i)];
+            const auto* name = event.name.load(std::memory_order_acquire);
+
+            if (name == nullptr)
+                continue;
+
+            out << ",\n{\"name\":\"" << name << "\",\"cat\":\"dsp\",\"ph\":\"X\",\"pid\":1,\"tid\":" << String(event.thread)
+                << ",\"ts\":" << String((event.startTicks - originTicks) * ticksToMicroseconds, 3)
+                << ",\"dur\":" << String((event.endTicks - event.startTicks) * ticksToMicroseconds, 3);
+
+            if (event.hasCounts)
+            {
+                out << ",\"args\":{";
+
+                for (int counter = 0; counter < numCounters; ++counter)
+                    out << (counter > 0 ? "," : "") << "\"" << counterNames[counter] << "\":" << String(event.counts[counter]);
+
+                out << "}";
+            }
+
+            out << "}";
+            maxThread = jmax(maxThread, event.thread);
+        }
+
+        for (uint32 thread = 1; thread <= maxThread; ++thread)
+            out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << String(thread)
+                << ",\"args\":{\"name\":\"Thread " << String(thread) << "\"}}";
+
+        out << "\n]}\n";
+        out.flush();
+        return out.getStatus().wasOk();
+    }
+
+    std::atomic<bool> recording { false };
+    std::atomic<int64> numEvents { 0 }; // Claimed slots, including the dropped ones past PROFILER_EVENTS.
+    std::atomic<uint32> numThreads { 0 };
+    std::unique_ptr<Event[]> events;
+    int64 originTicks = 0;
+
+    CriticalSection sessionLock;
+    int numSessions = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Profiler)
+};
+
+#endif
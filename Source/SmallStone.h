@@ -10,93 +10,717 @@
 
 #pragma once
 #include <JuceHeader.h>
+#include "CpuDispatch.h"
+#include "DryWet.h"
 #include "Filters.h"
+#include "Profiling.h"
 
 #define FEEDBACK 0.8
-#define STAGES 4
+#define STAGES 4 // The Small Stone's, the default voicing (see SmallStone) and the one StoneMistressBank runs.
+#define MAX_OVERSAMPLING 4
+#define PHASER_CHUNK 32 // Samples laid out around the chain at a time, see SmallStone::processGroups().
 
 // Small Stone EH4800 Phase Shifter Pedal emulation. When the COLOR switch is engaged, a feedback line is enabled.
+// The channels run lane-parallel: they are split into groups as wide as a vector register of the instruction set
+// CpuDispatch picked (4 floats or 2 doubles with SSE/NEON, twice that with AVX2, four times with AVX-512), and each
+// group runs the whole chain and the feedback line with one instruction per operation. Stereo is a single group, 7.1.4
+// is three float groups with SSE and one with AVX-512, so the cost grows with the number of groups rather than of
+// channels. The state of every channel has its own slot, so the group width can change from one block to the next.
+//
+// With deep modulation the feedback line pushes energy up to Nyquist, where it aliases at 44.1/48 kHz. The phaser can
+// run 2x or 4x oversampled through half-band filters: polyphase IIR (minimum phase, a few samples of latency) or
+// equiripple FIR (linear phase, more latency). All four configurations are built up front, so switching between
+// them is allocation free and can happen on the audio thread. The latency must be compensated by the caller.
+// The dry signal is mixed in at the oversampled rate, so it goes through the same filters and stays aligned with the wet.
+//
+// numStages is 4 for the Small Stone, 6, 8 or 12 for deeper voicings with more notches. The stages come in pairs with
+// identical Break Frequencies, each pair runs as one section (see AllPassPair) and the pairs are unrolled at compile
+// time, so a deeper phaser costs about the same per stage as the Small Stone.
+template <typename SampleType, int numStages = STAGES>
 class SmallStone {
 public:
+    static_assert(numStages % 2 == 0 && numStages >= 4 && numStages <= 12, "4, 6, 8, 10 or 12 stages, in pairs");
+
+    using Oversampler = dsp::Oversampling<SampleType>;
+
+    static constexpr int numPairs = numStages / 2;
+
+    /** The Small Stone's pairs break at 25 and 50 Hz, deeper voicings carry on an octave apart: 100, 200 Hz... */
+    static constexpr double getBreakFrequency(int pair) { return 25.0 * (1 << pair); }
 
     SmallStone()
-        : chain{
-        AllPass(25.0),
-        AllPass(25.0),
-        AllPass(50.0),
-        AllPass(50.0),
-        }
     {
+        for (int pair = 0; pair < numPairs; ++pair)
+            coefficients[pair].setBreakFrequency(getBreakFrequency(pair));
+
+        // The oversamplers are built by prepareToPlay(): designing their filters is most of what an instance costs, and
+        // many are constructed, e.g. for a precision or a crossfade, without ever being prepared.
     }
 
     ~SmallStone() {}
 
-    void prepareToPlay(double newSampleRate)
+    void prepareToPlay(double newSampleRate, int maxBlockSize, int newNumChannels = 2)
     {
-        samplePeriod = 1 / newSampleRate;
-        feedbackSignal.setSize(2, 1);
-        feedbackSignal.clear();
-        for (auto& stage : chain)
+        jassert(newNumChannels > 0 && newNumChannels <= MAX_CHANNELS);
+
+        sampleRate = newSampleRate;
+        numChannels = newNumChannels;
+        oversampledModulation.setSize(numChannels, maxBlockSize * MAX_OVERSAMPLING);
+        lastModulation.assign(static_cast<size_t>(numChannels), SampleType(0));
+
+        if (numChannels != oversampledChannels)
+            createOversamplers(numChannels);
+
+        for (auto& filterType : oversamplers)
         {
-            stage.setSamplePeriod(samplePeriod);
+            for (auto& oversampler : filterType)
+            {
+                oversampler->initProcessing(static_cast<size_t>(maxBlockSize));
+            }
         }
+
+        reset();
     }
 
     void releaseResources()
     {
-        feedbackSignal.setSize(0, 0);
+        oversampledModulation.setSize(0, 0);
     }
 
     /** This is where the magic takes place.
     
-        @param buffer       The buffer with the audio data.
-        @param modulation   The buffer containing the modulation data.
+        @param buffer       The buffer with the audio data, up to the number of channels given to prepareToPlay()
+                            from firstChannel on.
+        @param modulation   The buffer containing the modulation data, one channel per audio channel. The last one is
+                            reused if there are fewer. Read from its first sample.
+        @param startSample  First sample of the buffer to process.
+        @param numSamples   At most the maxBlockSize given to prepareToPlay().
+        @param firstChannel The channel of both buffers this phaser's channel 0 is, when several share them (see
+                            StoneMistressEngine).
     */
-    void processBlock(AudioBuffer<float>& buffer, AudioBuffer<double>& modulation, const int numSamples)
+    void processBlock(AudioBuffer<SampleType>& buffer, AudioBuffer<SampleType>& modulation, const int startSample, const int numSamples, const int firstChannel = 0)
     {
-        const auto numCh = buffer.getNumChannels();
+        STONEMISTRESS_TRACE_SCOPE("SmallStone::processBlock");
 
-        auto bufferData = buffer.getArrayOfWritePointers();
-        auto modData = modulation.getArrayOfWritePointers();
+        const auto numCh = jmin(buffer.getNumChannels() - firstChannel, numChannels);
+        const auto numModCh = modulation.getNumChannels();
 
-        for (int smp = 0; smp < numSamples; ++smp)
+        SampleType* channels[MAX_CHANNELS];
+        const SampleType* modChannels[MAX_CHANNELS];
+
+        if (oversamplingFactor == 1)
         {
             for (int ch = 0; ch < numCh; ++ch)
             {
-                auto sampleValue = bufferData[ch][smp];
-                auto modValue = modData[ch][smp];
+                channels[ch] = buffer.getWritePointer(firstChannel + ch, startSample);
+                modChannels[ch] = modulation.getReadPointer(jmin(firstChannel + ch, numModCh - 1));
+            }
+
+            process(channels, modChannels, numCh, numSamples);
+            return;
+        }
+
+        dsp::AudioBlock<SampleType> block(buffer.getArrayOfWritePointers() + firstChannel, static_cast<size_t>(numCh), static_cast<size_t>(startSample), static_cast<size_t>(numSamples));
+        auto& oversampler = getOversampler();
+        dsp::AudioBlock<SampleType> upsampled;
+
+        {
+            STONEMISTRESS_TRACE_SCOPE("SmallStone upsampling");
+            upsampled = oversampler.processSamplesUp(block);
+            upsampleModulation(modulation, firstChannel, numCh, numSamples);
+        }
+
+        for (int ch = 0; ch < numCh; ++ch)
+        {
+            channels[ch] = upsampled.getChannelPointer(static_cast<size_t>(ch));
+            modChannels[ch] = oversampledModulation.getReadPointer(ch);
+        }
+
+        process(channels, modChannels, numCh, numSamples * oversamplingFactor);
+
+        STONEMISTRESS_TRACE_SCOPE("SmallStone downsampling");
+        oversampler.processSamplesDown(block);
+    }
+
+    /** A channel that turns Color on starts its feedback line from silence. */
+    void setColor(bool shouldBeOn)
+    {
+        for (int ch = 0; ch < MAX_CHANNELS; ++ch)
+            switchColor(ch, shouldBeOn);
+
+        colorSwitch = shouldBeOn;
+    }
+
+    /** Color for one channel only, e.g. one track of a StoneMistressBank. While any channel has it on, the feedback
+        line runs for all of them and adds nothing to the others.
+    */
+    void setColor(int channel, bool shouldBeOn)
+    {
+        jassert(isPositiveAndBelow(channel, MAX_CHANNELS));
+        switchColor(channel, shouldBeOn);
+        colorSwitch = std::any_of(std::begin(feedbackGains), std::end(feedbackGains), [](SampleType gain) { return gain != SampleType(0); });
+    }
+
+    /** @param newMix   0 is dry only, 1 is phaser only. */
+    void setMix(double newMix)
+    {
+        drywet.setMix(newMix);
+    }
+
+    /** The LFO tops out at 8 Hz, so the coefficients don't need to be evaluated at audio rate. With an interval N > 1
+        they are evaluated exactly every N samples and linearly interpolated in between. 1 evaluates every sample.
+
+        @param numSamples   Samples between two exact evaluations, e.g. 8, 16 or 32.
+    */
+    void setControlInterval(int numSamples)
+    {
+        jassert(numSamples > 0);
+        controlInterval = jmax(1, numSamples);
+        interpolationNeedsReset = true;
+    }
+
+    /** Runs the phaser at 1x, 2x or 4x the sample rate. Allocation free, but it clears the phaser state and changes
+        getLatencyInSamples(), so it's meant for quality switches rather than automation.
+    */
+    void setOversampling(int newFactor, bool shouldUseLinearPhase)
+    {
+        jassert(newFactor == 1 || newFactor == 2 || newFactor == MAX_OVERSAMPLING);
+
+        if (newFactor == oversamplingFactor && shouldUseLinearPhase == linearPhase)
+            return;
+
+        oversamplingFactor = newFactor;
+        linearPhase = shouldUseLinearPhase;
+        reset();
+    }
+
+    /** Carries on from where other is, with its settings. Both must have been prepared alike. Doesn't allocate.
+        The state of the oversampling filters can't be copied, they start from silence: the output takes their
+        latency to come in, which is meant to be covered by a crossfade.
+    */
+    void copyStateFrom(const SmallStone& other)
+    {
+        jassert(other.sampleRate == sampleRate && other.numChannels == numChannels);
+
+        setOversampling(other.oversamplingFactor, other.linearPhase);
+
+        if (oversamplingFactor > 1)
+            getOversampler().reset();
+
+        colorSwitch = other.colorSwitch;
+        std::copy(std::begin(other.feedbackGains), std::end(other.feedbackGains), std::begin(feedbackGains));
+        controlInterval = other.controlInterval;
+        interpolationNeedsReset = other.interpolationNeedsReset;
+        modulationNeedsReset = other.modulationNeedsReset;
+
+        std::copy(&other.pairInputs[0][0], &other.pairInputs[0][0] + numPairs * MAX_CHANNELS, &pairInputs[0][0]);
+        std::copy(&other.pairMiddles[0][0], &other.pairMiddles[0][0] + numPairs * MAX_CHANNELS, &pairMiddles[0][0]);
+        std::copy(&other.pairOutputs[0][0], &other.pairOutputs[0][0] + numPairs * MAX_CHANNELS, &pairOutputs[0][0]);
+        std::copy(std::begin(other.feedbackSignal), std::end(other.feedbackSignal), std::begin(feedbackSignal));
+        std::copy(&other.currentCoefficients[0][0], &other.currentCoefficients[0][0] + numPairs * MAX_CHANNELS, &currentCoefficients[0][0]);
+        std::copy(other.lastModulation.begin(), other.lastModulation.end(), lastModulation.begin());
+
+        drywet.copyStateFrom(other.drywet);
+    }
+
+    /** The modulation is about to jump, e.g. because blocks were skipped: the next block starts from its own first
+        value instead of ramping from the last one seen.
+    */
+    void restartModulation()
+    {
+        interpolationNeedsReset = true;
+        modulationNeedsReset = true;
+    }
+
+    /** How long the phaser keeps ringing once its input stops, until a full scale input has decayed below threshold.
+        The worst case is a step: the modulation can sit at 0, where the Break Frequencies are lowest and each stage
+        holds a low frequency for 1 / (pi * fb) seconds (its group delay at DC).
+        Without Color, the slowest pole decays as exp(-2 * pi * 25 * t), on top of the delay through the chain. With
+        Color, the signal recirculates through the whole chain, losing FEEDBACK on every trip. Rounded up by 10 %.
+    */
+    static double getTailLengthSeconds(bool colorIsOn, double threshold)
+    {
+        double chainDelay = 0.0;
+
+        for (int pair = 0; pair < numPairs; ++pair)
+            chainDelay += 2.0 / (MathConstants<double>::pi * getBreakFrequency(pair));
+
+        const auto decayTime = colorIsOn ? chainDelay * std::log(1.0 / (threshold * (1.0 - FEEDBACK))) / -std::log(FEEDBACK)
+                                         : std::log(1.0 / threshold) / (MathConstants<double>::twoPi * getBreakFrequency(0)) + chainDelay;
+
+        return 1.1 * decayTime;
+    }
+
+    /** The lowest notch of the sweep at a modulation value, in Hz, for displays. The dry signal cancels where the
+        stages add up to 180 degrees, each pair turning by 4 * atan(f / fb). With four stages, f1 = 25 Hz + modulation
+        and f2 = 50 Hz + modulation, that's the positive root of f^2 + (f1 + f2) * f - f1 * f2. Deeper voicings are
+        solved by bisection, below f1 where the first pair alone reaches 180 degrees. Analog prototype, without Color.
+    */
+    static double getNotchFrequency(double modulation)
+    {
+        const auto f1 = getBreakFrequency(0) + modulation;
+
+        if constexpr (numPairs == 2)
+        {
+            const auto f2 = getBreakFrequency(1) + modulation;
+            return 0.5 * (std::sqrt((f1 + f2) * (f1 + f2) + 4.0 * f1 * f2) - (f1 + f2));
+        }
+        else
+        {
+            auto low = 0.0, high = f1;
+
+            for (int step = 0; step < 40; ++step)
+            {
+                const auto f = 0.5 * (low + high);
+                auto phase = 0.0;
+
+                for (int pair = 0; pair < numPairs; ++pair)
+                    phase += 4.0 * std::atan(f / (getBreakFrequency(pair) + modulation));
+
+                (phase < MathConstants<double>::pi ? low : high) = f;
+            }
+
+            return 0.5 * (low + high);
+        }
+    }
+
+    int getOversamplingFactor() const { return oversamplingFactor; }
+    bool isLinearPhase() const { return linearPhase; }
+
+    /** Delay added by the oversampling filters, in samples at the base rate. */
+    int getLatencyInSamples() const
+    {
+        return getLatencyInSamples(oversamplingFactor, linearPhase);
+    }
+
+    /** The delay setOversampling(factor, useLinearPhase) would add, 0 until prepared. It only reads the filters
+        prepareToPlay() built, so any thread may ask while the audio thread processes.
+    */
+    int getLatencyInSamples(int factor, bool useLinearPhase) const
+    {
+        const auto& oversampler = oversamplers[useLinearPhase ? 1 : 0][factor == MAX_OVERSAMPLING ? 1 : 0];
+        return factor > 1 && oversampler != nullptr ? roundToInt(oversampler->getLatencyInSamples()) : 0;
+    }
+
+    /** The largest latency any setOversampling() configuration can have, once prepared. */
+    int getMaxLatencyInSamples() const
+    {
+        int maxLatency = 0;
+
+        for (auto& filterType : oversamplers)
+            for (auto& oversampler : filterType)
+                if (oversampler != nullptr)
+                    maxLatency = jmax(maxLatency, roundToInt(oversampler->getLatencyInSamples()));
+
+        return maxLatency;
+    }
+
+private:
+
+    void switchColor(int channel, bool shouldBeOn)
+    {
+        if (shouldBeOn && feedbackGains[channel] == SampleType(0))
+            feedbackSignal[channel] = SampleType(0);
+
+        feedbackGains[channel] = shouldBeOn ? static_cast<SampleType>(FEEDBACK) : SampleType(0);
+    }
+
+    void createOversamplers(int numOversampledChannels)
+    {
+        for (int numFactors = 1; numFactors <= 2; ++numFactors)
+        {
+            // Integer latency, so the dry signal and the host can be compensated exactly.
+            oversamplers[0][numFactors - 1] = std::make_unique<Oversampler>(static_cast<size_t>(numOversampledChannels), numFactors, Oversampler::filterHalfBandPolyphaseIIR, false, true);
+            oversamplers[1][numFactors - 1] = std::make_unique<Oversampler>(static_cast<size_t>(numOversampledChannels), numFactors, Oversampler::filterHalfBandFIREquiripple, false, true);
+        }
+
+        oversampledChannels = numOversampledChannels;
+    }
+
+    Oversampler& getOversampler() const
+    {
+        return *oversamplers[linearPhase ? 1 : 0][oversamplingFactor == MAX_OVERSAMPLING ? 1 : 0];
+    }
+
+    // Clears the whole phaser and sets it up for the current oversampling factor.
+    void reset()
+    {
+        samplePeriod = 1.0 / (sampleRate * oversamplingFactor);
+        interpolationNeedsReset = true;
+        modulationNeedsReset = true;
+        drywet.prepareToPlay(sampleRate * oversamplingFactor);
+
+        for (auto& coefficient : coefficients)
+        {
+            coefficient.setSamplePeriod(samplePeriod);
+        }
+        for (int pair = 0; pair < numPairs; ++pair)
+        {
+            std::fill(std::begin(pairInputs[pair]), std::end(pairInputs[pair]), SampleType(0));
+            std::fill(std::begin(pairMiddles[pair]), std::end(pairMiddles[pair]), SampleType(0));
+            std::fill(std::begin(pairOutputs[pair]), std::end(pairOutputs[pair]), SampleType(0));
+        }
+
+        std::fill(std::begin(feedbackSignal), std::end(feedbackSignal), SampleType(0));
+
+        if (oversamplingFactor > 1 && oversampledChannels > 0)
+        {
+            getOversampler().reset();
+        }
+    }
+
+    // The LFO is far below the audio band, a linear ramp between the base rate values is all the upsampling it needs.
+    // One channel per audio channel, the last modulation channel standing in for the missing ones as on the base rate.
+    void upsampleModulation(AudioBuffer<SampleType>& modulation, const int firstChannel, const int numCh, const int numSamples)
+    {
+        for (int ch = 0; ch < numCh; ++ch)
+        {
+            auto source = modulation.getReadPointer(jmin(firstChannel + ch, modulation.getNumChannels() - 1));
+            auto destination = oversampledModulation.getWritePointer(ch);
+            auto previous = modulationNeedsReset ? source[0] : lastModulation[ch];
 
-                if (colorSwitch) // Adds feedback up at first stage.
+            for (int smp = 0; smp < numSamples; ++smp)
+            {
+                const auto step = (source[smp] - previous) / oversamplingFactor;
+
+                for (int i = 1; i <= oversamplingFactor; ++i)
                 {
-                    sampleValue += FEEDBACK * feedbackSignal.getSample(ch, 0);
+                    *destination++ = previous + step * i;
                 }
 
-                for (int stage = 0; stage < STAGES; ++stage)
+                previous = source[smp];
+            }
+
+            lastModulation[ch] = previous;
+        }
+
+        modulationNeedsReset = false;
+    }
+
+    void process(SampleType* const* channels, const SampleType* const* modulation, const int numCh, const int numSamples)
+    {
+        CpuDispatch::run([&](auto registerSize)
+        {
+            processInGroupsOf<decltype(registerSize)::value / static_cast<int>(sizeof(SampleType))>(channels, modulation, numCh, numSamples);
+        });
+    }
+
+    /* The chain is a recurrence, so a group takes as long as the chain's latency whatever its width: the groups are
+       made as narrow as the channels allow, down to a dsp::SIMDRegister. Stereo stays one SSE group with AVX-512 too,
+       where a wider register would only cost more to fill and empty. */
+    template <int numLanes>
+    void processInGroupsOf(SampleType* const* channels, const SampleType* const* modulation, const int numCh, const int numSamples)
+    {
+        if constexpr (numLanes > static_cast<int>(dsp::SIMDRegister<SampleType>::SIMDNumElements))
+        {
+            if (numCh <= numLanes / 2)
+            {
+                processInGroupsOf<numLanes / 2>(channels, modulation, numCh, numSamples);
+                return;
+            }
+        }
+
+        // A single group gets its own instantiation, where the compiler knows there's only one and keeps it in registers.
+        if (numCh <= numLanes)
+            processGroups<numLanes, 1>(channels, modulation, numCh, numSamples);
+        else
+            processGroups<numLanes, MAX_CHANNELS / numLanes>(channels, modulation, numCh, numSamples);
+    }
+
+    // Calls function(pair) for every pair, unrolled at compile time: the pair is a std::integral_constant.
+    template <typename Function>
+    static void forEachPair(Function&& function)
+    {
+        forEachPair(function, std::make_integer_sequence<int, numPairs>());
+    }
+
+    template <typename Function, int... pairs>
+    static void forEachPair(Function& function, std::integer_sequence<int, pairs...>)
+    {
+        (function(std::integral_constant<int, pairs>()), ...);
+    }
+
+    // One register of channels, with its own state for the whole chain. It's a local copy of the members for the
+    // length of a block: that way it can't alias the audio buffers, and isn't reloaded after every sample written.
+    template <int numLanes>
+    struct ChannelGroup
+    {
+        using Lanes = LaneRegister<SampleType, numLanes>;
+
+        void load(const SmallStone& phaser, int first)
+        {
+            forEachPair([&](auto pair)
+            {
+                chain[pair].load(phaser.pairInputs[pair] + first, phaser.pairMiddles[pair] + first, phaser.pairOutputs[pair] + first);
+                currentCoefficients[pair] = Lanes::fromRawArray(phaser.currentCoefficients[pair] + first);
+            });
+
+            feedbackSignal = Lanes::fromRawArray(phaser.feedbackSignal + first);
+            feedbackGains = Lanes::fromRawArray(phaser.feedbackGains + first);
+        }
+
+        void store(SmallStone& phaser, int first) const
+        {
+            forEachPair([&](auto pair)
+            {
+                chain[pair].store(phaser.pairInputs[pair] + first, phaser.pairMiddles[pair] + first, phaser.pairOutputs[pair] + first);
+                currentCoefficients[pair].copyToRawArray(phaser.currentCoefficients[pair] + first);
+            });
+
+            feedbackSignal.copyToRawArray(phaser.feedbackSignal + first);
+        }
+
+        AllPassPair<SampleType, numLanes> chain[numPairs];
+        Lanes feedbackSignal; // 1 Sample big, one lane per channel.
+        Lanes feedbackGains; // FEEDBACK where Color is on, 0 elsewhere.
+        Lanes currentCoefficients[numPairs]; // Interpolated coefficients, one lane per channel.
+        Lanes targets[numPairs];
+        Lanes increments[numPairs];
+    };
+
+    /* The chain is a recurrence across samples but not across the lanes of a frame, so everything else is done a
+       chunk at a time around it: the input and the modulation are laid out frame by frame (see toFrames()), the
+       coefficients of the whole chunk are evaluated in one flat loop that vectorises, division included, and the
+       chain loads and stores whole registers. */
+    template <int numLanes, int maxGroups>
+    void processGroups(SampleType* const* channels, const SampleType* const* modulation, const int numCh, const int numSamples)
+    {
+        const auto numGroups = maxGroups == 1 ? 1 : (numCh + numLanes - 1) / numLanes;
+        ChannelGroup<numLanes> groups[maxGroups];
+
+        for (int group = 0; group < numGroups; ++group)
+            groups[group].load(*this, group * numLanes);
+
+        if (controlInterval > 1 && interpolationNeedsReset)
+        {
+            for (int group = 0; group < numGroups; ++group)
+                for (int pair = 0; pair < numPairs; ++pair)
+                    groups[group].currentCoefficients[pair] = evaluate<numLanes>(coefficients[pair], modulation + group * numLanes, jmin(numLanes, numCh - group * numLanes), 0);
+
+            interpolationNeedsReset = false;
+        }
+
+        int segmentRemaining = 0; // Control rate segments carry on from one chunk to the next.
+
+        for (int chunkStart = 0; chunkStart < numSamples; chunkStart += PHASER_CHUNK)
+        {
+            const auto chunkLength = jmin(PHASER_CHUNK, numSamples - chunkStart);
+
+            for (int group = 0; group < numGroups; ++group)
+                toFrames<numLanes>(channels + group * numLanes, jmin(numLanes, numCh - group * numLanes), chunkStart, chunkLength, frames + group * PHASER_CHUNK * numLanes);
+
+            if (controlInterval > 1)
+                processAtControlRate(groups, numGroups, modulation, numCh, chunkStart, chunkLength, numSamples, segmentRemaining);
+            else
+                processAtAudioRate(groups, numGroups, modulation, numCh, chunkStart, chunkLength);
+
+            for (int group = 0; group < numGroups; ++group)
+                fromFrames<numLanes>(frames + group * PHASER_CHUNK * numLanes, jmin(numLanes, numCh - group * numLanes), chunkStart, chunkLength, channels + group * numLanes);
+        }
+
+        for (int group = 0; group < numGroups; ++group)
+            groups[group].store(*this, group * numLanes);
+    }
+
+    // Samples startSample to startSample + numSamples of numLanesUsed channels, frame by frame: lane l of sample smp goes
+    // to frames[smp * numLanes + l]. The lanes past the last channel are silent.
+    template <int numLanes>
+    static void toFrames(const SampleType* const* sources, int numLanesUsed, int startSample, int numSamples, SampleType* destination)
+    {
+        for (int lane = 0; lane < numLanes; ++lane)
+        {
+            if (lane < numLanesUsed)
+            {
+                for (int smp = 0; smp < numSamples; ++smp)
+                    destination[smp * numLanes + lane] = sources[lane][startSample + smp];
+            }
+            else
+            {
+                for (int smp = 0; smp < numSamples; ++smp)
+                    destination[smp * numLanes + lane] = SampleType(0);
+            }
+        }
+    }
+
+    // The other way around, for the channels only.
+    template <int numLanes>
+    static void fromFrames(const SampleType* source, int numLanesUsed, int startSample, int numSamples, SampleType* const* destinations)
+    {
+        for (int lane = 0; lane < numLanesUsed; ++lane)
+            for (int smp = 0; smp < numSamples; ++smp)
+                destinations[lane][startSample + smp] = source[smp * numLanes + lane];
+    }
+
+    template <int numLanes>
+    void processAtAudioRate(ChannelGroup<numLanes>* groups, const int numGroups, const SampleType* const* modulation, const int numCh, const int startSample, const int numSamples)
+    {
+        using Lanes = LaneRegister<SampleType, numLanes>;
+
+        for (int group = 0; group < numGroups; ++group)
+        {
+            const auto offset = group * PHASER_CHUNK * numLanes;
+
+            toFrames<numLanes>(modulation + group * numLanes, jmin(numLanes, numCh - group * numLanes), startSample, numSamples, modulationFrames + offset);
+
+            forEachPair([&](auto pair)
+            {
+                coefficients[pair].getCoefficients(modulationFrames + offset, coefficientFrames[pair] + offset, numSamples * numLanes);
+            });
+        }
+
+        const auto mixIsSmoothing = drywet.isSmoothing();
+        auto gains = drywet.getCurrentGains();
+
+        for (int smp = 0; smp < numSamples; ++smp)
+        {
+            if (mixIsSmoothing)
+                gains = drywet.getNextGains();
+
+            // The groups are independent, keeping them in one loop lets their dependency chains overlap.
+            for (int group = 0; group < numGroups; ++group)
+            {
+                const auto frame = (group * PHASER_CHUNK + smp) * numLanes;
+                Lanes pairCoefficients[numPairs];
+
+                forEachPair([&](auto pair) { pairCoefficients[pair] = Lanes::fromRawArray(coefficientFrames[pair] + frame); });
+
+                processFrame(groups[group], frames + frame, pairCoefficients, gains);
+            }
+        }
+    }
+
+    // The coefficient of every channel in the group, each at its own modulation value.
+    template <int numLanes>
+    static LaneRegister<SampleType, numLanes> evaluate(const AllPassCoefficient& coefficient, const SampleType* const* modulation, int numLanesUsed, int smp)
+    {
+        alignas(64) SampleType lanes[numLanes] = {};
+
+        for (int lane = 0; lane < numLanesUsed; ++lane)
+            lanes[lane] = modulation[lane][smp];
+
+        coefficient.getCoefficients(lanes, lanes, numLanes);
+        return LaneRegister<SampleType, numLanes>::fromRawArray(lanes);
+    }
+
+    // Runs one frame of a channel group through the feedback line and all the pairs and mixes it over the dry frame,
+    // in place.
+    template <int numLanes>
+    void processFrame(ChannelGroup<numLanes>& group, SampleType* frame, const LaneRegister<SampleType, numLanes>* pairCoefficients, typename DryWet<SampleType>::Gains gains)
+    {
+        const auto dry = LaneRegister<SampleType, numLanes>::fromRawArray(frame);
+        auto x = dry;
+
+        if (colorSwitch) // Adds feedback up at first stage.
+        {
+            x += group.feedbackSignal * group.feedbackGains;
+        }
+
+        forEachPair([&](auto pair)
+        {
+            x = group.chain[pair].processSample(x, pairCoefficients[pair]);
+        });
+
+        if (colorSwitch)
+        {
+            group.feedbackSignal = x;
+        }
+
+        x = dry * gains.dry + x * gains.wet;
+        x.copyToRawArray(frame);
+    }
+
+    /* Each segment ramps from the coefficients evaluated at the end of the previous segment to the ones evaluated at
+       its own last sample, so the coefficients are exact on every segment boundary and never lag the modulation. The
+       segments start from the beginning of the block, segmentRemaining is what's left of the current one. */
+    template <int numLanes>
+    void processAtControlRate(ChannelGroup<numLanes>* groups, const int numGroups, const SampleType* const* modulation, const int numCh, const int startSample, const int numSamples, const int blockLength, int& segmentRemaining)
+    {
+        const auto mixIsSmoothing = drywet.isSmoothing();
+        auto gains = drywet.getCurrentGains();
+
+        for (int smp = 0; smp < numSamples;)
+        {
+            if (segmentRemaining == 0)
+            {
+                const auto segmentLength = jmin(controlInterval, blockLength - (startSample + smp));
+                const auto last = startSample + smp + segmentLength - 1;
+
+                for (int group = 0; group < numGroups; ++group)
                 {
-                    sampleValue = chain[stage].processSample(sampleValue, ch, modValue);
+                    auto& state = groups[group];
+
+                    forEachPair([&](auto pair)
+                    {
+                        state.targets[pair] = evaluate<numLanes>(coefficients[pair], modulation + group * numLanes, jmin(numLanes, numCh - group * numLanes), last);
+                        state.increments[pair] = (state.targets[pair] - state.currentCoefficients[pair]) * (SampleType(1) / segmentLength);
+                    });
                 }
 
-                if (colorSwitch)
+                segmentRemaining = segmentLength;
+            }
+
+            const auto segmentEnd = smp + jmin(segmentRemaining, numSamples - smp);
+            segmentRemaining -= segmentEnd - smp;
+
+            for (; smp < segmentEnd; ++smp)
+            {
+                if (mixIsSmoothing)
+                    gains = drywet.getNextGains();
+
+                for (int group = 0; group < numGroups; ++group)
                 {
-                    feedbackSignal.setSample(ch, 0, sampleValue);
+                    auto& state = groups[group];
+
+                    forEachPair([&](auto pair) { state.currentCoefficients[pair] += state.increments[pair]; });
+
+                    processFrame(state, frames + (group * PHASER_CHUNK + smp) * numLanes, state.currentCoefficients, gains);
                 }
+            }
 
-                bufferData[ch][smp] = static_cast<float>(sampleValue);
+            // Land exactly on the evaluated values, so rounding errors don't build up across segments.
+            if (segmentRemaining == 0)
+            {
+                for (int group = 0; group < numGroups; ++group)
+                {
+                    auto& state = groups[group];
+
+                    forEachPair([&](auto pair) { state.currentCoefficients[pair] = state.targets[pair]; });
+                }
             }
         }
     }
 
-    void setColor()
-    {
-        colorSwitch = !colorSwitch;
-    }
+    AllPassCoefficient coefficients[numPairs];
 
-private:
+    // The state of every channel, in the same place whatever the group width: x[n - 1], m[n - 1] and y[n - 1] of every
+    // pair, the feedback sample and gain and the interpolated coefficients.
+    alignas(64) SampleType pairInputs[numPairs][MAX_CHANNELS] = {};
+    alignas(64) SampleType pairMiddles[numPairs][MAX_CHANNELS] = {};
+    alignas(64) SampleType pairOutputs[numPairs][MAX_CHANNELS] = {};
+    alignas(64) SampleType feedbackSignal[MAX_CHANNELS] = {};
+    alignas(64) SampleType feedbackGains[MAX_CHANNELS] = {};
+    alignas(64) SampleType currentCoefficients[numPairs][MAX_CHANNELS] = {};
+
+    // The chunk being processed, laid out by toFrames(), one group after the other: the audio, the modulation and the
+    // coefficients of every pair. Written before they are read, so left uninitialised.
+    alignas(64) SampleType frames[PHASER_CHUNK * MAX_CHANNELS];
+    alignas(64) SampleType modulationFrames[PHASER_CHUNK * MAX_CHANNELS];
+    alignas(64) SampleType coefficientFrames[numPairs][PHASER_CHUNK * MAX_CHANNELS];
 
-    AllPass chain[4];
-    AudioBuffer<float> feedbackSignal; // 1 Sample big.
+    std::unique_ptr<Oversampler> oversamplers[2][2]; // [linear phase][2x, 4x]
+    AudioBuffer<SampleType> oversampledModulation;
+    DryWet<SampleType> drywet;
+    std::vector<SampleType> lastModulation; // Last base rate value of every modulation channel.
 
+    double sampleRate = 44100.0;
     double samplePeriod = 1.0;
+    int numChannels = 2;
+    int oversampledChannels = 0; // Channels the oversamplers were built for.
+    int controlInterval = 1;
+    int oversamplingFactor = 1;
+    bool linearPhase = false;
+    bool interpolationNeedsReset = true;
+    bool modulationNeedsReset = true;
     bool colorSwitch = false;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SmallStone)
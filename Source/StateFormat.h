@@ -0,0 +1,121 @@
+/*
+  ==============================================================================
+
+    StateFormat.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "Parameters.h"
+
+#define STATE_MAGIC 0x54534d53 // "SMST" in the first four bytes.
+#define STATE_VERSION 1
+
+/*
+ * The plugin state as the host saves it, a few dozen bytes instead of an XML document:
+ *
+ *   int32   STATE_MAGIC
+ *   int32   version
+ *   int32   number of values
+ *   n x     parameter ID (UTF-8, zero terminated), float32 value in the units of the parameter
+ *   int32   preset index, -1 if none                                                          (version 1)
+ *
+ * All little-endian. Values are stored by ID, so parameters may come and go: unknown IDs are skipped and missing ones
+ * keep what the caller put in. A new version only appends fields, an older reader ignores them.
+ * Sessions saved before this format hold the XML of the AudioProcessorValueTreeState, read() turns them down so that
+ * the caller can fall back to readXml().
+*/
+class StateFormat
+{
+public:
+
+    static void write(const Parameters::Values& values, int presetIndex, MemoryBlock& destData)
+    {
+        MemoryOutputStream stream(destData, false);
+
+        stream.writeInt(STATE_MAGIC);
+        stream.writeInt(STATE_VERSION);
+        stream.writeInt(Parameters::numParameters);
+
+        for (int index = 0; index < Parameters::numParameters; ++index)
+        {
+            stream.writeString(Parameters::ids[index]);
+            stream.writeFloat(values[static_cast<size_t>(index)]);
+        }
+
+        stream.writeInt(presetIndex);
+    }
+
+    /** Returns false and leaves values and presetIndex alone if data is not in this format, or is cut short. */
+    static bool read(const void* data, int sizeInBytes, Parameters::Values& values, int& presetIndex)
+    {
+        if (data == nullptr || sizeInBytes < 12)
+            return false;
+
+        MemoryInputStream stream(data, static_cast<size_t>(sizeInBytes), false);
+
+        if (stream.readInt() != STATE_MAGIC)
+            return false;
+
+        const auto version = stream.readInt();
+        const auto numValues = stream.readInt();
+
+        if (version < 1 || numValues < 0)
+            return false;
+
+        auto newValues = values;
+
+        for (int i = 0; i < numValues; ++i)
+        {
+            const auto id = stream.readString();
+
+            if (stream.getNumBytesRemaining() < 4)
+                return false;
+
+            const auto value = stream.readFloat();
+
+            for (int index = 0; index < Parameters::numParameters; ++index)
+            {
+                if (id == Parameters::ids[index])
+                {
+                    newValues[static_cast<size_t>(index)] = value;
+                    break;
+                }
+            }
+        }
+
+        if (stream.getNumBytesRemaining() < 4)
+            return false;
+
+        presetIndex = stream.readInt();
+        values = newValues;
+        return true;
+    }
+
+    /** Reads the XML of the AudioProcessorValueTreeState, one PARAM child with an id and a value per parameter, in the
+        units of the parameter. Returns false and leaves values alone if xml isn't a tree of type stateType.
+    */
+    static bool readXml(const XmlElement& xml, const Identifier& stateType, Parameters::Values& values)
+    {
+        if (! xml.hasTagName(stateType.toString()))
+            return false;
+
+        for (auto* param : xml.getChildWithTagNameIterator("PARAM"))
+        {
+            const auto id = param->getStringAttribute("id");
+
+            for (int index = 0; index < Parameters::numParameters; ++index)
+            {
+                if (id == Parameters::ids[index])
+                {
+                    values[static_cast<size_t>(index)] = static_cast<float>(param->getDoubleAttribute("value", values[static_cast<size_t>(index)]));
+                    break;
+                }
+            }
+        }
+
+        return true;
+    }
+};
@@ -0,0 +1,248 @@
+/*
+  ==============================================================================
+
+    StoneMistressBank.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "CpuDispatch.h"
+#include "Delays.h"
+#include "DryWet.h"
+#include "Oscillator.h"
+#include "Profiling.h"
+#include "SmallStone.h"
+
+// Tracks per bank. Their channels fill two registers of the widest instruction set the project is compiled for, which
+// is what the phaser runs side by side. The loops themselves are compiled for the CPU's one (see CpuDispatch).
+#if defined (__AVX512F__)
+ #define STONEMISTRESS_BANK_LANES 16
+#elif defined (__AVX2__) || defined (__AVX__)
+ #define STONEMISTRESS_BANK_LANES 8
+#else
+ #define STONEMISTRESS_BANK_LANES 4
+#endif
+
+/*
+ * Runs numLanes independent Stone Mistress instances (one per track, mono or stereo) through one set of units.
+ * Every track is two channels of the same ModulationGenerator -> SmallStone -> Chorus chain StoneMistressEngine runs,
+ * track t on channels 2t and 2t + 1: the phaser processes them a register of channels at a time (see SmallStone), so
+ * a bank costs about as many phaser instances as it fills registers rather than one per track, and the chorus reads
+ * every channel's delay line in one loop.
+ * What differs from track to track lives outside the shared state: every track has a ModulationGenerator of its own,
+ * writing its two channels of the modulation, and Color is set per channel. The units run wet only, and every track
+ * mixes its own dry signal back in after each of them, with a DryWet of its own.
+ * A track comes out as it would from a StoneMistressEngine with the same settings, up to rounding: the wet signal is
+ * scaled by the mix after the unit rather than inside it. StoneMistressBenchmark checks the difference.
+ * Only the lanes that have a track run, so a bank that isn't full costs less: a single track costs about what an
+ * engine does. Unlike the engine, a bank never sleeps, and the phaser isn't oversampled.
+*/
+template <int numLanes>
+class StoneMistressBank
+{
+public:
+
+    static constexpr int numChannels = 2 * numLanes;
+
+    static_assert(numChannels <= MAX_CHANNELS, "Two channels per track");
+
+    StoneMistressBank(double defaultRate, double defaultPhaserDepth, double defaultChorusDepth)
+    {
+        for (auto& generator : generators)
+        {
+            generator.setRate(defaultRate);
+            generator.setPhaserDepth(defaultPhaserDepth);
+            generator.setChorusDepth(defaultChorusDepth);
+        }
+
+        phaser.setMix(1.0);
+        chorus.setMix(1.0);
+    }
+
+    ~StoneMistressBank() {}
+
+    void prepareToPlay(double newSampleRate, int maxBlockSize)
+    {
+        sliceSize = maxBlockSize;
+
+        for (auto& generator : generators)
+            generator.prepareToPlay(newSampleRate, 2);
+
+        for (int lane = 0; lane < numLanes; ++lane)
+        {
+            phaserMixes[lane].prepareToPlay(newSampleRate);
+            chorusMixes[lane].prepareToPlay(newSampleRate);
+        }
+
+        phaser.prepareToPlay(newSampleRate, maxBlockSize, numChannels);
+        chorus.prepareToPlay(newSampleRate, maxBlockSize, numChannels);
+
+        audio.setSize(numChannels, maxBlockSize);
+        dry.setSize(numChannels, maxBlockSize);
+        phaserModulation.setSize(numChannels, maxBlockSize);
+        chorusModulation.setSize(numChannels, maxBlockSize);
+    }
+
+    void releaseResources()
+    {
+        phaser.releaseResources();
+        chorus.releaseResources();
+
+        audio.setSize(0, 0);
+        dry.setSize(0, 0);
+        phaserModulation.setSize(0, 0);
+        chorusModulation.setSize(0, 0);
+    }
+
+    void setRate(int lane, double newValue)         { generators[lane].setRate(newValue); }
+    void setPhaserDepth(int lane, double newValue)  { generators[lane].setPhaserDepth(newValue); }
+    void setChorusDepth(int lane, double newValue)  { generators[lane].setChorusDepth(newValue); }
+    void setPhaserMix(int lane, double newValue)    { phaserMixes[lane].setMix(newValue); }
+    void setChorusMix(int lane, double newValue)    { chorusMixes[lane].setMix(newValue); }
+
+    void setColor(int lane, bool shouldBeOn)
+    {
+        phaser.setColor(2 * lane, shouldBeOn);
+        phaser.setColor(2 * lane + 1, shouldBeOn);
+    }
+
+    /** See SmallStone::setControlInterval(), for every track. */
+    void setPhaserControlInterval(int numSamples) { phaser.setControlInterval(numSamples); }
+
+    /** See Chorus::setInterpolation(), for every track. */
+    void setChorusInterpolation(ChorusInterpolation::Kernel newKernel) { chorus.setInterpolation(newKernel); }
+
+    /** Processes up to numLanes tracks in place, track t in lane t. All of them must hold numSamples samples, one or two
+        channels: a mono track is processed as two identical channels and gets the first one back. The lanes without a
+        track stand still, LFO included, and pick up from there when a track comes back to them.
+    */
+    void processBlock(AudioBuffer<float>* const* tracks, int numTracks, int numSamples)
+    {
+        jassert(numTracks <= numLanes);
+        jassert(sliceSize > 0); // Not prepared.
+
+        STONEMISTRESS_TRACE_SCOPE("StoneMistressBank::processBlock");
+
+        // Every unit is sized for maxBlockSize, longer blocks go through in slices.
+        for (int startSample = 0; startSample < numSamples; startSample += sliceSize)
+        {
+            const auto numThisTime = jmin(sliceSize, numSamples - startSample);
+
+            readTracks(tracks, numTracks, startSample, numThisTime);
+            processSlice(numTracks, numThisTime);
+            writeTracks(tracks, numTracks, startSample, numThisTime);
+        }
+    }
+
+private:
+
+    void readTracks(AudioBuffer<float>* const* tracks, int numTracks, int startSample, int numSamples)
+    {
+        for (int lane = 0; lane < numTracks; ++lane)
+            for (int ch = 0; ch < 2; ++ch)
+                audio.copyFrom(2 * lane + ch, 0, *tracks[lane], jmin(ch, tracks[lane]->getNumChannels() - 1), startSample, numSamples);
+    }
+
+    void writeTracks(AudioBuffer<float>* const* tracks, int numTracks, int startSample, int numSamples)
+    {
+        for (int lane = 0; lane < numTracks; ++lane)
+            for (int ch = 0; ch < jmin(2, tracks[lane]->getNumChannels()); ++ch)
+                tracks[lane]->copyFrom(ch, startSample, audio, 2 * lane + ch, 0, numSamples);
+    }
+
+    void processSlice(int numTracks, int numSamples)
+    {
+        // The channels of the lanes in use: the units process as many as the buffer has.
+        AudioBuffer<float> active(audio.getArrayOfWritePointers(), 2 * numTracks, numSamples);
+
+        // 1-4. Every track's LFO, scaled and clamped, into its own two channels of the modulation.
+        {
+            STONEMISTRESS_TRACE_SCOPE("1-4. Modulation");
+
+            for (int lane = 0; lane < numTracks; ++lane)
+            {
+                AudioBuffer<float> trackPhaserModulation(phaserModulation.getArrayOfWritePointers() + 2 * lane, 2, numSamples);
+                AudioBuffer<float> trackChorusModulation(chorusModulation.getArrayOfWritePointers() + 2 * lane, 2, numSamples);
+
+                generators[lane].getNextAudioBlock(trackPhaserModulation, trackChorusModulation, numSamples);
+            }
+        }
+
+        // 5. The phaser, wet only, then every track's own mix.
+        {
+            STONEMISTRESS_TRACE_SCOPE("5. Phaser");
+            keepDry(numTracks, numSamples);
+            phaser.processBlock(active, phaserModulation, 0, numSamples);
+            mixTracks(phaserMixes, numTracks, numSamples);
+        }
+
+        // 6. The chorus over the mixed phaser output, the same way.
+        {
+            STONEMISTRESS_TRACE_SCOPE("6. Chorus");
+            keepDry(numTracks, numSamples);
+            chorus.processBlock(active, chorusModulation, 0, numSamples);
+            mixTracks(chorusMixes, numTracks, numSamples);
+        }
+    }
+
+    void keepDry(int numTracks, int numSamples)
+    {
+        for (int ch = 0; ch < 2 * numTracks; ++ch)
+            dry.copyFrom(ch, 0, audio, ch, 0, numSamples);
+    }
+
+    // The units leave wet * MIX_LEVEL, which the wet gain of the track's mix replaces: the same gains, sample by sample,
+    // as a unit with that mix would use.
+    void mixTracks(DryWet<float>* mixes, int numTracks, int numSamples)
+    {
+        constexpr auto wetScale = static_cast<float>(1.0 / MIX_LEVEL);
+
+        CpuDispatch::run([&](auto)
+        {
+            for (int lane = 0; lane < numTracks; ++lane)
+            {
+                auto& mix = mixes[lane];
+                const float* dryData[2] = { dry.getReadPointer(2 * lane), dry.getReadPointer(2 * lane + 1) };
+                float* wetData[2] = { audio.getWritePointer(2 * lane), audio.getWritePointer(2 * lane + 1) };
+
+                if (! mix.isSmoothing())
+                {
+                    const auto gains = mix.getCurrentGains();
+                    const auto wetGain = gains.wet * wetScale;
+
+                    for (int ch = 0; ch < 2; ++ch)
+                        for (int smp = 0; smp < numSamples; ++smp)
+                            wetData[ch][smp] = dryData[ch][smp] * gains.dry + wetData[ch][smp] * wetGain;
+                }
+                else
+                {
+                    for (int smp = 0; smp < numSamples; ++smp)
+                    {
+                        const auto gains = mix.getNextGains();
+                        const auto wetGain = gains.wet * wetScale;
+
+                        for (int ch = 0; ch < 2; ++ch)
+                            wetData[ch][smp] = dryData[ch][smp] * gains.dry + wetData[ch][smp] * wetGain;
+                    }
+                }
+            }
+        });
+    }
+
+    ModulationGenerator<float> generators[numLanes];
+    SmallStone<float> phaser;
+    Chorus<float> chorus;
+    DryWet<float> phaserMixes[numLanes];
+    DryWet<float> chorusMixes[numLanes];
+
+    AudioBuffer<float> audio; // Two channels per track, see above.
+    AudioBuffer<float> dry; // What the unit being run mixes over.
+    AudioBuffer<float> phaserModulation;
+    AudioBuffer<float> chorusModulation;
+
+    int sliceSize = 0; // maxBlockSize, the longest slice the units are prepared for.
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StoneMistressBank)
+};
@@ -0,0 +1,475 @@
+/*
+  ==============================================================================
+
+    StoneMistressEngine.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "Delays.h"
+#include "Oscillator.h"
+#include "Profiling.h"
+#include "SmallStone.h"
+#include "Telemetry.h"
+#include "WorkerPool.h"
+
+#define SILENCE_THRESHOLD 1.0e-5 // -100 dBFS
+#define PARALLEL_MIN_SAMPLES 256 // Shorter slices run every range on the calling thread, waking the workers costs more.
+#define CHORUS_REALTIME_ERROR -30.0 // dB, chorus interpolation error allowed while playing (see ChorusInterpolation::pick()).
+#define CHORUS_OFFLINE_ERROR -55.0 // dB, the same for bounces and offline renders: only the sinc meets it.
+
+/*
+ * The complete Stone Mistress signal chain, kept apart from the AudioProcessor so that it can be
+ * driven by other hosts as well (e.g. the offline renderer in Tools/StoneMistressRender).
+ * ModulationGenerator (LFO + depths) -> SmallStone -> Chorus, each unit mixing its own dry signal in as it processes.
+ * Every unit runs in SampleType, float or double, modulation included, so neither path converts per sample.
+ * Any channel count up to MAX_CHANNELS, from mono to Ambisonic beds: every channel gets its own LFO phase (see
+ * ModulationGenerator) and its own lane in the phaser. With several chorus voices, the LFO writes a chorus modulation
+ * channel for every voice of every channel.
+ *
+ * Once the input has been silent for longer than the tail, the engine sleeps: it outputs silence without running any
+ * unit, and only advances the LFO phase so that the sweep picks up in time. The first block with signal wakes it up.
+ *
+ * While a Telemetry is attached and enabled, every block reports the time each unit took, the output levels and trace
+ * points of the LFO and the notch of channel 0.
+ *
+ * Apart from the LFO, which is generated once for all of them, the channels don't depend on each other. With parallel
+ * processing on (offline renders only), prepareToPlay() splits them into ranges with a phaser and a
+ * chorus each, as many as there are threads in the WorkerPool and a whole number of vector registers wide where there
+ * are enough channels, and every slice runs the ranges side by side. The output is the same as on one thread, bit for
+ * bit with the portable kernels: the others may round differently where a narrower range gets a narrower register.
+*/
+template <typename SampleType>
+class StoneMistressEngine
+{
+public:
+
+    StoneMistressEngine(double defaultRate, double defaultPhaserDepth, double defaultChorusDepth)
+        : modulation(defaultRate, defaultPhaserDepth, defaultChorusDepth)
+    {
+        ranges.add(new ChannelRange());
+    }
+
+    ~StoneMistressEngine() {}
+
+    /** Resets the LFO phase offsets to an even spread over numChannels. */
+    void prepareToPlay(double newSampleRate, int samplesPerBlock, int numChannels = 2)
+    {
+        sampleRate = newSampleRate;
+        maxBlockSize = samplesPerBlock;
+        modulation.prepareToPlay(sampleRate, numChannels);
+        phaserModulationBuffer.setSize(numChannels, samplesPerBlock);
+
+        // Room for the most voices, so that setChorusVoices() only narrows or widens it.
+        chorusModulationBuffer.setSize(numChannels * CHORUS_MAX_VOICES, samplesPerBlock);
+        chorusModulationBuffer.setSize(numChannels * chorusVoices, samplesPerBlock, false, false, true);
+        createRanges(numChannels);
+
+        for (auto* range : ranges)
+        {
+            range->phaser.prepareToPlay(sampleRate, samplesPerBlock, range->numChannels);
+            range->chorus.prepareToPlay(sampleRate, samplesPerBlock, range->numChannels);
+        }
+
+        silentSamples = 0;
+        sleeping = false;
+        traceInterval = jmax(1, roundToInt(sampleRate / TELEMETRY_TRACE_RATE));
+        samplesToNextTracePoint = 0;
+        updateOversampling();
+        updateTail();
+    }
+
+    void releaseResources()
+    {
+        phaserModulationBuffer.setSize(0, 0);
+        chorusModulationBuffer.setSize(0, 0);
+
+        for (auto* range : ranges)
+        {
+            range->phaser.releaseResources();
+            range->chorus.releaseResources();
+        }
+
+        workers.reset();
+    }
+
+    void setRate(double newValue)           { modulation.setRate(newValue); }
+    void setPhaserDepth(double newValue)    { modulation.setPhaserDepth(newValue); }
+    void setChorusDepth(double newValue)    { modulation.setChorusDepth(newValue); }
+
+    void setColor(bool shouldBeOn)
+    {
+        colorIsOn = shouldBeOn;
+
+        for (auto* range : ranges)
+            range->phaser.setColor(shouldBeOn);
+
+        updateTail();
+    }
+
+    void setPhaserMix(double newValue)
+    {
+        phaserMix = newValue;
+
+        for (auto* range : ranges)
+            range->phaser.setMix(newValue);
+    }
+
+    void setChorusMix(double newValue)
+    {
+        chorusMix = newValue;
+
+        for (auto* range : ranges)
+            range->chorus.setMix(newValue);
+    }
+
+    /** See Chorus::setNumVoices(). The LFO then writes one chorus modulation channel per voice of every channel. */
+    void setChorusVoices(int newNumVoices)
+    {
+        chorusVoices = jlimit(1, CHORUS_MAX_VOICES, newNumVoices);
+        chorusModulationBuffer.setSize(phaserModulationBuffer.getNumChannels() * chorusVoices, maxBlockSize, false, false, true);
+
+        for (auto* range : ranges)
+            range->chorus.setNumVoices(chorusVoices);
+    }
+
+    /** See Chorus::setInterpolation(). */
+    void setChorusInterpolation(ChorusInterpolation::Kernel newKernel)
+    {
+        chorusInterpolation = newKernel;
+
+        for (auto* range : ranges)
+            range->chorus.setInterpolation(newKernel);
+    }
+
+    /** Processes ranges of channels on the WorkerPool from the next prepareToPlay() on, see above. Waking the workers
+        and waiting for them isn't real-time safe: meant for offline renders only.
+    */
+    void setParallelProcessing(bool shouldBeParallel) { parallel = shouldBeParallel; }
+
+    /** Ranges of channels processed side by side, 1 unless parallel processing is on and there are threads for it. */
+    int getNumRanges() const { return ranges.size(); }
+
+    /** Frames and trace points go to newTelemetry whenever it's enabled. It must outlive the engine, or be replaced. */
+    void setTelemetry(Telemetry* newTelemetry) { telemetry = newTelemetry; }
+
+    /** See ModulationGenerator::setPhaseOffset(), call it after prepareToPlay(). */
+    void setPhaseOffset(int channel, double offset) { modulation.setPhaseOffset(channel, offset); }
+
+    /** See SmallStone::setControlInterval(), 1 evaluates the phaser coefficients every sample. */
+    void setPhaserControlInterval(int numSamples)
+    {
+        controlInterval = numSamples;
+
+        for (auto* range : ranges)
+            range->phaser.setControlInterval(numSamples);
+    }
+
+    /** Runs the phaser 1x, 2x or 4x oversampled. Safe to call from any thread, it's picked up by the next
+        processBlock(). getLatencyInSamples(factor, linearPhase) tells the latency it will have without waiting for it.
+    */
+    void setOversampling(int factor, bool linearPhase)
+    {
+        requestedOversampling = factor;
+        requestedLinearPhase = linearPhase;
+    }
+
+    /** Latency of the whole chain, which is the phaser's oversampling filters. The phaser dry signal goes through them too. */
+    int getLatencyInSamples() const { return ranges.getFirst()->phaser.getLatencyInSamples(); }
+
+    /** The latency of the chain with setOversampling(factor, linearPhase), 0 until prepared. Depends on nothing the
+        audio thread changes, so any thread may ask, e.g. to tell the host before the setting is picked up.
+    */
+    int getLatencyInSamples(int factor, bool linearPhase) const { return ranges.getFirst()->phaser.getLatencyInSamples(factor, linearPhase); }
+
+    /** The longest the output keeps sounding once the input stops: the phaser ringing down to SILENCE_THRESHOLD (after
+        both mixes, which can add up to MIX_LEVEL each), then the longest chorus delay. Not counting the latency.
+    */
+    static double getTailLengthSeconds(bool colorIsOn)
+    {
+        return SmallStone<SampleType>::getTailLengthSeconds(colorIsOn, SILENCE_THRESHOLD / (MIX_LEVEL * MIX_LEVEL)) + MAX_DELAY_TIME;
+    }
+
+    bool isSleeping() const { return sleeping; }
+
+    /** Runs the whole chain in place. The buffer must not have more channels than the numChannels given to
+        prepareToPlay(). It may be longer than samplesPerBlock, which some hosts do despite promising otherwise:
+        every unit is sized for samplesPerBlock, so a longer buffer is processed in slices of that length.
+    */
+    void processBlock(AudioBuffer<SampleType>& buffer)
+    {
+        processBlock(buffer, 0, buffer.getNumSamples());
+    }
+
+    /** Same as above, for numSamples of the buffer from startSample on. */
+    void processBlock(AudioBuffer<SampleType>& buffer, int startSample, int numSamples)
+    {
+        jassert(maxBlockSize > 0); // Not prepared.
+
+        STONEMISTRESS_TRACE_SCOPE("StoneMistressEngine::processBlock");
+
+        if (updateOversampling())
+            updateTail();
+
+        const auto endSample = startSample + numSamples;
+
+        for (int sliceStart = startSample; sliceStart < endSample; sliceStart += maxBlockSize)
+            processSlice(buffer, sliceStart, jmin(maxBlockSize, endSample - sliceStart));
+    }
+
+    /** Turns this engine into a copy of other, settings and state, so that it can take over from it (see
+        CrossfadingEngine). Both must have been prepared alike. Doesn't allocate. The oversampling filters start from
+        silence, see SmallStone::copyStateFrom().
+    */
+    void copyStateFrom(const StoneMistressEngine& other)
+    {
+        jassert(other.sampleRate == sampleRate && other.maxBlockSize == maxBlockSize && other.ranges.size() == ranges.size());
+
+        requestedOversampling = other.requestedOversampling.load();
+        requestedLinearPhase = other.requestedLinearPhase.load();
+
+        modulation.copyStateFrom(other.modulation);
+        setChorusVoices(other.chorusVoices);
+
+        for (int i = 0; i < ranges.size(); ++i)
+        {
+            ranges[i]->phaser.copyStateFrom(other.ranges[i]->phaser);
+            ranges[i]->chorus.copyStateFrom(other.ranges[i]->chorus);
+        }
+
+        colorIsOn = other.colorIsOn;
+        phaserMix = other.phaserMix;
+        chorusMix = other.chorusMix;
+        chorusInterpolation = other.chorusInterpolation;
+        controlInterval = other.controlInterval;
+        tailSamples = other.tailSamples;
+        silentSamples = other.silentSamples;
+        sleeping = other.sleeping;
+        samplesToNextTracePoint = other.samplesToNextTracePoint;
+    }
+
+private:
+
+    // Adjacent channels with units of their own, so that they can be processed at the same time as the other ranges.
+    struct ChannelRange
+    {
+        SmallStone<SampleType> phaser;
+        Chorus<SampleType> chorus;
+        int firstChannel = 0;
+        int numChannels = 0;
+    };
+
+    /* As many ranges as threads, but no narrower than a vector register once there are two registers' worth of
+       channels: the phaser processes a register in about the time it takes for a single channel (see SmallStone), so
+       splitting one up only costs more. Ranges that were there before keep their units, and with them their filters. */
+    void createRanges(int numChannels)
+    {
+        workers.reset(parallel && numChannels > 1 ? new WorkerPool::Client() : nullptr);
+
+        const auto numThreads = workers != nullptr ? workers->getNumThreads() : 1;
+        const auto registerWidth = static_cast<int>(dsp::SIMDRegister<SampleType>::SIMDNumElements);
+        auto width = (numChannels + numThreads - 1) / numThreads;
+
+        if (numChannels >= 2 * registerWidth)
+            width = (width + registerWidth - 1) / registerWidth * registerWidth;
+
+        const auto numRanges = (numChannels + width - 1) / width;
+
+        ranges.removeLast(ranges.size() - numRanges);
+
+        while (ranges.size() < numRanges)
+        {
+            auto* range = ranges.add(new ChannelRange());
+            range->phaser.setColor(colorIsOn);
+            range->phaser.setMix(phaserMix);
+            range->phaser.setControlInterval(controlInterval);
+            range->chorus.setMix(chorusMix);
+            range->chorus.setInterpolation(chorusInterpolation);
+            range->chorus.setNumVoices(chorusVoices);
+        }
+
+        for (int index = 0; index < numRanges; ++index)
+        {
+            ranges[index]->firstChannel = index * width;
+            ranges[index]->numChannels = jmin(width, numChannels - index * width);
+        }
+    }
+
+    // On the workers for slices long enough, with the calling thread taking its share.
+    template <typename Function>
+    void forEachRange(const AudioBuffer<SampleType>& buffer, int numSamples, Function&& function)
+    {
+        auto processRange = [&](int index)
+        {
+            auto& range = *ranges.getUnchecked(index);
+
+            if (range.firstChannel < buffer.getNumChannels())
+                function(range);
+        };
+
+        if (workers != nullptr && numSamples >= PARALLEL_MIN_SAMPLES)
+        {
+            workers->run(ranges.size(), processRange);
+            return;
+        }
+
+        for (int index = 0; index < ranges.size(); ++index)
+            processRange(index);
+    }
+
+    void processSlice(AudioBuffer<SampleType>& buffer, int startSample, int numSamples)
+    {
+        const auto measuring = telemetry != nullptr && telemetry->isEnabled();
+        Telemetry::Frame frame;
+
+        if (! isSilent(buffer, startSample, numSamples))
+        {
+            silentSamples = 0;
+            sleeping = false;
+        }
+        else if (silentSamples >= tailSamples)
+        {
+            // Everything has decayed: the state is left as it is, it's all below the threshold.
+            if (! sleeping)
+                for (auto* range : ranges)
+                    range->phaser.restartModulation();
+
+            STONEMISTRESS_TRACE_SCOPE("Asleep");
+
+            sleeping = true;
+            modulation.skip(numSamples);
+            buffer.clear(startSample, numSamples);
+
+            if (measuring)
+            {
+                frame.blockSeconds = static_cast<float>(numSamples / sampleRate);
+                frame.sleeping = true;
+                telemetry->push(frame);
+            }
+
+            return;
+        }
+        else
+        {
+            silentSamples += numSamples;
+        }
+
+        Telemetry::Stopwatch stopwatch(measuring);
+
+        // 1-4. Generate the LFO signal, scaled for the phaser and the chorus and bounded for the chorus, in one pass.
+        {
+            STONEMISTRESS_TRACE_SCOPE("1-4. Modulation");
+            modulation.getNextAudioBlock(phaserModulationBuffer, chorusModulationBuffer, numSamples);
+        }
+        frame.modulationSeconds = stopwatch.lap();
+
+        // 5. Feed the buffer into the phaser unit, which mixes it with the dry signal.
+        {
+            STONEMISTRESS_TRACE_SCOPE("5. Phaser");
+            forEachRange(buffer, numSamples, [&](ChannelRange& range)
+            {
+                range.phaser.processBlock(buffer, phaserModulationBuffer, startSample, numSamples, range.firstChannel);
+            });
+        }
+        frame.phaserSeconds = stopwatch.lap();
+
+        // 6. Feed the mixed signal into the chorus unit, which mixes it with the delayed one for the final output.
+        {
+            STONEMISTRESS_TRACE_SCOPE("6. Chorus");
+            forEachRange(buffer, numSamples, [&](ChannelRange& range)
+            {
+                range.chorus.processBlock(buffer, chorusModulationBuffer, startSample, numSamples, range.firstChannel);
+            });
+        }
+        frame.chorusSeconds = stopwatch.lap();
+
+        if (measuring)
+        {
+            STONEMISTRESS_TRACE_SCOPE("Telemetry");
+
+            frame.blockSeconds = static_cast<float>(numSamples / sampleRate);
+            frame.peak = static_cast<float>(buffer.getMagnitude(startSample, numSamples));
+
+            SampleType sumOfSquares = 0;
+
+            for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+            {
+                const auto rms = buffer.getRMSLevel(ch, startSample, numSamples);
+                sumOfSquares += rms * rms;
+            }
+
+            frame.rms = static_cast<float>(std::sqrt(sumOfSquares / buffer.getNumChannels()));
+            telemetry->push(frame);
+
+            pushTrace(numSamples);
+        }
+    }
+
+    // One trace point every traceInterval samples, counted across slices, from the slice just generated.
+    void pushTrace(int numSamples)
+    {
+        for (; samplesToNextTracePoint < numSamples; samplesToNextTracePoint += traceInterval)
+        {
+            Telemetry::TracePoint point;
+            point.lfo = static_cast<float>(modulation.getLfoValue(samplesToNextTracePoint - numSamples));
+            point.notchFrequency = static_cast<float>(SmallStone<SampleType>::getNotchFrequency(phaserModulationBuffer.getSample(0, samplesToNextTracePoint)));
+            telemetry->push(point);
+        }
+
+        samplesToNextTracePoint -= numSamples;
+    }
+
+    // Returns true if the latency changed.
+    bool updateOversampling()
+    {
+        const auto latency = getLatencyInSamples();
+
+        for (auto* range : ranges)
+            range->phaser.setOversampling(requestedOversampling, requestedLinearPhase);
+
+        return getLatencyInSamples() != latency;
+    }
+
+    void updateTail()
+    {
+        tailSamples = roundToInt(std::ceil(getTailLengthSeconds(colorIsOn) * sampleRate)) + getLatencyInSamples();
+    }
+
+    static bool isSilent(const AudioBuffer<SampleType>& buffer, int startSample, int numSamples)
+    {
+        return buffer.getMagnitude(startSample, numSamples) <= static_cast<SampleType>(SILENCE_THRESHOLD);
+    }
+
+    AudioBuffer<SampleType> phaserModulationBuffer;
+    AudioBuffer<SampleType> chorusModulationBuffer;
+
+    ModulationGenerator<SampleType> modulation;
+    OwnedArray<ChannelRange> ranges; // A single one for all the channels unless parallel.
+    std::unique_ptr<WorkerPool::Client> workers; // Only while prepared for parallel processing.
+
+    double sampleRate = 44100.0;
+    int maxBlockSize = 0;
+    int tailSamples = 0;
+    int silentSamples = 0; // Silent input samples in a row, counted until the engine sleeps.
+    bool sleeping = false;
+    bool parallel = false;
+
+    // Kept for the units of new ranges.
+    bool colorIsOn = false;
+    double phaserMix = 0.5;
+    double chorusMix = 0.5;
+    ChorusInterpolation::Kernel chorusInterpolation = ChorusInterpolation::allPass;
+    int chorusVoices = 1;
+    int controlInterval = 1;
+
+    Telemetry* telemetry = nullptr;
+    int traceInterval = 1; // Samples between two trace points.
+    int samplesToNextTracePoint = 0;
+
+    std::atomic<int> requestedOversampling { 1 };
+    std::atomic<bool> requestedLinearPhase { false };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StoneMistressEngine)
+};
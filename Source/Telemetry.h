@@ -0,0 +1,135 @@
+/*
+  ==============================================================================
+
+    Telemetry.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+#define TELEMETRY_FRAMES 512 // Frames the queue holds, a few seconds of audio at any block size a reader keeps up with.
+#define TELEMETRY_TRACE_POINTS 1024
+#define TELEMETRY_TRACE_RATE 200.0 // Trace points per second of audio, 25 per cycle of the fastest LFO.
+
+/*
+ * Wait-free channel from the audio thread to the editor: what every block cost and how loud it came out, and
+ * decimated traces of the LFO and of the phaser notch.
+ * One writer (the audio thread) and one reader (the editor's timer), each through its own AbstractFifo, so neither
+ * side ever waits for the other. When the reader falls behind, new data is dropped rather than overwriting what it
+ * is reading.
+ * Nothing is measured or queued while it's disabled, which is the case whenever no editor is open: the engine then
+ * pays one relaxed atomic load per block.
+*/
+class Telemetry
+{
+public:
+
+    /** One processed block. The mixes run inside the phaser and chorus loops, so their cost is part of those. */
+    struct Frame
+    {
+        float modulationSeconds = 0.0f;
+        float phaserSeconds = 0.0f;
+        float chorusSeconds = 0.0f;
+        float blockSeconds = 0.0f; // Length of the audio, for CPU load.
+        float peak = 0.0f; // Output, all channels.
+        float rms = 0.0f; // Output, averaged over the channels.
+        bool sleeping = false;
+    };
+
+    /** Channel 0 at one instant. */
+    struct TracePoint
+    {
+        float lfo = 0.0f; // Unipolar, 0 to 1.
+        float notchFrequency = 0.0f; // Lowest notch of the phaser, in Hz.
+    };
+
+    Telemetry() {}
+    ~Telemetry() {}
+
+    /** Reader side. Anything left in the queues from a previous session is thrown away when enabling. */
+    void setEnabled(bool shouldBeEnabled)
+    {
+        if (shouldBeEnabled)
+        {
+            // Read rather than reset, the writer may still be finishing a block from before it was disabled.
+            frameFifo.read(frameFifo.getNumReady());
+            traceFifo.read(traceFifo.getNumReady());
+        }
+
+        enabled.store(shouldBeEnabled, std::memory_order_relaxed);
+    }
+
+    bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    /** Writer side. Returns false if the queue was full and the frame got dropped. */
+    bool push(const Frame& frame)               { return write(frameFifo, frames, frame); }
+    bool push(const TracePoint& point)          { return write(traceFifo, trace, point); }
+
+    /** Reader side. Calls callback(const Frame&) for every frame queued since the last call, oldest first. */
+    template <typename Callback>
+    int readFrames(Callback&& callback)         { return read(frameFifo, frames, callback); }
+
+    /** Reader side. Calls callback(const TracePoint&) for every point queued since the last call, oldest first. */
+    template <typename Callback>
+    int readTrace(Callback&& callback)          { return read(traceFifo, trace, callback); }
+
+    /** Times consecutive stages of a block. Only reads the clock if enabled, lap() returns 0 otherwise. */
+    class Stopwatch
+    {
+    public:
+        explicit Stopwatch(bool isEnabled)
+            : enabled(isEnabled), lastTicks(isEnabled ? Time::getHighResolutionTicks() : 0)
+        {
+        }
+
+        /** Seconds since the previous lap, or since construction. */
+        float lap()
+        {
+            if (! enabled)
+                return 0.0f;
+
+            const auto ticks = Time::getHighResolutionTicks();
+            const auto seconds = Time::highResolutionTicksToSeconds(ticks - lastTicks);
+            lastTicks = ticks;
+            return static_cast<float>(seconds);
+        }
+
+    private:
+        const bool enabled;
+        int64 lastTicks;
+    };
+
+private:
+
+    template <typename Item, size_t size>
+    static bool write(AbstractFifo& fifo, std::array<Item, size>& items, const Item& item)
+    {
+        const auto scope = fifo.write(1);
+
+        if (scope.blockSize1 == 0)
+            return false;
+
+        items[static_cast<size_t>(scope.startIndex1)] = item;
+        return true;
+    }
+
+    template <typename Item, size_t size, typename Callback>
+    static int read(AbstractFifo& fifo, const std::array<Item, size>& items, Callback& callback)
+    {
+        const auto scope = fifo.read(fifo.getNumReady());
+        scope.forEach([&](int index) { callback(items[static_cast<size_t>(index)]); });
+        return scope.blockSize1 + scope.blockSize2;
+    }
+
+    AbstractFifo frameFifo { TELEMETRY_FRAMES };
+    std::array<Frame, TELEMETRY_FRAMES> frames;
+
+    AbstractFifo traceFifo { TELEMETRY_TRACE_POINTS };
+    std::array<TracePoint, TELEMETRY_TRACE_POINTS> trace;
+
+    std::atomic<bool> enabled { false };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Telemetry)
+};
@@ -0,0 +1,240 @@
+/*
+  ==============================================================================
+
+    TelemetryView.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "Telemetry.h"
+
+#define TELEMETRY_VIEW_HEIGHT 96 // The meters and the scope, under the bar.
+#define TELEMETRY_BAR_HEIGHT 20 // The toggle, all there is of the strip while it's collapsed.
+#define TELEMETRY_VIEW_FPS 30 // Repaints per second at most, fewer when no audio comes in.
+#define TELEMETRY_VIEW_SECONDS 2.0 // Length of the scope.
+#define CPU_METER_RANGE 0.1 // Share of the real time a full meter stands for.
+#define SCOPE_MIN_FREQUENCY 10.0
+#define SCOPE_MAX_FREQUENCY 5000.0
+
+/*
+ * Strip under the pedal face showing the Telemetry of the running engine: the share of real time the modulation, the
+ * phaser and the chorus take, the output level, and a scope with the LFO and the lowest notch of the phaser.
+ * The strip opens collapsed to its toggle. Telemetry is enabled, and the timer runs, only while it's expanded, so the
+ * audio thread doesn't measure and the editor doesn't redraw for a strip nobody asked to see.
+ * While expanded, a timer drains the queues at TELEMETRY_VIEW_FPS at most and repaints only this strip, and only if
+ * something arrived.
+*/
+class TelemetryView : public Component, private Timer
+{
+public:
+
+    explicit TelemetryView(Telemetry& source)
+        : telemetry(source)
+    {
+        setOpaque(true);
+
+        toggle.setColour(ToggleButton::textColourId, Colours::lightgrey);
+        toggle.setColour(ToggleButton::tickColourId, Colours::orange);
+        toggle.onClick = [this] { setExpanded(toggle.getToggleState()); };
+        addAndMakeVisible(toggle);
+    }
+
+    ~TelemetryView() override
+    {
+        stopTimer();
+        telemetry.setEnabled(false);
+    }
+
+    /** Called after the strip expands or collapses, for the editor to follow getPreferredHeight(). */
+    std::function<void()> onExpandedChange;
+
+    bool isExpanded() const { return expanded; }
+
+    void setExpanded(bool shouldBeExpanded)
+    {
+        if (shouldBeExpanded == expanded)
+            return;
+
+        expanded = shouldBeExpanded;
+        toggle.setToggleState(expanded, dontSendNotification);
+
+        if (expanded)
+        {
+            // Start from empty meters and scope rather than from what was left when the strip collapsed.
+            std::fill(std::begin(load), std::end(load), 0.0f);
+            peak = rms = 0.0f;
+            sleeping = false;
+            scope.fill({});
+            scopeIndex = 0;
+
+            telemetry.setEnabled(true);
+            startTimerHz(TELEMETRY_VIEW_FPS);
+        }
+        else
+        {
+            stopTimer();
+            telemetry.setEnabled(false);
+        }
+
+        if (onExpandedChange != nullptr)
+            onExpandedChange();
+    }
+
+    int getPreferredHeight() const { return TELEMETRY_BAR_HEIGHT + (expanded ? TELEMETRY_VIEW_HEIGHT : 0); }
+
+    /** Drains the queues and repaints if anything arrived. The timer calls it while the strip is expanded. */
+    void refresh()
+    {
+        float stageSeconds[numStages] = {};
+        float audioSeconds = 0.0f;
+        float newPeak = 0.0f;
+        float newRms = 0.0f;
+
+        const auto numFrames = telemetry.readFrames([&](const Telemetry::Frame& frame)
+        {
+            stageSeconds[0] += frame.modulationSeconds;
+            stageSeconds[1] += frame.phaserSeconds;
+            stageSeconds[2] += frame.chorusSeconds;
+            audioSeconds += frame.blockSeconds;
+            newPeak = jmax(newPeak, frame.peak);
+            newRms = jmax(newRms, frame.rms);
+            sleeping = frame.sleeping;
+        });
+
+        telemetry.readTrace([this](const Telemetry::TracePoint& point)
+        {
+            scope[static_cast<size_t>(scopeIndex)] = point;
+            scopeIndex = (scopeIndex + 1) % numScopePoints;
+        });
+
+        if (numFrames == 0)
+            return;
+
+        // Meters rise at once and fall back slowly, so that a single expensive block stays readable.
+        for (int stage = 0; stage < numStages; ++stage)
+            load[stage] = jmax(stageSeconds[stage] / audioSeconds, load[stage] * 0.9f);
+
+        peak = jmax(newPeak, peak * 0.8f);
+        rms = newRms;
+
+        repaint();
+    }
+
+    void resized() override
+    {
+        toggle.setBounds(getLocalBounds().removeFromTop(TELEMETRY_BAR_HEIGHT).reduced(4, 0).removeFromLeft(100));
+    }
+
+    void paint(Graphics& g) override
+    {
+        g.fillAll(Colour(0xff1c1b1a));
+
+        if (! expanded)
+            return;
+
+        auto area = getLocalBounds().withTrimmedTop(TELEMETRY_BAR_HEIGHT).reduced(6, 0).withTrimmedBottom(6);
+        auto meters = area.removeFromLeft(170);
+        area.removeFromLeft(8);
+
+        g.setFont(11.0f);
+
+        const char* names[] = { "Modulation", "Phaser", "Chorus" };
+        float total = 0.0f;
+
+        for (int stage = 0; stage < numStages; ++stage)
+        {
+            drawMeter(g, meters.removeFromTop(16), names[stage], load[stage]);
+            total += load[stage];
+        }
+
+        drawMeter(g, meters.removeFromTop(16), "Total", total);
+
+        meters.removeFromTop(4);
+        g.setColour(Colours::lightgrey);
+        g.drawText(sleeping ? String("Asleep, input silent")
+                            : "Peak " + String(Decibels::gainToDecibels(peak), 1) + " dB  RMS " + String(Decibels::gainToDecibels(rms), 1) + " dB",
+                   meters.removeFromTop(16), Justification::centredLeft);
+
+        drawScope(g, area);
+    }
+
+private:
+
+    static constexpr int numStages = 3;
+    static constexpr int numScopePoints = static_cast<int>(TELEMETRY_VIEW_SECONDS * TELEMETRY_TRACE_RATE);
+
+    void timerCallback() override
+    {
+        refresh();
+    }
+
+    void drawMeter(Graphics& g, Rectangle<int> row, const char* name, float value) const
+    {
+        g.setColour(Colours::lightgrey);
+        g.drawText(name, row.removeFromLeft(66), Justification::centredLeft);
+        g.drawText(String(value * 100.0f, 2) + " %", row.removeFromRight(46), Justification::centredRight);
+
+        const auto bar = row.reduced(2, 4).toFloat();
+        g.setColour(Colours::darkgrey);
+        g.fillRect(bar);
+        g.setColour(Colours::orange);
+        g.fillRect(bar.withWidth(bar.getWidth() * jlimit(0.0f, 1.0f, value / static_cast<float>(CPU_METER_RANGE))));
+    }
+
+    // LFO in white, from 0 at the bottom to 1 at the top. Notch in orange, on a log frequency axis.
+    void drawScope(Graphics& g, Rectangle<int> area) const
+    {
+        const auto bounds = area.toFloat();
+        g.setColour(Colours::black);
+        g.fillRect(bounds);
+
+        Path lfoPath, notchPath;
+        const auto logRange = std::log(SCOPE_MAX_FREQUENCY / SCOPE_MIN_FREQUENCY);
+
+        for (int i = 0; i < numScopePoints; ++i)
+        {
+            const auto& point = scope[static_cast<size_t>((scopeIndex + i) % numScopePoints)];
+            const auto x = bounds.getX() + bounds.getWidth() * i / (numScopePoints - 1);
+            const auto notch = std::log(jmax(SCOPE_MIN_FREQUENCY, static_cast<double>(point.notchFrequency)) / SCOPE_MIN_FREQUENCY) / logRange;
+
+            const auto lfoY = bounds.getBottom() - bounds.getHeight() * point.lfo;
+            const auto notchY = bounds.getBottom() - bounds.getHeight() * static_cast<float>(jmin(1.0, notch));
+
+            if (i == 0)
+            {
+                lfoPath.startNewSubPath(x, lfoY);
+                notchPath.startNewSubPath(x, notchY);
+            }
+            else
+            {
+                lfoPath.lineTo(x, lfoY);
+                notchPath.lineTo(x, notchY);
+            }
+        }
+
+        g.setColour(Colours::white.withAlpha(0.7f));
+        g.strokePath(lfoPath, PathStrokeType(1.0f));
+        g.setColour(Colours::orange);
+        g.strokePath(notchPath, PathStrokeType(1.5f));
+
+        g.setColour(Colours::lightgrey);
+        g.drawText("LFO / notch " + String(roundToInt(scope[static_cast<size_t>((scopeIndex + numScopePoints - 1) % numScopePoints)].notchFrequency)) + " Hz",
+                   area.reduced(4, 2), Justification::topLeft);
+    }
+
+    Telemetry& telemetry;
+    ToggleButton toggle { "Telemetry" };
+    bool expanded = false;
+
+    float load[numStages] = {};
+    float peak = 0.0f;
+    float rms = 0.0f;
+    bool sleeping = false;
+
+    std::array<Telemetry::TracePoint, static_cast<size_t>(numScopePoints)> scope {};
+    int scopeIndex = 0; // Oldest point, where the next one goes.
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(TelemetryView)
+};
@@ -0,0 +1,247 @@
+/*
+  ==============================================================================
+
+    WorkerPool.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+#define WORKER_POOL_MAX_CLIENTS 64 // Engines that can be parallel at once, further ones run on their own thread.
+
+/*
+ * Threads shared by every engine of the process, to process groups of channels side by side (see StoneMistressEngine).
+ * One thread per CPU but one, started when the first client connects and kept until the last one goes, so a block
+ * never waits for a thread to be created.
+ *
+ * Every client has a slot of its own. run() publishes a batch of tasks in it, wakes as many idle workers as there are
+ * tasks to spare, and then takes tasks from the same batch itself: a batch is finished even if all the workers are busy
+ * with other clients, and the caller only ever waits for tasks that are already running. Tasks are claimed with a
+ * compare-and-swap on one word holding the batch number, its size and the next task, so a worker that looked at a
+ * previous batch can't claim anything from the next one.
+ *
+ * Waking a thread is a system call, this is not real-time safe: it's meant for offline renders only.
+*/
+class WorkerPool
+{
+    struct Slot;
+
+public:
+
+    WorkerPool()
+    {
+        for (int i = 0; i < SystemStats::getNumCpus() - 1; ++i)
+            workers.add(new Worker(*this, i))->startThread(Thread::Priority::high);
+    }
+
+    ~WorkerPool()
+    {
+        for (auto* worker : workers)
+            worker->signalThreadShouldExit();
+
+        for (auto* worker : workers)
+        {
+            worker->notify();
+            worker->stopThread(-1);
+        }
+    }
+
+    int getNumWorkers() const { return workers.size(); }
+
+    /*
+     * What an engine holds to use the pool: the pool stays up as long as any client does. A client without a slot (all
+     * taken) or without workers (a single CPU) runs every task on the calling thread.
+    */
+    class Client
+    {
+    public:
+
+        Client() : slot(pool->acquireSlot()) {}
+
+        ~Client()
+        {
+            if (slot != nullptr)
+                pool->releaseSlot(*slot);
+        }
+
+        /** Tasks that can run at the same time, the calling thread included. */
+        int getNumThreads() const { return slot != nullptr ? pool->getNumWorkers() + 1 : 1; }
+
+        /** Calls function(index) for every index below numTasks, spread over the calling thread and the workers, and
+            returns when all have returned. One client must not run two batches at once.
+        */
+        template <typename Function>
+        void run(int numTasks, Function&& function)
+        {
+            jassert(numTasks <= 0xffff);
+
+            if (slot == nullptr || numTasks < 2)
+            {
+                for (int index = 0; index < numTasks; ++index)
+                    function(index);
+
+                return;
+            }
+
+            pool->run(*slot, numTasks, &call<std::remove_reference_t<Function>>, &function);
+        }
+
+    private:
+
+        template <typename Function>
+        static void call(void* function, int index)
+        {
+            (*static_cast<Function*>(function))(index);
+        }
+
+        SharedResourcePointer<WorkerPool> pool;
+        Slot* slot;
+
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Client)
+    };
+
+private:
+
+    using Task = void (*)(void* context, int index);
+
+    // The batch number in the top 32 bits, its size in the next 16 and the next task to claim in the last 16.
+    struct Slot
+    {
+        std::atomic<uint64> batch { 0 };
+        std::atomic<int> tasksDone { 0 };
+        Task task = nullptr; // Written before the batch is published, read after claiming from it.
+        void* context = nullptr;
+        std::atomic<bool> inUse { false };
+    };
+
+    class Worker : public Thread
+    {
+    public:
+
+        Worker(WorkerPool& owner, int workerIndex)
+            : Thread("StoneMistress worker " + String(workerIndex + 1)), pool(owner), index(workerIndex)
+        {
+        }
+
+        void run() override
+        {
+            while (! threadShouldExit())
+            {
+                if (pool.runAnyTask(index))
+                    continue;
+
+                // Looks again once idle is set, so that a batch published in between is either seen here or wakes it.
+                idle = true;
+
+                if (! pool.runAnyTask(index))
+                    wait(-1);
+
+                idle = false;
+            }
+        }
+
+        std::atomic<bool> idle { false };
+
+    private:
+
+        WorkerPool& pool;
+        const int index;
+    };
+
+    Slot* acquireSlot()
+    {
+        if (workers.isEmpty())
+            return nullptr;
+
+        for (int i = 0; i < WORKER_POOL_MAX_CLIENTS; ++i)
+        {
+            bool free = false;
+
+            if (slots[i].inUse.compare_exchange_strong(free, true))
+            {
+                for (auto used = numSlotsUsed.load(); used < i + 1 && ! numSlotsUsed.compare_exchange_weak(used, i + 1);) {}
+                return &slots[i];
+            }
+        }
+
+        return nullptr;
+    }
+
+    void releaseSlot(Slot& slot)
+    {
+        slot.inUse = false;
+    }
+
+    void run(Slot& slot, int numTasks, Task task, void* context)
+    {
+        slot.task = task;
+        slot.context = context;
+        slot.tasksDone = 0;
+
+        const auto number = (slot.batch.load() >> 32) + 1;
+        slot.batch = (number << 32) | (static_cast<uint64>(numTasks) << 16);
+
+        wakeWorkers(numTasks - 1);
+
+        while (runTask(slot)) {}
+
+        while (slot.tasksDone.load() < numTasks)
+            Thread::yield();
+    }
+
+    void wakeWorkers(int numToWake)
+    {
+        for (auto* worker : workers)
+        {
+            if (numToWake == 0)
+                return;
+
+            if (worker->idle)
+            {
+                worker->notify();
+                --numToWake;
+            }
+        }
+    }
+
+    // Returns false if the slot had nothing left to claim.
+    static bool runTask(Slot& slot)
+    {
+        auto batch = slot.batch.load();
+
+        for (;;)
+        {
+            const auto next = static_cast<int>(batch & 0xffff);
+
+            if (next >= static_cast<int>((batch >> 16) & 0xffff))
+                return false;
+
+            if (slot.batch.compare_exchange_weak(batch, batch + 1))
+            {
+                slot.task(slot.context, next);
+                slot.tasksDone.fetch_add(1);
+                return true;
+            }
+        }
+    }
+
+    // Workers start looking at different slots, so that several clients get served at once.
+    bool runAnyTask(int workerIndex)
+    {
+        const auto used = numSlotsUsed.load();
+
+        for (int i = 0; i < used; ++i)
+            if (runTask(slots[(workerIndex + i) % used]))
+                return true;
+
+        return false;
+    }
+
+    Slot slots[WORKER_POOL_MAX_CLIENTS];
+    std::atomic<int> numSlotsUsed { 0 };
+    OwnedArray<Worker> workers;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WorkerPool)
+};
@@ -0,0 +1,552 @@
+/*
+  ==============================================================================
+
+    Per-stage micro-benchmarks: times every unit of the chain in isolation
+    across block sizes and sample rates and writes the results as JSON.
+    With --audit, runs the real-time safety audit instead, with --paint
+    times the editor frames, and with --startup times building instances
+    and opening editors.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include <iostream>
+#include <map>
+#include "StageBenchmarks.h"
+#include "ProcessorAudit.h"
+#include "PaintBenchmark.h"
+#include "StartupBenchmark.h"
+
+// Each measurement is the median of this many timed runs.
+#define NUM_RUNS 5
+#define BANK_MAX_DEVIATION 1.0e-5 // -100 dB: rounding only, a bank that runs the chain differently is off by far more.
+
+static void printUsage()
+{
+    std::cout << "Usage: StoneMistressBenchmark [options]\n"
+                 "  --audit                  Run the plugin's processor with a trap on allocations, locks and system\n"
+                 "                           calls instead of benchmarking, and fail on any of them\n"
+                 "  --paint                  Time editor frames at display scales 1, 1.5 and 2 instead of the DSP\n"
+                 "  --startup                Measure instances built and restored per second, and editor open\n"
+                 "                           times at display scales 1 and 2, instead of the DSP\n"
+                 "  --stages=<a,b,...>       Subset of: lfo, modulation, modulation_fused, phaser_color_off,\n"
+                 "                           phaser_color_on, phaser_color_off_cr<n>, phaser_color_on_cr<n>,\n"
+                 "                           phaser_color_on_os2, phaser_color_on_os4,\n"
+                 "                           phaser_color_off_stages<6|8|12>, phaser_color_on_stages12, chorus,\n"
+                 "                           chorus_linear, chorus_hermite, chorus_lagrange, chorus_sinc,\n"
+                 "                           chorus_voices2, chorus_voices4, chorus_voices8,\n"
+                 "                           engine, engine_double, engine_idle, engine_12ch,\n"
+                 "                           engine_telemetry, engine_parallel, engine_12ch_parallel,\n"
+                 "                           bank_x<lanes>\n"
+                 "                           (default: all)\n"
+                 "  --control-interval=<n>   Interval of the control-rate phaser stages (default 16)\n"
+                 "  --deviation              Also report how far the control-rate phaser deviates from\n"
+                 "                           the per-sample one, for intervals 8, 16 and 32\n"
+                 "  --block-sizes=<a,b,...>  Default 16,32,64,128,256,512,1024,2048,4096\n"
+                 "  --sample-rates=<a,b,...> Default 44100,48000,88200,96000,176400,192000,352800,384000\n"
+                 "  --seconds=<s>            Audio processed per timed run (default 0.25)\n"
+                 "  --output=<file>          Write the JSON report here instead of stdout\n"
+                 "  --baseline=<file>        Compare against a previous report and fail on regressions\n"
+                 "  --threshold=<percent>    Allowed slowdown against the baseline (default 10)\n"
+                 "  --isa=<name>             Run the kernels for portable, sse4.2, avx2 or avx512 instead of\n"
+                 "                           the widest one the CPU supports\n"
+                 "  --deterministic          Same as --isa=portable, the kernels that are bit-identical everywhere\n"
+                 "  --trace=<file>           Write a Chrome trace of the timed blocks (Profile builds only), best\n"
+                 "                           with a single stage, block size and sample rate\n";
+}
+
+static Array<double> parseList(const ArgumentList& args, StringRef option, const String& defaultList)
+{
+    auto list = args.containsOption(option) ? args.getValueForOption(option) : defaultList;
+    Array<double> values;
+
+    for (auto& token : StringArray::fromTokens(list, ",", {}))
+        if (token.trim().isNotEmpty())
+            values.add(token.trim().getDoubleValue());
+
+    return values;
+}
+
+/** Returns the median cost of one processBlock() call, in nanoseconds per sample frame. */
+static double measureNsPerSample(StageBenchmark& stage, double sampleRate, int blockSize, double seconds)
+{
+    ScopedNoDenormals noDenormals;
+
+    stage.prepare(sampleRate, blockSize);
+
+    const int numBlocks = jmax(16, roundToInt(seconds * sampleRate / blockSize));
+
+    for (int block = 0; block < numBlocks / 4; ++block) // Warm up caches and branch predictors.
+        stage.processBlock(blockSize);
+
+    std::array<double, NUM_RUNS> runs;
+
+    for (auto& run : runs)
+    {
+        const auto start = Time::getHighResolutionTicks();
+
+        for (int block = 0; block < numBlocks; ++block)
+            stage.processBlock(blockSize);
+
+        const auto elapsed = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - start);
+        run = elapsed * 1.0e9 / (static_cast<double>(numBlocks) * blockSize);
+    }
+
+    std::sort(runs.begin(), runs.end());
+    return runs[NUM_RUNS / 2];
+}
+
+static String resultKey(const var& result)
+{
+    return result["stage"].toString() + "@" + String(static_cast<double>(result["sampleRate"])) + "@" + String(static_cast<int>(result["blockSize"]));
+}
+
+/** Prints every stage that got slower than the baseline by more than the threshold, returns how many did. */
+static int compareWithBaseline(const Array<var>& results, const File& baselineFile, double thresholdPercent)
+{
+    const auto baseline = JSON::parse(baselineFile);
+
+    if (! baseline["results"].isArray())
+    {
+        std::cerr << "Could not read baseline " << baselineFile.getFullPathName() << std::endl;
+        return 1;
+    }
+
+    const auto instructionSet = String(CpuDispatch::getName(CpuDispatch::getInstructionSet()));
+
+    if (baseline.hasProperty("instructionSet") && baseline["instructionSet"].toString() != instructionSet)
+        std::cerr << "Warning: the baseline ran the " << baseline["instructionSet"].toString() << " kernels, this run "
+                  << instructionSet << ". Pass --isa to compare like with like." << std::endl;
+
+    std::map<String, double> baselineCosts;
+
+    for (auto& result : *baseline["results"].getArray())
+        baselineCosts[resultKey(result)] = static_cast<double>(result["nsPerSample"]);
+
+    int numRegressions = 0;
+
+    for (auto& result : results)
+    {
+        const auto found = baselineCosts.find(resultKey(result));
+
+        if (found == baselineCosts.end())
+            continue;
+
+        const auto cost = static_cast<double>(result["nsPerSample"]);
+        const auto change = (cost / found->second - 1.0) * 100.0;
+
+        if (change > thresholdPercent)
+        {
+            std::cerr << "REGRESSION " << resultKey(result) << ": " << String(found->second, 3) << " -> "
+                      << String(cost, 3) << " ns/sample (+" << String(change, 1) << "%)" << std::endl;
+            ++numRegressions;
+        }
+    }
+
+    return numRegressions;
+}
+
+/** Measures every chorus interpolation kernel into errors and prints the ones ChorusInterpolation::getError() no longer
+    states right, the measurement rounded up to the next 0.1 dB, and the engine's error targets no kernel meets.
+    Returns how many don't match.
+*/
+static int checkInterpolationErrors(Array<var>& errors)
+{
+    int numMismatches = 0;
+
+    for (int index = 0; index < ChorusInterpolation::numKernels; ++index)
+    {
+        const auto kernel = static_cast<ChorusInterpolation::Kernel>(index);
+        const auto measured = measureInterpolationError(kernel);
+        const auto stated = ChorusInterpolation::getError(kernel);
+        const auto expected = std::ceil(measured * 10.0) / 10.0;
+
+        DynamicObject::Ptr error = new DynamicObject();
+        error->setProperty("kernel", ChorusInterpolation::getName(kernel));
+        error->setProperty("statedDb", stated);
+        error->setProperty("measuredDb", measured);
+        errors.add(var(error.get()));
+
+        if (std::abs(stated - expected) > 1.0e-6)
+        {
+            std::cerr << "INTERPOLATION ERROR " << ChorusInterpolation::getName(kernel) << ": stated " << String(stated, 1)
+                      << " dB, measured " << String(measured, 3) << " dB, should be " << String(expected, 1) << std::endl;
+            ++numMismatches;
+        }
+    }
+
+    // A target only pick()'s fallback meets asks for more than any kernel gives.
+    for (auto target : { CHORUS_REALTIME_ERROR, CHORUS_OFFLINE_ERROR })
+    {
+        if (ChorusInterpolation::getError(ChorusInterpolation::pick(target)) > target)
+        {
+            std::cerr << "INTERPOLATION TARGET " << String(target, 1) << " dB: no kernel is that accurate" << std::endl;
+            ++numMismatches;
+        }
+    }
+
+    return numMismatches;
+}
+
+/** Runs a bank and one engine per track side by side into deviations, and prints the sample rates where they differ by
+    more than BANK_MAX_DEVIATION. Returns how many do.
+*/
+static int checkBankDeviation(Array<var>& deviations)
+{
+    int numMismatches = 0;
+
+    for (auto sampleRate : { 44100.0, 96000.0 })
+    {
+        const auto maxError = measureBankDeviation(sampleRate);
+
+        DynamicObject::Ptr deviation = new DynamicObject();
+        deviation->setProperty("sampleRate", sampleRate);
+        deviation->setProperty("lanes", STONEMISTRESS_BANK_LANES);
+        deviation->setProperty("maxError", maxError);
+        deviation->setProperty("maxErrorDb", Decibels::gainToDecibels(maxError, -200.0));
+        deviations.add(var(deviation.get()));
+
+        if (maxError > BANK_MAX_DEVIATION)
+        {
+            std::cerr << "BANK DEVIATION at " << sampleRate << " Hz: " << String(Decibels::gainToDecibels(maxError, -200.0), 1)
+                      << " dB from the engine" << std::endl;
+            ++numMismatches;
+        }
+    }
+
+    return numMismatches;
+}
+
+/** Every precision, block size and channel layout the plugin is likely to meet, mono to a 7th order Ambisonic bed,
+    in real time and in bounces. Returns the number of scenarios that failed.
+*/
+static int runAudit()
+{
+    // The processor is a Timer and restores its state through the message thread, like in a host.
+    ScopedJuceInitialiser_GUI gui;
+
+    if (! RealtimeAudit::initialise())
+        std::cerr << "Only operator new and delete can be trapped on this platform." << std::endl;
+
+    int numFailures = 0;
+
+    auto runScenario = [&numFailures](auto& audit)
+    {
+        const auto numViolations = audit.run(2.0);
+        const auto failed = numViolations > 0 || ! audit.hasSlept();
+
+        std::cerr << (failed ? "FAIL " : "ok   ") << audit.getName() << ": " << numViolations << " violations"
+                  << (audit.hasSlept() ? "" : ", never went to sleep") << std::endl;
+
+        numFailures += failed ? 1 : 0;
+    };
+
+    for (auto sampleRate : { 44100.0, 96000.0 })
+    {
+        for (auto samplesPerBlock : { 32, 512 })
+        {
+            for (auto numChannels : { 1, 2, 12, MAX_CHANNELS })
+            {
+                ProcessorAudit<float> floatAudit(sampleRate, samplesPerBlock, numChannels, false);
+                runScenario(floatAudit);
+
+                ProcessorAudit<double> doubleAudit(sampleRate, samplesPerBlock, numChannels, false);
+                runScenario(doubleAudit);
+            }
+        }
+    }
+
+    // However large the host blocks, real time never wakes the worker threads.
+    for (auto numChannels : { 2, 12 })
+    {
+        ProcessorAudit<float> largeBlockAudit(48000.0, 4096, numChannels, false);
+        runScenario(largeBlockAudit);
+    }
+
+    // Bounces run the channels on the workers, and may wait for them but not allocate.
+    for (auto numChannels : { 2, 12, MAX_CHANNELS })
+    {
+        ProcessorAudit<float> floatAudit(48000.0, 512, numChannels, true);
+        runScenario(floatAudit);
+
+        ProcessorAudit<double> doubleAudit(48000.0, 512, numChannels, true);
+        runScenario(doubleAudit);
+    }
+
+    return numFailures;
+}
+
+/** Every kind of editor frame at the usual display scales, as JSON. */
+static var runPaintBenchmark(int numFrames)
+{
+    ScopedJuceInitialiser_GUI gui;
+    Array<var> results;
+
+    for (auto scale : { 1.0f, 1.5f, 2.0f })
+    {
+        PaintBenchmark benchmark(scale);
+
+        const std::pair<const char*, double> frames[] = {
+            { "first", benchmark.measureFirstFrame() },
+            { "full", benchmark.measureFullFrame(numFrames) },
+            { "color_switch", benchmark.measureSwitchFrame(numFrames) },
+            { "knob", benchmark.measureKnobFrame(numFrames) },
+            { "telemetry", benchmark.measureTelemetryFrame(numFrames) },
+            { "legacy_full", benchmark.measureLegacyFrame(numFrames) },
+        };
+
+        for (auto& frame : frames)
+        {
+            DynamicObject::Ptr result = new DynamicObject();
+            result->setProperty("frame", frame.first);
+            result->setProperty("displayScale", scale);
+            result->setProperty("microseconds", frame.second);
+            results.add(var(result.get()));
+
+            std::cerr << frame.first << " at " << scale << "x: " << String(frame.second, 1) << " us" << std::endl;
+        }
+    }
+
+    DynamicObject::Ptr report = new DynamicObject();
+    report->setProperty("cpu", SystemStats::getCpuModel());
+    report->setProperty("operatingSystem", SystemStats::getOperatingSystemName());
+    report->setProperty("paint", results);
+    return var(report.get());
+}
+
+/** Instances per second and editor open times, as JSON. */
+static var runStartupBenchmark(int numInstances)
+{
+    ScopedJuceInitialiser_GUI gui;
+
+    DynamicObject::Ptr instances = new DynamicObject();
+    const std::pair<const char*, double> rates[] = {
+        { "restoredPerSecond", StartupBenchmark::measureInstancesPerSecond(numInstances, false) },
+        { "restoredFromXmlPerSecond", StartupBenchmark::measureInstancesPerSecond(numInstances, true) },
+        { "preparedPerSecond", StartupBenchmark::measurePreparedInstancesPerSecond(numInstances) },
+    };
+
+    for (auto& rate : rates)
+    {
+        instances->setProperty(rate.first, rate.second);
+        std::cerr << "instances " << rate.first << ": " << String(rate.second, 1) << std::endl;
+    }
+
+    Array<var> editors;
+
+    for (auto scale : { 1.0f, 2.0f })
+    {
+        const auto times = StartupBenchmark::measureEditorOpen(scale, 20);
+
+        DynamicObject::Ptr result = new DynamicObject();
+        result->setProperty("displayScale", scale);
+        result->setProperty("firstOpenMs", times.firstOpen);
+        result->setProperty("withArtworkMs", times.withArtwork);
+        result->setProperty("nextOpenMs", times.nextOpen);
+        result->setProperty("legacyOpenMs", times.legacyOpen);
+        editors.add(var(result.get()));
+
+        std::cerr << "editor at " << scale << "x: first " << String(times.firstOpen, 2) << " ms (artwork after "
+                  << String(times.withArtwork, 2) << " ms), next " << String(times.nextOpen, 2) << " ms, legacy "
+                  << String(times.legacyOpen, 2) << " ms" << std::endl;
+    }
+
+    DynamicObject::Ptr report = new DynamicObject();
+    report->setProperty("cpu", SystemStats::getCpuModel());
+    report->setProperty("operatingSystem", SystemStats::getOperatingSystemName());
+    report->setProperty("numInstances", numInstances);
+    report->setProperty("instances", var(instances.get()));
+    report->setProperty("editors", editors);
+    return var(report.get());
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    ArgumentList args(argc, argv);
+
+    if (args.containsOption("--help|-h"))
+    {
+        printUsage();
+        return 0;
+    }
+
+    if (args.containsOption("--isa"))
+    {
+        auto instructionSet = CpuDispatch::portable;
+
+        if (! CpuDispatch::fromName(args.getValueForOption("--isa"), instructionSet))
+        {
+            printUsage();
+            return 1;
+        }
+
+        CpuDispatch::setInstructionSet(instructionSet);
+
+        if (CpuDispatch::getInstructionSet() != instructionSet)
+            std::cerr << "This CPU doesn't support " << CpuDispatch::getName(instructionSet) << ", running "
+                      << CpuDispatch::getName(CpuDispatch::getInstructionSet()) << std::endl;
+    }
+
+    if (args.containsOption("--deterministic"))
+        CpuDispatch::setDeterministic(true);
+
+   #if STONEMISTRESS_PROFILING
+    // Ends after everything else in main(), with all the threads done.
+    std::unique_ptr<Profiler::Session> profilerSession;
+
+    if (args.containsOption("--trace"))
+        profilerSession = std::make_unique<Profiler::Session>(File::getCurrentWorkingDirectory().getChildFile(args.getValueForOption("--trace")));
+   #else
+    if (args.containsOption("--trace"))
+        std::cerr << "Built without STONEMISTRESS_PROFILING, no trace is written. Build the Profile configuration." << std::endl;
+   #endif
+
+    if (args.containsOption("--audit"))
+        return runAudit() > 0 ? 1 : 0;
+
+    if (args.containsOption("--paint") || args.containsOption("--startup"))
+    {
+        const auto json = JSON::toString(args.containsOption("--paint") ? runPaintBenchmark(200) : runStartupBenchmark(300));
+
+        if (args.containsOption("--output"))
+            File::getCurrentWorkingDirectory().getChildFile(args.getValueForOption("--output")).replaceWithText(json);
+        else
+            std::cout << json << std::endl;
+
+        return 0;
+    }
+
+    const auto controlInterval = args.containsOption("--control-interval") ? jmax(2, args.getValueForOption("--control-interval").getIntValue()) : 16;
+
+    OwnedArray<StageBenchmark> stages;
+    stages.add(new LfoBenchmark());
+    stages.add(new ModulationBenchmark());
+    stages.add(new FusedModulationBenchmark());
+    stages.add(new PhaserBenchmark<>(false));
+    stages.add(new PhaserBenchmark<>(true));
+    stages.add(new PhaserBenchmark<>(false, controlInterval));
+    stages.add(new PhaserBenchmark<>(true, controlInterval));
+    stages.add(new PhaserBenchmark<>(true, 1, 2));
+    stages.add(new PhaserBenchmark<>(true, 1, 4));
+    stages.add(new PhaserBenchmark<6>(false));
+    stages.add(new PhaserBenchmark<8>(false));
+    stages.add(new PhaserBenchmark<12>(false));
+    stages.add(new PhaserBenchmark<12>(true));
+    stages.add(new ChorusBenchmark());
+    stages.add(new ChorusBenchmark(ChorusInterpolation::linear));
+    stages.add(new ChorusBenchmark(ChorusInterpolation::hermite));
+    stages.add(new ChorusBenchmark(ChorusInterpolation::lagrange));
+    stages.add(new ChorusBenchmark(ChorusInterpolation::sinc));
+    stages.add(new ChorusBenchmark(ChorusInterpolation::allPass, 2));
+    stages.add(new ChorusBenchmark(ChorusInterpolation::allPass, 4));
+    stages.add(new ChorusBenchmark(ChorusInterpolation::allPass, 8));
+    stages.add(new EngineBenchmark<float>());
+    stages.add(new EngineBenchmark<double>());
+    stages.add(new EngineBenchmark<float>(true));
+    stages.add(new EngineBenchmark<float>(false, 12));
+    stages.add(new EngineBenchmark<float>(false, 2, true));
+    stages.add(new EngineBenchmark<float>(false, 2, false, true));
+    stages.add(new EngineBenchmark<float>(false, 12, false, true));
+    stages.add(new BankBenchmark());
+
+    if (args.containsOption("--stages"))
+    {
+        const auto selected = StringArray::fromTokens(args.getValueForOption("--stages"), ",", {});
+
+        for (int i = stages.size(); --i >= 0;)
+            if (! selected.contains(stages[i]->getName()))
+                stages.remove(i);
+    }
+
+    const auto blockSizes = parseList(args, "--block-sizes", "16,32,64,128,256,512,1024,2048,4096");
+    const auto sampleRates = parseList(args, "--sample-rates", "44100,48000,88200,96000,176400,192000,352800,384000");
+    const auto seconds = args.containsOption("--seconds") ? jmax(0.01, args.getValueForOption("--seconds").getDoubleValue()) : 0.25;
+
+    Array<var> results;
+
+    for (auto* stage : stages)
+    {
+        for (auto sampleRate : sampleRates)
+        {
+            for (auto blockSizeValue : blockSizes)
+            {
+                const auto blockSize = roundToInt(blockSizeValue);
+                const auto nsPerSample = measureNsPerSample(*stage, sampleRate, blockSize, seconds);
+
+                DynamicObject::Ptr result = new DynamicObject();
+                result->setProperty("stage", stage->getName());
+                result->setProperty("sampleRate", sampleRate);
+                result->setProperty("blockSize", blockSize);
+                result->setProperty("nsPerSample", nsPerSample);
+                result->setProperty("realtimeFactor", 1.0e9 / (nsPerSample * static_cast<double>(sampleRate)));
+                results.add(var(result.get()));
+
+                std::cerr << stage->getName() << " " << sampleRate << " Hz, " << blockSize
+                          << " samples: " << String(nsPerSample, 3) << " ns/sample" << std::endl;
+            }
+        }
+    }
+
+    DynamicObject::Ptr report = new DynamicObject();
+    report->setProperty("cpu", SystemStats::getCpuModel());
+    report->setProperty("operatingSystem", SystemStats::getOperatingSystemName());
+    report->setProperty("instructionSet", CpuDispatch::getName(CpuDispatch::getInstructionSet()));
+    report->setProperty("secondsPerRun", seconds);
+    report->setProperty("results", results);
+
+    if (args.containsOption("--deviation"))
+    {
+        Array<var> deviations;
+
+        for (auto sampleRate : sampleRates)
+        {
+            for (auto interval : { 8, 16, 32 })
+            {
+                for (auto color : { false, true })
+                {
+                    const auto maxError = measureControlRateDeviation(sampleRate, interval, color);
+
+                    DynamicObject::Ptr deviation = new DynamicObject();
+                    deviation->setProperty("sampleRate", sampleRate);
+                    deviation->setProperty("controlInterval", interval);
+                    deviation->setProperty("color", color);
+                    deviation->setProperty("maxError", maxError);
+                    deviation->setProperty("maxErrorDb", Decibels::gainToDecibels(maxError, -200.0));
+                    deviations.add(var(deviation.get()));
+                }
+            }
+        }
+
+        report->setProperty("controlRateDeviation", deviations);
+    }
+
+    // Cheap next to the stages, so it always runs: the table pick() chooses from can't drift from the kernels.
+    Array<var> interpolationErrors;
+    const auto numInterpolationMismatches = checkInterpolationErrors(interpolationErrors);
+    report->setProperty("interpolationError", interpolationErrors);
+
+    // The same for the bank, which has to sound like the engine it stands in for.
+    Array<var> bankDeviations;
+    const auto numBankMismatches = checkBankDeviation(bankDeviations);
+    report->setProperty("bankDeviation", bankDeviations);
+
+    const auto json = JSON::toString(var(report.get()));
+
+    if (args.containsOption("--output"))
+        File::getCurrentWorkingDirectory().getChildFile(args.getValueForOption("--output")).replaceWithText(json);
+    else
+        std::cout << json << std::endl;
+
+    if (args.containsOption("--baseline"))
+    {
+        const auto baselineFile = File::getCurrentWorkingDirectory().getChildFile(args.getValueForOption("--baseline"));
+        const auto threshold = args.containsOption("--threshold") ? args.getValueForOption("--threshold").getDoubleValue() : 10.0;
+
+        if (compareWithBaseline(results, baselineFile, threshold) > 0)
+            return 1;
+    }
+
+    return numInterpolationMismatches + numBankMismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+/*
+  ==============================================================================
+
+    PaintBenchmark.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "../../../Source/FrontPanel.h"
+#include "../../../Source/TelemetryView.h"
+
+// The artwork is exported at 300 dpi for the 72 dpi layout of the panel.
+#define ARTWORK_SCALE (300.0 / 72.0)
+
+/*
+ * Frame cost of the editor, painted offscreen the way a host window would at a given display scale.
+ * The binary resources belong to the plugin project, so the panel gets stand-in pictures with the size of the real
+ * artwork: the cost of drawing depends on the pixel count, not on the content.
+ * Every benchmark has artwork of its own, so the first frame rescales the background as the first editor would.
+ * The editor is laid out as the plugin's, with the telemetry strip collapsed unless a benchmark expands it.
+*/
+class PaintBenchmark
+{
+public:
+
+    explicit PaintBenchmark(float displayScale)
+        : scale(displayScale),
+          artwork(createStandInImages),
+          editor(artwork, telemetry),
+          panel(editor.panel),
+          frame(Image::RGB, roundToInt(PANEL_WIDTH * scale), roundToInt((PANEL_HEIGHT + TELEMETRY_BAR_HEIGHT + TELEMETRY_VIEW_HEIGHT) * scale), true)
+    {
+        artwork.waitUntilLoaded();
+        legacyBackground = createArtwork(PANEL_WIDTH, PANEL_HEIGHT);
+    }
+
+    static PanelArtwork::Images createStandInImages()
+    {
+        return { createArtwork(PANEL_WIDTH, PANEL_HEIGHT), createArtwork(26, 35), createArtwork(28, 28) };
+    }
+
+    /** The first frame after opening the editor, with the background and the layers still to be built. */
+    double measureFirstFrame()
+    {
+        return time([this] { paint(editor.getLocalBounds()); });
+    }
+
+    /** A full repaint, e.g. the window being uncovered. */
+    double measureFullFrame(int numFrames)
+    {
+        paint(editor.getLocalBounds());
+        return time([this] { paint(editor.getLocalBounds()); }, numFrames);
+    }
+
+    /** A click on the Color switch: only the switch picture is dirty. */
+    double measureSwitchFrame(int numFrames)
+    {
+        return time([this]
+        {
+            panel.colorSwitch.setToggleState(! panel.colorSwitch.getToggleState(), sendNotificationSync);
+            paint(panel.getColorSwitchArea());
+        }, numFrames);
+    }
+
+    /** A knob turned by automation: only the knob is dirty. */
+    double measureKnobFrame(int numFrames)
+    {
+        auto& knob = panel.rateSlider;
+        knob.setRange(0.0, 1.0);
+
+        return time([this, &knob]
+        {
+            knob.setValue(knob.getValue() > 0.5 ? 0.25 : 0.75, dontSendNotification);
+            paint(knob.getBounds());
+        }, numFrames);
+    }
+
+    /** The steady state with the telemetry strip expanded: every timer tick drains what the audio thread queued since
+        the last one and repaints the strip. The queues get what a 48 kHz stream in 512 sample blocks would queue. */
+    double measureTelemetryFrame(int numFrames)
+    {
+        auto& view = editor.telemetryView;
+        view.setExpanded(true);
+
+        // Fill the scope first, as it is once the strip has been open for a while.
+        for (int i = 0; i < roundToInt(TELEMETRY_VIEW_SECONDS * TELEMETRY_VIEW_FPS); ++i)
+        {
+            queueTelemetry();
+            view.refresh();
+        }
+
+        const auto frameTime = time([this, &view]
+        {
+            queueTelemetry();
+            view.refresh();
+            paint(view.getBounds());
+        }, numFrames);
+
+        view.setExpanded(false);
+        return frameTime;
+    }
+
+    /** What every repaint cost before the panel: the full size artwork resampled onto the whole editor. */
+    double measureLegacyFrame(int numFrames)
+    {
+        return time([this]
+        {
+            Graphics g(frame);
+            g.addTransform(AffineTransform::scale(scale));
+            g.drawImage(legacyBackground, Rectangle<float>(0.0f, 0.0f, static_cast<float>(PANEL_WIDTH), static_cast<float>(PANEL_HEIGHT)));
+        }, numFrames);
+    }
+
+private:
+
+    // The plugin editor's components and layout, without the processor it needs.
+    struct StandInEditor : public Component
+    {
+        StandInEditor(PanelArtwork& artwork, Telemetry& telemetry)
+            : panel(artwork), telemetryView(telemetry)
+        {
+            setOpaque(true);
+            addAndMakeVisible(panel);
+            addAndMakeVisible(telemetryView);
+
+            telemetryView.onExpandedChange = [this] { setSize(PANEL_WIDTH, PANEL_HEIGHT + telemetryView.getPreferredHeight()); };
+            setSize(PANEL_WIDTH, PANEL_HEIGHT + telemetryView.getPreferredHeight());
+        }
+
+        void resized() override
+        {
+            auto area = getLocalBounds();
+            panel.setBounds(area.removeFromTop(PANEL_HEIGHT));
+            telemetryView.setBounds(area);
+        }
+
+        FrontPanel panel;
+        TelemetryView telemetryView;
+    };
+
+    // One timer tick's worth of frames and trace points, with changing values so that the meters and the scope move.
+    void queueTelemetry()
+    {
+        constexpr double sampleRate = 48000.0;
+        constexpr int blockSize = 512;
+
+        for (int i = 0; i < roundToInt(sampleRate / blockSize / TELEMETRY_VIEW_FPS); ++i)
+        {
+            Telemetry::Frame frame;
+            frame.modulationSeconds = 2.0e-6f * random.nextFloat();
+            frame.phaserSeconds = 2.0e-5f * random.nextFloat();
+            frame.chorusSeconds = 1.0e-5f * random.nextFloat();
+            frame.blockSeconds = static_cast<float>(blockSize / sampleRate);
+            frame.peak = random.nextFloat();
+            frame.rms = frame.peak * 0.5f;
+            telemetry.push(frame);
+        }
+
+        for (int i = 0; i < roundToInt(TELEMETRY_TRACE_RATE / TELEMETRY_VIEW_FPS); ++i)
+        {
+            const auto lfo = 0.5f + 0.5f * std::sin(static_cast<float>(traceIndex++) * 0.05f);
+
+            Telemetry::TracePoint point;
+            point.lfo = lfo;
+            point.notchFrequency = 100.0f + 2000.0f * lfo;
+            telemetry.push(point);
+        }
+    }
+
+    // A smooth gradient with some grain, at artwork resolution.
+    static Image createArtwork(int width, int height)
+    {
+        Image image(Image::ARGB, roundToInt(width * ARTWORK_SCALE), roundToInt(height * ARTWORK_SCALE), false);
+        Graphics g(image);
+        g.setGradientFill(ColourGradient(Colours::darkslategrey, 0.0f, 0.0f, Colours::silver,
+                                         static_cast<float>(image.getWidth()), static_cast<float>(image.getHeight()), false));
+        g.fillAll();
+
+        Random random(0x5704e);
+
+        for (int i = 0; i < image.getWidth() * image.getHeight() / 64; ++i)
+            image.setPixelAt(random.nextInt(image.getWidth()), random.nextInt(image.getHeight()), Colours::black.withAlpha(random.nextFloat()));
+
+        return image;
+    }
+
+    // Paints the editor into the frame with the dirty area as clip, as the window peer does.
+    void paint(Rectangle<int> dirtyArea)
+    {
+        Graphics g(frame);
+        g.addTransform(AffineTransform::scale(scale));
+        g.reduceClipRegion(dirtyArea);
+        editor.paintEntireComponent(g, false);
+    }
+
+    // Median time of one call, in microseconds.
+    template <typename Callback>
+    static double time(Callback&& callback, int numFrames = 1)
+    {
+        std::vector<double> frames;
+
+        for (int i = 0; i < numFrames; ++i)
+        {
+            const auto start = Time::getHighResolutionTicks();
+            callback();
+            frames.push_back(Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - start) * 1.0e6);
+        }
+
+        std::sort(frames.begin(), frames.end());
+        return frames[frames.size() / 2];
+    }
+
+    const float scale;
+    PanelArtwork artwork;
+    Telemetry telemetry;
+    StandInEditor editor;
+    FrontPanel& panel;
+    Image frame;
+    Image legacyBackground;
+
+    Random random { 0x7e1e };
+    int traceIndex = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PaintBenchmark)
+};
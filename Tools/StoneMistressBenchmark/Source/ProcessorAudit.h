@@ -0,0 +1,245 @@
+/*
+  ==============================================================================
+
+    ProcessorAudit.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include <thread>
+#include "../../../Source/PluginProcessor.h"
+#include "../../../Source/Parameters.h"
+#include "../../../Source/StateFormat.h"
+#include "RealtimeAudit.h"
+
+// Longest host block the audit sends, in multiples of samplesPerBlock.
+#define AUDIT_MAX_OVERSIZE 8
+#define AUDIT_RESTORE_INTERVAL 20 // ms between two restores from the message thread.
+
+/*
+ * Real-time safety audit of the plugin: the StoneMistressAudioProcessor itself, driven the way a host drives it, with
+ * the RealtimeAudit trap armed around every processBlock() call on the audio thread. Everything the processor does per
+ * block is inside: reading the parameters, the crossfade into a restored state and the engine.
+ * One scenario: the processor is prepared on the message thread, then an audio thread of its own feeds it noise,
+ * silence long enough to put it to sleep even with Color on, and noise again. Every block has a different length, from
+ * 1 sample to AUDIT_MAX_OVERSIZE times samplesPerBlock (hosts that overshoot it exist). Rate and depths are automated on
+ * every block, the other parameters jump now and then.
+ * While there's noise, the message thread restores a saved state, in the current format or as the XML of older
+ * sessions, or selects a preset, which PresetBank applies from its own thread. The audio thread meets them halfway
+ * through a write and crossfades into them, and the message thread updates the latency.
+ * Host automation stays outside the trap: JUCE notifies the parameter listeners under a lock, which is the wrapper's
+ * business. The processor's own listener only raises a flag there.
+ * Offline scenarios prepare the processor for a bounce, so the channels run on the WorkerPool. Waking the workers and
+ * waiting for them is allowed then, and the trap only looks for allocations. The workers aren't armed, but the audio
+ * thread runs its own share of the ranges through the same code.
+ * Telemetry is enabled, as with the editor open, and drained outside the trap like the editor's timer would.
+*/
+template <typename SampleType>
+class ProcessorAudit
+{
+public:
+    ProcessorAudit(double newSampleRate, int newSamplesPerBlock, int newNumChannels, bool shouldRenderOffline)
+        : sampleRate(newSampleRate), samplesPerBlock(newSamplesPerBlock), numChannels(newNumChannels),
+        offline(shouldRenderOffline)
+    {
+        for (auto* parameter : processor.getParameters())
+            if (auto* ranged = dynamic_cast<RangedAudioParameter*>(parameter))
+                for (int index = 0; index < Parameters::numParameters; ++index)
+                    if (ranged->paramID == Parameters::ids[index])
+                        parameters[index] = ranged;
+    }
+
+    String getName() const
+    {
+        return String(std::is_same<SampleType, double>::value ? "processor_double" : "processor") + (offline ? "_offline " : " ")
+            + String(sampleRate) + " Hz, " + String(samplesPerBlock) + " samples, " + String(numChannels) + " ch";
+    }
+
+    /** Returns the number of violations the scenario caused. Call it from the message thread.
+
+        @param seconds  Noise before and after the silence, in total.
+    */
+    int run(double seconds)
+    {
+        const auto violationsBefore = RealtimeAudit::getNumViolations();
+
+        prepare();
+
+        std::thread audioThread([this, seconds] { processAudio(seconds); });
+
+        while (! finished.load())
+        {
+            Thread::sleep(AUDIT_RESTORE_INTERVAL);
+
+            if (restoring.load())
+                restore();
+        }
+
+        audioThread.join();
+        processor.releaseResources();
+
+        return RealtimeAudit::getNumViolations() - violationsBefore;
+    }
+
+    /** False if the silence never put the engine to sleep, in which case that path wasn't audited. */
+    bool hasSlept() const { return sleptOnce; }
+
+private:
+
+    void prepare()
+    {
+        const auto channelSet = numChannels == 1 ? AudioChannelSet::mono()
+                              : numChannels == 2 ? AudioChannelSet::stereo()
+                              : AudioChannelSet::discreteChannels(numChannels);
+
+        AudioProcessor::BusesLayout layout;
+        layout.inputBuses.add(channelSet);
+        layout.outputBuses.add(channelSet);
+
+        const auto layoutApplied = processor.setBusesLayout(layout);
+        jassert(layoutApplied);
+        ignoreUnused(layoutApplied);
+
+        // The host tells the processor about precision and bounces before preparing it.
+        processor.setProcessingPrecision(std::is_same<SampleType, double>::value ? AudioProcessor::doublePrecision
+                                                                                  : AudioProcessor::singlePrecision);
+        processor.setNonRealtime(offline);
+        processor.setRateAndBufferSizeDetails(sampleRate, samplesPerBlock);
+        processor.prepareToPlay(sampleRate, samplesPerBlock);
+        processor.getTelemetry().setEnabled(true);
+
+        storage.setSize(numChannels, samplesPerBlock * AUDIT_MAX_OVERSIZE);
+    }
+
+    void processAudio(double seconds)
+    {
+        const auto context = getName();
+        const auto checks = offline ? RealtimeAudit::Checks::allocationsOnly : RealtimeAudit::Checks::everything;
+        const auto silenceStart = static_cast<int64>(0.5 * seconds * sampleRate);
+        const auto silenceEnd = silenceStart + static_cast<int64>((StoneMistressEngine<SampleType>::getTailLengthSeconds(true) + 1.0) * sampleRate);
+        const auto totalSamples = silenceEnd + silenceStart;
+        auto& telemetry = processor.getTelemetry();
+        MidiBuffer midi;
+
+        for (int64 position = 0; position < totalSamples;)
+        {
+            const auto numSamples = nextBlockSize();
+            const auto silent = position >= silenceStart && position < silenceEnd;
+
+            // A restore reaching the engine during the silence would only delay the sleep.
+            restoring = ! silent;
+            fill(numSamples, silent);
+            automate();
+
+            // The host's buffer, built outside the trap: from 32 channels up AudioBuffer allocates its pointer array.
+            AudioBuffer<SampleType> block(storage.getArrayOfWritePointers(), numChannels, numSamples);
+
+            {
+                RealtimeAudit::ScopedTrap trap(context.toRawUTF8(), checks);
+                processor.processBlock(block, midi);
+            }
+
+            telemetry.readFrames([this](const Telemetry::Frame& frame) { sleptOnce = sleptOnce || frame.sleeping; });
+            telemetry.readTrace([](const Telemetry::TracePoint&) {});
+
+            position += numSamples;
+        }
+
+        restoring = false;
+        finished = true;
+    }
+
+    int nextBlockSize()
+    {
+        switch (random.nextInt(6))
+        {
+            case 0:  return 1 + random.nextInt(16);
+            case 1:  return samplesPerBlock;
+            case 2:  return samplesPerBlock + 1;
+            case 3:  return samplesPerBlock * AUDIT_MAX_OVERSIZE;
+            default: return 1 + random.nextInt(samplesPerBlock * AUDIT_MAX_OVERSIZE);
+        }
+    }
+
+    void fill(int numSamples, bool silent)
+    {
+        for (int ch = 0; ch < numChannels; ++ch)
+            for (int smp = 0; smp < numSamples; ++smp)
+                storage.setSample(ch, smp, silent ? SampleType(0) : static_cast<SampleType>(random.nextFloat() - 0.5f));
+    }
+
+    // Rate and depths move on every block, like host automation, and everything else jumps every 64 blocks.
+    void automate()
+    {
+        if (++blockCount % 64 == 0)
+        {
+            for (auto index : { Parameters::indexColor, Parameters::indexOversampling, Parameters::indexLinearPhase,
+                                Parameters::indexPhaserMix, Parameters::indexChorusMix, Parameters::indexChorusVoices })
+                parameters[index]->setValueNotifyingHost(random.nextFloat());
+        }
+
+        for (auto index : { Parameters::indexRate, Parameters::indexPhaserDepth, Parameters::indexChorusDepth })
+            parameters[index]->setValueNotifyingHost(random.nextFloat());
+    }
+
+    // Message thread. Every parameter off its default, in one of the three ways a session or the user changes them all.
+    void restore()
+    {
+        Parameters::Values values;
+
+        for (int index = 0; index < Parameters::numParameters; ++index)
+            values[static_cast<size_t>(index)] = parameters[index]->convertFrom0to1(restoreRandom.nextFloat());
+
+        MemoryBlock state;
+
+        switch (restoreRandom.nextInt(3))
+        {
+            case 0:
+                StateFormat::write(values, -1, state);
+                processor.setStateInformation(state.getData(), static_cast<int>(state.getSize()));
+                break;
+
+            case 1:
+                writeXml(values, state);
+                processor.setStateInformation(state.getData(), static_cast<int>(state.getSize()));
+                break;
+
+            default:
+                processor.setCurrentProgram(restoreRandom.nextInt(processor.getNumPrograms()));
+                break;
+        }
+    }
+
+    // What the processor saved before StateFormat: the XML of its AudioProcessorValueTreeState.
+    static void writeXml(const Parameters::Values& values, MemoryBlock& destData)
+    {
+        XmlElement xml("STONEMISTRESS_PARAMS");
+
+        for (int index = 0; index < Parameters::numParameters; ++index)
+        {
+            auto* parameter = xml.createNewChildElement("PARAM");
+            parameter->setAttribute("id", Parameters::ids[index]);
+            parameter->setAttribute("value", values[static_cast<size_t>(index)]);
+        }
+
+        AudioProcessor::copyXmlToBinary(xml, destData);
+    }
+
+    const double sampleRate;
+    const int samplesPerBlock;
+    const int numChannels;
+    const bool offline;
+
+    StoneMistressAudioProcessor processor;
+    RangedAudioParameter* parameters[Parameters::numParameters] = {};
+    AudioBuffer<SampleType> storage;
+    Random random { 0x5704e }; // Audio thread.
+    Random restoreRandom { 0x5704f }; // Message thread.
+    int blockCount = 0;
+    bool sleptOnce = false;
+
+    std::atomic<bool> restoring { false };
+    std::atomic<bool> finished { false };
+};
@@ -0,0 +1,248 @@
+/*
+  ==============================================================================
+
+    RealtimeAudit.cpp
+
+  ==============================================================================
+*/
+
+#include "RealtimeAudit.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if JUCE_LINUX
+ #include <cerrno>
+ #include <cstdarg>
+ #include <dlfcn.h>
+ #include <pthread.h>
+ #include <semaphore.h>
+ #include <sched.h>
+ #include <time.h>
+ #include <unistd.h>
+#endif
+
+// On Linux the C allocation functions, the pthread locks and the blocking system call wrappers are interposed: the
+// executable defines them, so every call from the program and from the shared libraries it loads lands here first,
+// gets checked and is forwarded to glibc. operator new and delete end up in malloc and free there.
+// Elsewhere operator new and delete are replaced instead, which catches every C++ allocation but not malloc or locks.
+
+// Full stack traces are printed for the first few violations, the rest are only counted.
+#define MAX_REPORTED_VIOLATIONS 8
+
+namespace
+{
+    // Constant initialised, so the hooks can read them from any thread at any time, even during static initialisation.
+    thread_local bool armed = false;
+    thread_local bool reporting = false;
+    thread_local bool allocationsOnly = false;
+    thread_local const char* currentContext = nullptr;
+    std::atomic<int> numViolations { 0 };
+
+    void violation(const char* what)
+    {
+        if (! armed || reporting)
+            return;
+
+        // Printing and building the stack trace allocate and write, they must not be reported themselves.
+        reporting = true;
+
+        if (++numViolations <= MAX_REPORTED_VIOLATIONS)
+        {
+            std::fprintf(stderr, "REAL-TIME VIOLATION: %s in %s\n%s\n", what, currentContext,
+                         SystemStats::getStackBacktrace().toRawUTF8());
+        }
+
+        reporting = false;
+    }
+
+    // Locks and system calls, which a trap for allocations only lets through.
+    void blockingViolation(const char* what)
+    {
+        if (! allocationsOnly)
+            violation(what);
+    }
+}
+
+namespace RealtimeAudit
+{
+    ScopedTrap::ScopedTrap(const char* context, Checks checks)
+        : previousContext(currentContext), previousAllocationsOnly(allocationsOnly)
+    {
+        currentContext = context;
+        allocationsOnly = checks == Checks::allocationsOnly;
+        armed = true;
+    }
+
+    ScopedTrap::~ScopedTrap()
+    {
+        armed = previousContext != nullptr;
+        currentContext = previousContext;
+        allocationsOnly = previousAllocationsOnly;
+    }
+
+    int getNumViolations()
+    {
+        return numViolations.load();
+    }
+}
+
+//==============================================================================
+#if JUCE_LINUX
+
+extern "C"
+{
+    void* __libc_malloc(size_t);
+    void* __libc_calloc(size_t, size_t);
+    void* __libc_realloc(void*, size_t);
+    void* __libc_memalign(size_t, size_t);
+    void __libc_free(void*);
+}
+
+namespace
+{
+    // The glibc version of a hooked function, looked up past the executable. Looked up on first use as well, in
+    // case something locks or writes during static initialisation, before initialise() runs.
+    template <typename Function>
+    Function* next(Function*& cached, const char* name)
+    {
+        if (cached == nullptr)
+            cached = reinterpret_cast<Function*>(dlsym(RTLD_NEXT, name));
+
+        return cached;
+    }
+
+    int (*realMutexLock)(pthread_mutex_t*) = nullptr;
+    int (*realRwlockRdlock)(pthread_rwlock_t*) = nullptr;
+    int (*realRwlockWrlock)(pthread_rwlock_t*) = nullptr;
+    int (*realCondWait)(pthread_cond_t*, pthread_mutex_t*) = nullptr;
+    int (*realCondTimedwait)(pthread_cond_t*, pthread_mutex_t*, const timespec*) = nullptr;
+    int (*realSemWait)(sem_t*) = nullptr;
+    ssize_t (*realRead)(int, void*, size_t) = nullptr;
+    ssize_t (*realWrite)(int, const void*, size_t) = nullptr;
+    int (*realNanosleep)(const timespec*, timespec*) = nullptr;
+    int (*realUsleep)(useconds_t) = nullptr;
+    int (*realSchedYield)() = nullptr;
+    long (*realSyscall)(long, ...) = nullptr;
+}
+
+extern "C"
+{
+    // Allocation. free(nullptr) is a no-op that some code calls on purpose, it isn't reported.
+    void* malloc(size_t size)                   { violation("malloc"); return __libc_malloc(size); }
+    void* calloc(size_t count, size_t size)     { violation("calloc"); return __libc_calloc(count, size); }
+    void* realloc(void* pointer, size_t size)   { violation("realloc"); return __libc_realloc(pointer, size); }
+    void* memalign(size_t alignment, size_t size)       { violation("memalign"); return __libc_memalign(alignment, size); }
+    void* aligned_alloc(size_t alignment, size_t size)  { violation("aligned_alloc"); return __libc_memalign(alignment, size); }
+
+    int posix_memalign(void** pointer, size_t alignment, size_t size)
+    {
+        violation("posix_memalign");
+        *pointer = __libc_memalign(alignment, size);
+        return *pointer != nullptr ? 0 : ENOMEM;
+    }
+
+    void free(void* pointer)
+    {
+        if (pointer != nullptr)
+            violation("free");
+
+        __libc_free(pointer);
+    }
+
+    // Locks. std::mutex, juce::CriticalSection and juce::WaitableEvent all end up in one of these.
+    int pthread_mutex_lock(pthread_mutex_t* mutex)          { blockingViolation("pthread_mutex_lock"); return next(realMutexLock, "pthread_mutex_lock")(mutex); }
+    int pthread_rwlock_rdlock(pthread_rwlock_t* lock)       { blockingViolation("pthread_rwlock_rdlock"); return next(realRwlockRdlock, "pthread_rwlock_rdlock")(lock); }
+    int pthread_rwlock_wrlock(pthread_rwlock_t* lock)       { blockingViolation("pthread_rwlock_wrlock"); return next(realRwlockWrlock, "pthread_rwlock_wrlock")(lock); }
+    int sem_wait(sem_t* semaphore)                          { blockingViolation("sem_wait"); return next(realSemWait, "sem_wait")(semaphore); }
+
+    int pthread_cond_wait(pthread_cond_t* condition, pthread_mutex_t* mutex)
+    {
+        blockingViolation("pthread_cond_wait");
+        return next(realCondWait, "pthread_cond_wait")(condition, mutex);
+    }
+
+    int pthread_cond_timedwait(pthread_cond_t* condition, pthread_mutex_t* mutex, const timespec* time)
+    {
+        blockingViolation("pthread_cond_timedwait");
+        return next(realCondTimedwait, "pthread_cond_timedwait")(condition, mutex, time);
+    }
+
+    // System calls that block or go through the kernel: file and console I/O, sleeping and yielding, and the raw
+    // syscall() wrapper, which is how futexes are reached outside of pthread.
+    ssize_t read(int file, void* data, size_t size)         { blockingViolation("read"); return next(realRead, "read")(file, data, size); }
+    ssize_t write(int file, const void* data, size_t size)  { blockingViolation("write"); return next(realWrite, "write")(file, data, size); }
+    int nanosleep(const timespec* duration, timespec* left) { blockingViolation("nanosleep"); return next(realNanosleep, "nanosleep")(duration, left); }
+    int usleep(useconds_t microseconds)                     { blockingViolation("usleep"); return next(realUsleep, "usleep")(microseconds); }
+    int sched_yield()                                       { blockingViolation("sched_yield"); return next(realSchedYield, "sched_yield")(); }
+
+    long syscall(long number, ...)
+    {
+        blockingViolation("syscall");
+
+        va_list args;
+        va_start(args, number);
+        long arguments[6];
+
+        for (auto& argument : arguments)
+            argument = va_arg(args, long);
+
+        va_end(args);
+
+        return next(realSyscall, "syscall")(number, arguments[0], arguments[1], arguments[2], arguments[3], arguments[4], arguments[5]);
+    }
+}
+
+bool RealtimeAudit::initialise()
+{
+    next(realMutexLock, "pthread_mutex_lock");
+    next(realRwlockRdlock, "pthread_rwlock_rdlock");
+    next(realRwlockWrlock, "pthread_rwlock_wrlock");
+    next(realCondWait, "pthread_cond_wait");
+    next(realCondTimedwait, "pthread_cond_timedwait");
+    next(realSemWait, "sem_wait");
+    next(realRead, "read");
+    next(realWrite, "write");
+    next(realNanosleep, "nanosleep");
+    next(realUsleep, "usleep");
+    next(realSchedYield, "sched_yield");
+    next(realSyscall, "syscall");
+    return true;
+}
+
+//==============================================================================
+#else
+
+void* operator new(std::size_t size)
+{
+    violation("operator new");
+
+    if (auto* pointer = std::malloc(size == 0 ? 1 : size))
+        return pointer;
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)                                  { return operator new(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept    { violation("operator new"); return std::malloc(size == 0 ? 1 : size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept  { violation("operator new[]"); return std::malloc(size == 0 ? 1 : size); }
+
+void operator delete(void* pointer) noexcept
+{
+    if (pointer != nullptr)
+        violation("operator delete");
+
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept                          { operator delete(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept               { operator delete(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept             { operator delete(pointer); }
+
+bool RealtimeAudit::initialise()
+{
+    return false;
+}
+
+#endif
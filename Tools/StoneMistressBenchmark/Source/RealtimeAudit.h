@@ -0,0 +1,45 @@
+/*
+  ==============================================================================
+
+    RealtimeAudit.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+
+// Real-time safety trap for the audit mode of the benchmark: while it is armed on a thread, every heap allocation,
+// lock or blocking system call made from that thread is counted and reported with a stack trace.
+namespace RealtimeAudit
+{
+    /** Looks up the functions the hooks forward to, call it once before arming any trap.
+        Returns false where only operator new and delete can be trapped: malloc, the pthread locks and the system
+        calls are only hooked on Linux.
+    */
+    bool initialise();
+
+    /** What a trap reports. Offline processing may wait for other threads, but still must not allocate. */
+    enum class Checks
+    {
+        everything,
+        allocationsOnly
+    };
+
+    /** Arms the trap on the calling thread for its lifetime. Anything it catches is reported against the context. */
+    class ScopedTrap
+    {
+    public:
+        explicit ScopedTrap(const char* context, Checks checks = Checks::everything);
+        ~ScopedTrap();
+
+    private:
+        const char* previousContext;
+        const bool previousAllocationsOnly;
+
+        JUCE_DECLARE_NON_COPYABLE(ScopedTrap)
+    };
+
+    /** Violations caught since the start of the program, on any thread. */
+    int getNumViolations();
+}
@@ -0,0 +1,147 @@
+/*
+  ==============================================================================
+
+    ReferenceModulation.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "../../../Source/Profiling.h"
+
+/*
+ * The modulation as the plugin first shipped it: LFO writes the triangle, ParameterModulation scales it for one unit in
+ * a second pass. ModulationGenerator has since fused both (and the chorus clamp) into one pass, which is what the engine
+ * runs. These two only remain here as the reference the "lfo" and "modulation" stages time, to be compared against
+ * "modulation_fused".
+*/
+template <typename SampleType>
+class LFO
+{
+public:
+    LFO(double defaultRate = 7.0, double defaultPhaseDelta = 0.5)
+    {
+        rate.setTargetValue(defaultRate);
+        phaseDelta = defaultPhaseDelta;
+    }
+
+    ~LFO() {}
+
+    void prepareToPlay(double sampleRate)
+    {
+        rate.reset(sampleRate, 0.02);
+        samplePeriod = 1.0 / sampleRate;
+    }
+
+    void setRate(double newValue)
+    {
+        // No zero-frequency allowed
+        jassert(newValue > 0);
+        rate.setTargetValue(newValue);
+    }
+
+    /* Left Channel/Channel 0 = Chorus Unit.
+       Right Channel/Channel 1 = Phaser Unit.
+    */
+    void getNextAudioBlock(AudioBuffer<SampleType>& buffer, const int numSamples)
+    {
+        STONEMISTRESS_TRACE_SCOPE("LFO::getNextAudioBlock");
+
+        auto data = buffer.getArrayOfWritePointers();
+
+        for (int smp = 0; smp < numSamples; ++smp)
+        {
+            double leftSample = 0.0f;
+            double rightSample = 0.0f;
+
+            getNextAudioSample(leftSample, rightSample);
+
+            data[0][smp] = static_cast<SampleType>(leftSample);
+            data[1][smp] = static_cast<SampleType>(rightSample);
+        }
+    }
+
+    void getNextAudioSample(double& leftSample, double& rightSample)
+    {
+        // Small Stone LFO Is a Triangle Wave
+        leftSample = 4.0 * abs(currentPhase - std::floor(currentPhase + 0.5)) - 1.0;
+        rightSample = 4.0 * abs((currentPhase + phaseDelta) - std::floor(currentPhase + phaseDelta + 0.5)) - 1.0;
+
+        phaseIncrement = rate.getNextValue() * samplePeriod;
+        currentPhase += phaseIncrement;
+        currentPhase -= static_cast<int>(currentPhase);
+    }
+
+private:
+    SmoothedValue<double, ValueSmoothingTypes::Multiplicative> rate;
+
+    double currentPhase = 0;
+    double phaseIncrement = 0;
+    double samplePeriod = 1.0;
+    double phaseDelta = 0.5;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LFO)
+};
+
+template <typename SampleType>
+class ParameterModulation {
+public:
+
+    ParameterModulation(const double defaultPhaserDepth = 0.030, const double defaultChorusDepth = 0.0)
+    {
+        phaserDepth.setCurrentAndTargetValue(static_cast<SampleType>(defaultPhaserDepth));
+        chorusDepth.setCurrentAndTargetValue(static_cast<SampleType>(defaultChorusDepth));
+    }
+
+    ~ParameterModulation() {}
+
+    void prepareToPlay(double sampleRate)
+    {
+        phaserDepth.reset(sampleRate, 0.02);
+        chorusDepth.reset(sampleRate, 0.2);
+    }
+
+    void setPhaserDepth(const double newValue)
+    {
+        phaserDepth.setTargetValue(static_cast<SampleType>(newValue));
+    }
+
+    void setChorusDepth(const double newValue)
+    {
+        chorusDepth.setTargetValue(static_cast<SampleType>(newValue));
+    }
+
+    void processBlock(AudioBuffer<SampleType>& buffer, const int numSamples, const String unit)
+    {
+        STONEMISTRESS_TRACE_SCOPE("ParameterModulation::processBlock");
+
+        auto data = buffer.getArrayOfWritePointers();
+        const auto numCh = buffer.getNumChannels();
+
+        for (int ch = 0; ch < numCh; ++ch)
+        {
+            FloatVectorOperations::add(data[ch], SampleType(1), numSamples); // At this stage, LFO is in range [0, +2]
+            FloatVectorOperations::multiply(data[ch], SampleType(0.5), numSamples); // At this stage, LFO is in range [0, +1]
+        }
+
+        if (unit == "p")
+        {
+            phaserDepth.applyGain(data[0], numSamples);
+            phaserDepth.applyGain(data[1], numSamples);
+        }
+        else if (unit == "c")
+        {
+            chorusDepth.applyGain(data[0], numSamples);
+            chorusDepth.applyGain(data[1], numSamples);
+        }
+    }
+
+private:
+
+    SmoothedValue<SampleType, ValueSmoothingTypes::Linear> phaserDepth;
+    SmoothedValue<SampleType, ValueSmoothingTypes::Linear> chorusDepth;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ParameterModulation)
+
+};
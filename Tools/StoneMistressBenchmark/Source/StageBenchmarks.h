@@ -0,0 +1,562 @@
+/*
+  ==============================================================================
+
+    StageBenchmarks.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "../../../Source/Parameters.h"
+#include "../../../Source/StoneMistressBank.h"
+#include "../../../Source/StoneMistressEngine.h"
+#include "ReferenceModulation.h"
+
+/*
+ * One unit of the chain, set up so that it can be run block after block in isolation.
+ * prepare() builds a fresh instance for every measurement, so no state leaks between block sizes and sample rates.
+*/
+class StageBenchmark
+{
+public:
+    virtual ~StageBenchmark() = default;
+
+    virtual String getName() const = 0;
+    virtual void prepare(double sampleRate, int blockSize) = 0;
+    virtual void processBlock(int blockSize) = 0;
+
+protected:
+
+    template <typename SampleType>
+    static void fillWithNoise(AudioBuffer<SampleType>& buffer)
+    {
+        Random random(0x5704e);
+
+        for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+            for (int smp = 0; smp < buffer.getNumSamples(); ++smp)
+                buffer.setSample(ch, smp, static_cast<SampleType>(random.nextFloat() - 0.5f));
+    }
+
+    /** Fills both buffers with one block of modulation from the ModulationGenerator the engine runs, as steps 1-4 would.
+        The chorus one may hold several voices per channel.
+    */
+    static void fillWithModulation(AudioBuffer<float>& phaserModulation, AudioBuffer<float>& chorusModulation, double sampleRate,
+                                   int blockSize, int numVoices = 1)
+    {
+        ModulationGenerator<float> generator(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::maxDelayTime * 0.5);
+
+        phaserModulation.setSize(2, blockSize);
+        chorusModulation.setSize(2 * numVoices, blockSize);
+        generator.prepareToPlay(sampleRate);
+        generator.getNextAudioBlock(phaserModulation, chorusModulation, blockSize);
+    }
+};
+
+// "lfo" and "modulation" time the two passes of ReferenceModulation.h, which ModulationGenerator replaced. They stay as
+// the reference "modulation_fused" is compared against.
+class LfoBenchmark : public StageBenchmark
+{
+public:
+    String getName() const override { return "lfo"; }
+
+    void prepare(double sampleRate, int blockSize) override
+    {
+        lfo = std::make_unique<LFO<float>>(Parameters::defaultRate);
+        lfo->prepareToPlay(sampleRate);
+        modulation.setSize(2, blockSize);
+    }
+
+    void processBlock(int blockSize) override { lfo->getNextAudioBlock(modulation, blockSize); }
+
+private:
+    std::unique_ptr<LFO<float>> lfo;
+    AudioBuffer<float> modulation;
+};
+
+// Both scaling passes. Depths are 1 so that running the pass over its own output stays bounded.
+class ModulationBenchmark : public StageBenchmark
+{
+public:
+    String getName() const override { return "modulation"; }
+
+    void prepare(double sampleRate, int blockSize) override
+    {
+        LFO<float> lfo(Parameters::defaultRate);
+
+        modulator = std::make_unique<ParameterModulation<float>>(1.0, 1.0);
+        modulator->prepareToPlay(sampleRate);
+        lfo.prepareToPlay(sampleRate);
+        phaserModulation.setSize(2, blockSize);
+        chorusModulation.setSize(2, blockSize);
+        lfo.getNextAudioBlock(phaserModulation, blockSize);
+        chorusModulation.makeCopyOf(phaserModulation);
+    }
+
+    void processBlock(int blockSize) override
+    {
+        modulator->processBlock(phaserModulation, blockSize, "p");
+        modulator->processBlock(chorusModulation, blockSize, "c");
+    }
+
+private:
+    std::unique_ptr<ParameterModulation<float>> modulator;
+    AudioBuffer<float> phaserModulation;
+    AudioBuffer<float> chorusModulation;
+};
+
+// Steps 1-4 of the engine in the single pass it actually runs: LFO, both depths and the chorus clamp.
+class FusedModulationBenchmark : public StageBenchmark
+{
+public:
+    String getName() const override { return "modulation_fused"; }
+
+    void prepare(double sampleRate, int blockSize) override
+    {
+        generator = std::make_unique<ModulationGenerator<float>>(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth);
+        generator->prepareToPlay(sampleRate);
+        phaserModulation.setSize(2, blockSize);
+        chorusModulation.setSize(2, blockSize);
+    }
+
+    void processBlock(int blockSize) override { generator->getNextAudioBlock(phaserModulation, chorusModulation, blockSize); }
+
+private:
+    std::unique_ptr<ModulationGenerator<float>> generator;
+    AudioBuffer<float> phaserModulation;
+    AudioBuffer<float> chorusModulation;
+};
+
+// The phaser and the chorus mix their dry signal in, which has gain above unity, so like the engine they restore
+// their input from a noise block before every call.
+// "phaser_stages<n>" are the deeper voicings, whose cost per stage should stay that of the Small Stone's four.
+template <int numStages = STAGES>
+class PhaserBenchmark : public StageBenchmark
+{
+public:
+    PhaserBenchmark(bool shouldUseColor, int coefficientInterval = 1, int oversamplingFactor = 1)
+        : color(shouldUseColor), controlInterval(coefficientInterval), oversampling(oversamplingFactor) {}
+
+    String getName() const override
+    {
+        return String(color ? "phaser_color_on" : "phaser_color_off") + (controlInterval > 1 ? "_cr" + String(controlInterval) : String())
+            + (oversampling > 1 ? "_os" + String(oversampling) : String()) + (numStages != STAGES ? "_stages" + String(numStages) : String());
+    }
+
+    void prepare(double sampleRate, int blockSize) override
+    {
+        phaser = std::make_unique<SmallStone<float, numStages>>();
+        phaser->prepareToPlay(sampleRate, blockSize);
+        phaser->setColor(color);
+        phaser->setControlInterval(controlInterval);
+        phaser->setOversampling(oversampling, false);
+        input.setSize(2, blockSize);
+        fillWithNoise(input);
+        audio.setSize(2, blockSize);
+        AudioBuffer<float> chorusModulation;
+        fillWithModulation(modulation, chorusModulation, sampleRate, blockSize);
+    }
+
+    void processBlock(int blockSize) override
+    {
+        for (int ch = 0; ch < 2; ++ch)
+            audio.copyFrom(ch, 0, input, ch, 0, blockSize);
+
+        phaser->processBlock(audio, modulation, 0, blockSize);
+    }
+
+private:
+    const bool color;
+    const int controlInterval;
+    const int oversampling;
+    std::unique_ptr<SmallStone<float, numStages>> phaser;
+    AudioBuffer<float> input;
+    AudioBuffer<float> audio;
+    AudioBuffer<float> modulation;
+};
+
+// "chorus" is the all-pass kernel the plugin plays with, the others are named after theirs. "chorus_voices<n>" reads
+// n voices per channel with the all-pass, each at its own LFO phase as the engine spreads them.
+class ChorusBenchmark : public StageBenchmark
+{
+public:
+    explicit ChorusBenchmark(ChorusInterpolation::Kernel interpolationKernel = ChorusInterpolation::allPass, int numberOfVoices = 1)
+        : kernel(interpolationKernel), numVoices(numberOfVoices) {}
+
+    String getName() const override
+    {
+        if (numVoices > 1)
+            return "chorus_voices" + String(numVoices);
+
+        return kernel == ChorusInterpolation::allPass ? String("chorus") : "chorus_" + String(ChorusInterpolation::getName(kernel));
+    }
+
+    void prepare(double sampleRate, int blockSize) override
+    {
+        chorus = std::make_unique<Chorus<float>>();
+        chorus->prepareToPlay(sampleRate, blockSize);
+        chorus->setInterpolation(kernel);
+        chorus->setNumVoices(numVoices);
+        input.setSize(2, blockSize);
+        fillWithNoise(input);
+        audio.setSize(2, blockSize);
+        AudioBuffer<float> phaserModulation;
+        fillWithModulation(phaserModulation, modulation, sampleRate, blockSize, numVoices);
+    }
+
+    void processBlock(int blockSize) override
+    {
+        for (int ch = 0; ch < 2; ++ch)
+            audio.copyFrom(ch, 0, input, ch, 0, blockSize);
+
+        chorus->processBlock(audio, modulation, 0, blockSize);
+    }
+
+private:
+    const ChorusInterpolation::Kernel kernel;
+    const int numVoices;
+    std::unique_ptr<Chorus<float>> chorus;
+    AudioBuffer<float> input;
+    AudioBuffer<float> audio;
+    AudioBuffer<float> modulation;
+};
+
+// The whole chain, which is all StoneMistressAudioProcessor::processBlock does, in either precision. The chain has gain
+// above unity, so the input is restored from a noise block before every call.
+// "engine_idle" feeds silence and runs the tail out in prepare(), so it times the sleeping engine: the silence check and
+// the LFO phase advance. "engine_12ch" runs a 7.1.4 bed, to be compared against six times "engine". The "_parallel"
+// ones split the channels over the WorkerPool as an offline render does, their time is wall clock time.
+template <typename SampleType>
+class EngineBenchmark : public StageBenchmark
+{
+public:
+    EngineBenchmark(bool shouldBeSilent = false, int channels = 2, bool withTelemetry = false, bool inParallel = false)
+        : silent(shouldBeSilent), numChannels(channels), measured(withTelemetry), parallel(inParallel) {}
+
+    String getName() const override
+    {
+        if (silent)
+            return "engine_idle";
+
+        if (measured)
+            return "engine_telemetry";
+
+        return String(std::is_same<SampleType, double>::value ? "engine_double" : "engine") + (numChannels != 2 ? "_" + String(numChannels) + "ch" : String())
+             + (parallel ? "_parallel" : "");
+    }
+
+    void prepare(double sampleRate, int blockSize) override
+    {
+        engine = std::make_unique<StoneMistressEngine<SampleType>>(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth);
+        engine->setParallelProcessing(parallel);
+        engine->prepareToPlay(sampleRate, blockSize, numChannels);
+        engine->setTelemetry(&telemetry);
+        telemetry.setEnabled(measured);
+        input.setSize(numChannels, blockSize);
+        input.clear();
+
+        if (! silent)
+            fillWithNoise(input);
+
+        audio.setSize(numChannels, blockSize);
+
+        while (silent && ! engine->isSleeping())
+            processBlock(blockSize);
+    }
+
+    void processBlock(int blockSize) override
+    {
+        for (int ch = 0; ch < numChannels; ++ch)
+            audio.copyFrom(ch, 0, input, ch, 0, blockSize);
+
+        engine->processBlock(audio);
+
+        // The editor's side, included: it's cheap next to the block, and keeps the queues from filling up.
+        if (measured)
+        {
+            telemetry.readFrames([](const Telemetry::Frame&) {});
+            telemetry.readTrace([](const Telemetry::TracePoint&) {});
+        }
+    }
+
+private:
+    const bool silent;
+    const int numChannels;
+    const bool measured;
+    const bool parallel;
+    Telemetry telemetry;
+    std::unique_ptr<StoneMistressEngine<SampleType>> engine;
+    AudioBuffer<SampleType> input;
+    AudioBuffer<SampleType> audio;
+};
+
+// A full bank of tracks through the whole chain. Divide by the lane count to compare against "engine".
+class BankBenchmark : public StageBenchmark
+{
+public:
+    using Bank = StoneMistressBank<STONEMISTRESS_BANK_LANES>;
+
+    String getName() const override { return "bank_x" + String(STONEMISTRESS_BANK_LANES); }
+
+    void prepare(double sampleRate, int blockSize) override
+    {
+        bank = std::make_unique<Bank>(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth);
+        bank->prepareToPlay(sampleRate, blockSize);
+        input.setSize(2, blockSize);
+        fillWithNoise(input);
+
+        for (int lane = 0; lane < STONEMISTRESS_BANK_LANES; ++lane)
+        {
+            tracks[lane].setSize(2, blockSize);
+            trackPointers[lane] = &tracks[lane];
+            bank->setRate(lane, Parameters::defaultRate * (1.0 + 0.1 * lane));
+            bank->setColor(lane, lane % 2 == 1);
+        }
+    }
+
+    void processBlock(int blockSize) override
+    {
+        for (auto& track : tracks)
+            for (int ch = 0; ch < 2; ++ch)
+                track.copyFrom(ch, 0, input, ch, 0, blockSize);
+
+        bank->processBlock(trackPointers, STONEMISTRESS_BANK_LANES, blockSize);
+    }
+
+private:
+    std::unique_ptr<Bank> bank;
+    AudioBuffer<float> input;
+    AudioBuffer<float> tracks[STONEMISTRESS_BANK_LANES];
+    AudioBuffer<float>* trackPointers[STONEMISTRESS_BANK_LANES];
+};
+
+/** Largest difference between a full bank and one StoneMistressEngine per track, over one second of noise in blocks of
+    every length up to twice the prepared one. Every track has settings of its own, Color included, and they all
+    change halfway through.
+*/
+static double measureBankDeviation(double sampleRate)
+{
+    constexpr int numLanes = STONEMISTRESS_BANK_LANES;
+    const int blockSize = 512;
+
+    StoneMistressBank<numLanes> bank(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth);
+    OwnedArray<StoneMistressEngine<float>> engines;
+    Random random(0x5704e);
+
+    for (int lane = 0; lane < numLanes; ++lane)
+        engines.add(new StoneMistressEngine<float>(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth));
+
+    auto randomise = [&]
+    {
+        for (int lane = 0; lane < numLanes; ++lane)
+        {
+            const auto rate = 0.05 + 7.95 * random.nextDouble();
+            const auto phaserDepth = 2000.0 * random.nextDouble();
+            const auto chorusDepth = 0.04 * random.nextDouble();
+            const auto phaserMix = random.nextDouble();
+            const auto chorusMix = random.nextDouble();
+            const auto color = random.nextBool();
+            auto& engine = *engines[lane];
+
+            bank.setRate(lane, rate);
+            bank.setPhaserDepth(lane, phaserDepth);
+            bank.setChorusDepth(lane, chorusDepth);
+            bank.setPhaserMix(lane, phaserMix);
+            bank.setChorusMix(lane, chorusMix);
+            bank.setColor(lane, color);
+
+            engine.setRate(rate);
+            engine.setPhaserDepth(phaserDepth);
+            engine.setChorusDepth(chorusDepth);
+            engine.setPhaserMix(phaserMix);
+            engine.setChorusMix(chorusMix);
+            engine.setColor(color);
+        }
+    };
+
+    randomise();
+    bank.prepareToPlay(sampleRate, blockSize);
+
+    for (auto* engine : engines)
+        engine->prepareToPlay(sampleRate, blockSize);
+
+    AudioBuffer<float> tracks[numLanes], references[numLanes];
+    AudioBuffer<float>* trackPointers[numLanes];
+    double maxError = 0.0;
+    bool changed = false;
+
+    for (int position = 0; position < roundToInt(sampleRate);)
+    {
+        const auto numSamples = 1 + random.nextInt(2 * blockSize);
+
+        if (! changed && position >= roundToInt(sampleRate * 0.5))
+        {
+            randomise();
+            changed = true;
+        }
+
+        for (int lane = 0; lane < numLanes; ++lane)
+        {
+            tracks[lane].setSize(2, numSamples, false, false, true);
+            references[lane].setSize(2, numSamples, false, false, true);
+            trackPointers[lane] = &tracks[lane];
+
+            for (int ch = 0; ch < 2; ++ch)
+            {
+                for (int smp = 0; smp < numSamples; ++smp)
+                {
+                    const auto noise = random.nextFloat() - 0.5f;
+                    tracks[lane].setSample(ch, smp, noise);
+                    references[lane].setSample(ch, smp, noise);
+                }
+            }
+
+            engines[lane]->processBlock(references[lane]);
+        }
+
+        bank.processBlock(trackPointers, numLanes, numSamples);
+
+        for (int lane = 0; lane < numLanes; ++lane)
+            for (int ch = 0; ch < 2; ++ch)
+                for (int smp = 0; smp < numSamples; ++smp)
+                    maxError = jmax(maxError, static_cast<double>(std::abs(tracks[lane].getSample(ch, smp) - references[lane].getSample(ch, smp))));
+
+        position += numSamples;
+    }
+
+    return maxError;
+}
+
+/** Largest difference between the per-sample phaser and the control-rate one, over one second of noise with the LFO
+    at its fastest and the phaser at full depth, which is the worst case for the interpolation.
+*/
+static double measureControlRateDeviation(double sampleRate, int controlInterval, bool color)
+{
+    const int blockSize = 512;
+
+    ModulationGenerator<float> generator(8.0, 2000.0, 0.0);
+    SmallStone<float> reference, controlRate;
+
+    generator.prepareToPlay(sampleRate);
+    reference.prepareToPlay(sampleRate, blockSize);
+    controlRate.prepareToPlay(sampleRate, blockSize);
+    reference.setColor(color);
+    controlRate.setColor(color);
+    controlRate.setControlInterval(controlInterval);
+
+    AudioBuffer<float> modulation(2, blockSize), chorusModulation(2, blockSize);
+    AudioBuffer<float> referenceAudio(2, blockSize), controlRateAudio(2, blockSize);
+    Random random(0x5704e);
+    double maxError = 0.0;
+
+    for (int block = 0; block < roundToInt(sampleRate / blockSize); ++block)
+    {
+        generator.getNextAudioBlock(modulation, chorusModulation, blockSize);
+
+        for (int ch = 0; ch < 2; ++ch)
+        {
+            for (int smp = 0; smp < blockSize; ++smp)
+            {
+                const auto noise = random.nextFloat() - 0.5f;
+                referenceAudio.setSample(ch, smp, noise);
+                controlRateAudio.setSample(ch, smp, noise);
+            }
+        }
+
+        reference.processBlock(referenceAudio, modulation, 0, blockSize);
+        controlRate.processBlock(controlRateAudio, modulation, 0, blockSize);
+
+        for (int ch = 0; ch < 2; ++ch)
+            for (int smp = 0; smp < blockSize; ++smp)
+                maxError = jmax(maxError, static_cast<double>(std::abs(referenceAudio.getSample(ch, smp) - controlRateAudio.getSample(ch, smp))));
+    }
+
+    return maxError;
+}
+
+/** The worst error of one interpolation kernel in SampleType against an ideal fractional delay, in dB, as
+    ChorusInterpolation::getError() states it: over fractions a 1024th apart and frequencies up to an eighth of the
+    sample rate. The kernel runs over a cosine and a sine at once, whose errors add up to the magnitude of the complex
+    one, so every output sample is a measurement. A recursive kernel first runs long enough to settle.
+*/
+template <typename SampleType, template <typename> class Kernel>
+static double measureInterpolationError()
+{
+    constexpr int numTaps = Kernel<SampleType>::numTaps;
+    constexpr int numFractions = 1024;
+    constexpr int numFrequencies = 32;
+    constexpr int numMeasured = 64;
+    constexpr int numSettling = Kernel<SampleType>::isRecursive ? 4096 : 0;
+    constexpr int length = numSettling + numMeasured + numTaps;
+
+    const Kernel<SampleType> kernel;
+    std::vector<SampleType> cosine(length), sine(length);
+    double maxError = 0.0;
+
+    for (int frequency = 1; frequency <= numFrequencies; ++frequency)
+    {
+        const auto omega = MathConstants<double>::pi * 0.25 * frequency / numFrequencies;
+
+        for (int n = 0; n < length; ++n)
+        {
+            cosine[static_cast<size_t>(n)] = static_cast<SampleType>(std::cos(omega * n));
+            sine[static_cast<size_t>(n)] = static_cast<SampleType>(std::sin(omega * n));
+        }
+
+        for (int step = 0; step < numFractions; ++step)
+        {
+            const auto fraction = static_cast<SampleType>(static_cast<double>(step) / numFractions);
+            const auto coefficient = Kernel<SampleType>::fromFraction(fraction);
+            SampleType previousCosine = 0, previousSine = 0;
+
+            for (int n = 0; n < numSettling + numMeasured; ++n)
+            {
+                SampleType outputCosine, outputSine;
+
+                if constexpr (Kernel<SampleType>::isRecursive)
+                {
+                    outputCosine = previousCosine = kernel(cosine.data() + n, coefficient, previousCosine);
+                    outputSine = previousSine = kernel(sine.data() + n, coefficient, previousSine);
+                }
+                else
+                {
+                    outputCosine = kernel(cosine.data() + n, coefficient);
+                    outputSine = kernel(sine.data() + n, coefficient);
+                }
+
+                if (n < numSettling)
+                    continue;
+
+                // The kernel returns the value fraction past taps[numTaps / 2 - 1].
+                const auto position = omega * (n + numTaps / 2 - 1 + static_cast<double>(fraction));
+                const auto error = std::hypot(outputCosine - std::cos(position), outputSine - std::sin(position));
+                maxError = jmax(maxError, error);
+            }
+        }
+    }
+
+    return Decibels::gainToDecibels(maxError, -200.0);
+}
+
+/** The error of kernel measured as above, the worse of float and double. */
+static double measureInterpolationError(ChorusInterpolation::Kernel kernel)
+{
+    switch (kernel)
+    {
+        case ChorusInterpolation::linear:
+            return jmax(measureInterpolationError<float, ChorusInterpolation::Linear>(), measureInterpolationError<double, ChorusInterpolation::Linear>());
+        case ChorusInterpolation::allPass:
+            return jmax(measureInterpolationError<float, ChorusInterpolation::AllPass>(), measureInterpolationError<double, ChorusInterpolation::AllPass>());
+        case ChorusInterpolation::hermite:
+            return jmax(measureInterpolationError<float, ChorusInterpolation::Hermite>(), measureInterpolationError<double, ChorusInterpolation::Hermite>());
+        case ChorusInterpolation::lagrange:
+            return jmax(measureInterpolationError<float, ChorusInterpolation::Lagrange>(), measureInterpolationError<double, ChorusInterpolation::Lagrange>());
+        case ChorusInterpolation::sinc:
+            return jmax(measureInterpolationError<float, ChorusInterpolation::Sinc>(), measureInterpolationError<double, ChorusInterpolation::Sinc>());
+        case ChorusInterpolation::numKernels:
+            break;
+    }
+
+    jassertfalse;
+    return 0.0;
+}
@@ -0,0 +1,234 @@
+/*
+  ==============================================================================
+
+    StartupBenchmark.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include "../../../Source/CrossfadingEngine.h"
+#include "../../../Source/Parameters.h"
+#include "../../../Source/StateFormat.h"
+#include "PaintBenchmark.h"
+
+/*
+ * What opening a session with many instances costs: building and restoring the instances, and opening their editors.
+ * A console tool can't link the plugin, so an instance is what its processor builds: the parameters on a stand-in
+ * processor and a crossfading engine per precision. An editor is the front panel, with the stand-in pictures of
+ * PaintBenchmark encoded as PNG, so that they are decoded like the plugin's.
+*/
+class StartupBenchmark
+{
+public:
+
+    /** Instances built and restored per second, from the compact state or from the XML older versions saved. */
+    static double measureInstancesPerSecond(int numInstances, bool fromXml)
+    {
+        const auto state = createState(fromXml);
+        OwnedArray<StandInProcessor> instances;
+
+        return numInstances / time([&]
+        {
+            for (int i = 0; i < numInstances; ++i)
+                instances.add(new StandInProcessor())->setStateInformation(state.getData(), static_cast<int>(state.getSize()));
+        });
+    }
+
+    /** Instances built, restored and prepared for 48 kHz, 512 samples in stereo, per second. */
+    static double measurePreparedInstancesPerSecond(int numInstances)
+    {
+        const auto state = createState(false);
+        OwnedArray<StandInProcessor> instances;
+
+        return numInstances / time([&]
+        {
+            for (int i = 0; i < numInstances; ++i)
+            {
+                auto* instance = instances.add(new StandInProcessor());
+                instance->setStateInformation(state.getData(), static_cast<int>(state.getSize()));
+                instance->prepareToPlay(48000.0, 512);
+            }
+        });
+    }
+
+    struct EditorTimes
+    {
+        double firstOpen;   // The first panel of the process, built and painted. It paints a plain face.
+        double withArtwork; // From building the first panel to its first frame with the artwork.
+        double nextOpen;    // Any further panel, built and painted, with the artwork decoded and rescaled already.
+        double legacyOpen;  // What every editor did before: decode, build, rescale and paint on the message thread.
+    };
+
+    /** In milliseconds, at the given display scale. Needs the message manager. */
+    static EditorTimes measureEditorOpen(float displayScale, int numEditors)
+    {
+        const auto pngs = encodeStandInImages();
+        Image frame(Image::RGB, roundToInt(PANEL_WIDTH * displayScale), roundToInt(PANEL_HEIGHT * displayScale), true);
+
+        auto paint = [&frame, displayScale](FrontPanel& panel)
+        {
+            Graphics g(frame);
+            g.addTransform(AffineTransform::scale(displayScale));
+            panel.paintEntireComponent(g, false);
+        };
+
+        EditorTimes times {};
+
+        {
+            PanelArtwork artwork([&pngs] { return decode(pngs); });
+            std::unique_ptr<FrontPanel> panel;
+
+            const auto start = Time::getHighResolutionTicks();
+            times.firstOpen = time([&] { panel = std::make_unique<FrontPanel>(artwork); paint(*panel); }) * 1.0e3;
+
+            artwork.waitUntilLoaded();
+            paint(*panel);
+            times.withArtwork = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - start) * 1.0e3;
+
+            std::vector<double> opens;
+
+            for (int i = 0; i < numEditors; ++i)
+                opens.push_back(time([&] { FrontPanel another(artwork); paint(another); }) * 1.0e3);
+
+            std::sort(opens.begin(), opens.end());
+            times.nextOpen = opens[opens.size() / 2];
+        }
+
+        times.legacyOpen = time([&]
+        {
+            const auto images = decode(pngs);
+            PanelArtwork artwork([&images] { return images; });
+            FrontPanel panel(artwork);
+            artwork.waitUntilLoaded();
+            paint(panel);
+        }) * 1.0e3;
+
+        return times;
+    }
+
+private:
+
+    // Builds what StoneMistressAudioProcessor builds, and restores a state the same two ways.
+    class StandInProcessor : public AudioProcessor
+    {
+    public:
+
+        StandInProcessor()
+            : AudioProcessor(BusesProperties().withInput("Input", AudioChannelSet::stereo(), true)
+                                              .withOutput("Output", AudioChannelSet::stereo(), true)),
+            parameters(*this, nullptr, "STONEMISTRESS_PARAMS", Parameters::createParameterLayout()),
+            floatEngine(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth),
+            doubleEngine(Parameters::defaultRate, Parameters::defaultPhaserDepth, Parameters::defaultChorusDepth)
+        {
+        }
+
+        void setValues(const Parameters::Values& values)
+        {
+            for (int index = 0; index < Parameters::numParameters; ++index)
+            {
+                auto* parameter = parameters.getParameter(Parameters::ids[index]);
+                parameter->setValueNotifyingHost(parameter->convertTo0to1(values[static_cast<size_t>(index)]));
+            }
+        }
+
+        void getStateInformation(MemoryBlock& destData) override
+        {
+            std::unique_ptr<XmlElement> xml(parameters.copyState().createXml());
+            copyXmlToBinary(*xml, destData);
+        }
+
+        void setStateInformation(const void* data, int sizeInBytes) override
+        {
+            auto values = Parameters::defaults;
+            int presetIndex = -1;
+
+            if (StateFormat::read(data, sizeInBytes, values, presetIndex))
+            {
+                setValues(values);
+                return;
+            }
+
+            std::unique_ptr<XmlElement> xmlState(getXmlFromBinary(data, sizeInBytes));
+            if (xmlState.get() != nullptr)
+                if (xmlState->hasTagName(parameters.state.getType()))
+                    parameters.replaceState(ValueTree::fromXml(*xmlState));
+        }
+
+        void prepareToPlay(double sampleRate, int samplesPerBlock) override { floatEngine.prepareToPlay(sampleRate, samplesPerBlock); }
+        void releaseResources() override { floatEngine.releaseResources(); }
+        void processBlock(AudioBuffer<float>& buffer, MidiBuffer&) override { floatEngine.processBlock(buffer); }
+
+        const String getName() const override { return "StoneMistress"; }
+        bool acceptsMidi() const override { return false; }
+        bool producesMidi() const override { return false; }
+        double getTailLengthSeconds() const override { return 0.0; }
+        AudioProcessorEditor* createEditor() override { return nullptr; }
+        bool hasEditor() const override { return false; }
+        int getNumPrograms() override { return 1; }
+        int getCurrentProgram() override { return 0; }
+        void setCurrentProgram(int) override {}
+        const String getProgramName(int) override { return {}; }
+        void changeProgramName(int, const String&) override {}
+
+    private:
+
+        AudioProcessorValueTreeState parameters;
+        CrossfadingEngine<float> floatEngine;
+        CrossfadingEngine<double> doubleEngine;
+
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StandInProcessor)
+    };
+
+    // A session saved with every parameter off its default.
+    static MemoryBlock createState(bool asXml)
+    {
+        const Parameters::Values values = { 0.6f, 800.0f, 0.012f, 1.0f, 1.0f, 0.0f, 0.2f, 0.7f, 3.0f };
+        MemoryBlock state;
+
+        if (asXml)
+        {
+            StandInProcessor instance;
+            instance.setValues(values);
+            instance.getStateInformation(state);
+        }
+        else
+        {
+            StateFormat::write(values, -1, state);
+        }
+
+        return state;
+    }
+
+    static std::array<MemoryBlock, 3> encodeStandInImages()
+    {
+        const auto images = PaintBenchmark::createStandInImages();
+        std::array<MemoryBlock, 3> pngs;
+        size_t index = 0;
+
+        for (auto* image : { &images.background, &images.switchOn, &images.switchOff })
+        {
+            MemoryOutputStream stream(pngs[index++], false);
+            PNGImageFormat().writeImageToStream(*image, stream);
+        }
+
+        return pngs;
+    }
+
+    static PanelArtwork::Images decode(const std::array<MemoryBlock, 3>& pngs)
+    {
+        return { ImageFileFormat::loadFrom(pngs[0].getData(), pngs[0].getSize()),
+                 ImageFileFormat::loadFrom(pngs[1].getData(), pngs[1].getSize()),
+                 ImageFileFormat::loadFrom(pngs[2].getData(), pngs[2].getSize()) };
+    }
+
+    // Seconds one call takes.
+    template <typename Callback>
+    static double time(Callback&& callback)
+    {
+        const auto start = Time::getHighResolutionTicks();
+        callback();
+        return Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - start);
+    }
+};
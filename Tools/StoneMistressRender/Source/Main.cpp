@@ -0,0 +1,199 @@
+/*
+  ==============================================================================
+
+    Headless offline renderer: runs WAV/AIFF files through the Stone Mistress
+    chain, several files at a time.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include <map>
+#include "RenderJob.h"
+
+static void printUsage()
+{
+    std::cout << "Usage: StoneMistressRender --output=<folder> [options] <files...>\n"
+                 "  --rate=<Hz>            LFO rate, 0.05 - 8 (default " << Parameters::defaultRate << ")\n"
+                 "  --phaser-depth=<Hz>    Phaser depth, 0 - 2000 (default " << Parameters::defaultPhaserDepth << ")\n"
+                 "  --chorus-depth=<s>     Chorus depth, 0 - 0.04 (default " << Parameters::defaultChorusDepth << ")\n"
+                 "  --color                Engage the Color feedback line\n"
+                 "  --phaser-mix=<0-1>     Phaser wet share, 0 dry only, 1 wet only (default " << Parameters::defaultPhaserMix << ")\n"
+                 "  --chorus-mix=<0-1>     Chorus wet share, 0 dry only, 1 wet only (default " << Parameters::defaultChorusMix << ")\n"
+                 "  --chorus-voices=<n>    Chorus voices per channel, 1 - " << Parameters::maxChorusVoices << ", each at its own LFO phase\n"
+                 "                         (default " << Parameters::defaultChorusVoices << ")\n"
+                 "  --chorus-error=<dB>    Chorus interpolation error allowed, picks the cheapest kernel\n"
+                 "                         that meets it (default " << CHORUS_OFFLINE_ERROR << ", sinc). Or name the kernel:\n"
+                 "                         linear, allpass (what the plugin plays with), hermite,\n"
+                 "                         lagrange or sinc\n"
+                 "  --control-interval=<n> Evaluate the phaser coefficients every n samples and\n"
+                 "                         interpolate in between (default 1, every sample)\n"
+                 "  --oversampling=<n>     Run the phaser 1x, 2x or 4x oversampled (default 1)\n"
+                 "  --linear-phase         Use linear phase oversampling filters instead of minimum phase\n"
+                 "  --block-size=<n>       Processing block size (default 512)\n"
+                 "  --jobs=<n>             Jobs run concurrently (default: number of CPUs). Without\n"
+                 "                         oversampling or chorus voices, a job renders up to " << STONEMISTRESS_BANK_LANES << "\n"
+                 "                         mono or stereo files at once, as lanes of one bank. With\n"
+                 "                         fewer jobs, the channels of each file are split over threads\n"
+                 "  --deterministic        Use the portable kernels on every CPU, so the output is\n"
+                 "                         bit-identical across machines\n"
+                 "  --trace=<file>         Write a Chrome trace of every block (Profile builds only)\n";
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    ArgumentList args(argc, argv);
+
+    if (args.size() == 0 || args.containsOption("--help|-h"))
+    {
+        printUsage();
+        return 0;
+    }
+
+    RenderSettings settings;
+
+    if (args.containsOption("--rate"))
+        settings.rate = jlimit(0.05, 8.0, args.getValueForOption("--rate").getDoubleValue());
+
+    if (args.containsOption("--phaser-depth"))
+        settings.phaserDepth = jlimit(0.0, 2000.0, args.getValueForOption("--phaser-depth").getDoubleValue());
+
+    if (args.containsOption("--chorus-depth"))
+        settings.chorusDepth = jlimit(0.0, 0.04, args.getValueForOption("--chorus-depth").getDoubleValue());
+
+    if (args.containsOption("--phaser-mix"))
+        settings.phaserMix = jlimit(0.0, 1.0, args.getValueForOption("--phaser-mix").getDoubleValue());
+
+    if (args.containsOption("--chorus-mix"))
+        settings.chorusMix = jlimit(0.0, 1.0, args.getValueForOption("--chorus-mix").getDoubleValue());
+
+    if (args.containsOption("--chorus-voices"))
+        settings.chorusVoices = jlimit(1, Parameters::maxChorusVoices, args.getValueForOption("--chorus-voices").getIntValue());
+
+    if (args.containsOption("--chorus-error"))
+    {
+        const auto value = args.getValueForOption("--chorus-error");
+
+        if (! ChorusInterpolation::fromName(value, settings.chorusInterpolation))
+            settings.chorusInterpolation = ChorusInterpolation::pick(value.getDoubleValue());
+    }
+
+    if (args.containsOption("--block-size"))
+        settings.blockSize = jlimit(16, RENDER_CHUNK_SIZE, args.getValueForOption("--block-size").getIntValue());
+
+    if (args.containsOption("--control-interval"))
+        settings.controlInterval = jlimit(1, 256, args.getValueForOption("--control-interval").getIntValue());
+
+    if (args.containsOption("--oversampling"))
+        settings.oversampling = nextPowerOfTwo(jlimit(1, MAX_OVERSAMPLING, args.getValueForOption("--oversampling").getIntValue()));
+
+    settings.color = args.containsOption("--color");
+    settings.linearPhase = args.containsOption("--linear-phase");
+
+    if (args.containsOption("--deterministic"))
+        CpuDispatch::setDeterministic(true);
+
+   #if STONEMISTRESS_PROFILING
+    // Ends after everything else in main(), with all the threads done.
+    std::unique_ptr<Profiler::Session> profilerSession;
+
+    if (args.containsOption("--trace"))
+        profilerSession = std::make_unique<Profiler::Session>(File::getCurrentWorkingDirectory().getChildFile(args.getValueForOption("--trace")));
+   #else
+    if (args.containsOption("--trace"))
+        std::cerr << "Built without STONEMISTRESS_PROFILING, no trace is written. Build the Profile configuration." << std::endl;
+   #endif
+
+    const auto numJobs = args.containsOption("--jobs") ? jmax(1, args.getValueForOption("--jobs").getIntValue())
+                                                       : SystemStats::getNumCpus();
+
+    if (! args.containsOption("--output"))
+    {
+        printUsage();
+        return 1;
+    }
+
+    settings.outputFolder = File::getCurrentWorkingDirectory().getChildFile(args.getValueForOption("--output"));
+
+    if (! settings.outputFolder.createDirectory())
+    {
+        std::cerr << "Could not create " << settings.outputFolder.getFullPathName() << std::endl;
+        return 1;
+    }
+
+    Array<File> inputFiles;
+
+    for (auto& arg : args.arguments)
+        if (! arg.isOption())
+            inputFiles.add(arg.resolveAsFile());
+
+    if (inputFiles.isEmpty())
+    {
+        printUsage();
+        return 1;
+    }
+
+    AudioFormatManager formatManager;
+    formatManager.registerFormat(new WavAudioFormat(), true);
+    formatManager.registerFormat(new AiffAudioFormat(), false);
+
+    // Mono and stereo files go through banks when the settings allow it, grouped by sample rate. Everything else, and
+    // the files that can't be read here, which their RenderJob reports, gets an engine of its own.
+    std::map<double, Array<File>> bankFiles;
+    Array<File> engineFiles;
+    int numBankFiles = 0;
+
+    for (auto& file : inputFiles)
+    {
+        std::unique_ptr<AudioFormatReader> reader(formatManager.createReaderFor(file));
+
+        if (reader != nullptr && BankRenderJob::canRender(settings) && BankRenderJob::canRender(static_cast<int>(reader->numChannels)))
+        {
+            bankFiles[reader->sampleRate].add(file);
+            ++numBankFiles;
+        }
+        else
+        {
+            engineFiles.add(file);
+        }
+    }
+
+    // Full banks, unless that leaves jobs without a bank.
+    const auto tracksPerBank = jlimit(1, STONEMISTRESS_BANK_LANES, (numBankFiles + numJobs - 1) / numJobs);
+    Array<Array<File>> banks;
+
+    for (auto& group : bankFiles)
+        for (int first = 0; first < group.second.size(); first += tracksPerBank)
+            banks.add(Array<File>(group.second.begin() + first, jmin(tracksPerBank, group.second.size() - first)));
+
+    // Cores left over by the jobs go to the channels of each file.
+    settings.parallelChannels = banks.size() + engineFiles.size() < numJobs;
+
+    TimeSliceThread writerThread("StoneMistress disk writer");
+    writerThread.startThread();
+
+    RenderReport report;
+    const auto startTime = Time::getMillisecondCounterHiRes();
+
+    {
+        ThreadPool pool(jmin(numJobs, banks.size() + engineFiles.size()));
+
+        for (auto& bank : banks)
+            pool.addJob(new BankRenderJob(formatManager, writerThread, bank, settings, report), true);
+
+        for (auto& file : engineFiles)
+            pool.addJob(new RenderJob(formatManager, writerThread, file, settings, report), true);
+
+        while (pool.getNumJobs() > 0)
+            Thread::sleep(20);
+    }
+
+    writerThread.stopThread(5000);
+
+    const auto seconds = (Time::getMillisecondCounterHiRes() - startTime) * 0.001;
+    std::cout << (inputFiles.size() - report.failures.size()) << " of " << inputFiles.size() << " files rendered in "
+              << String(seconds, 2) << " s (" << CpuDispatch::getName(CpuDispatch::getInstructionSet()) << ")" << std::endl;
+
+    return report.failures.isEmpty() ? 0 : 1;
+}
@@ -0,0 +1,340 @@
+/*
+  ==============================================================================
+
+    RenderJob.h
+
+  ==============================================================================
+*/
+
+#pragma once
+#include <JuceHeader.h>
+#include <iostream>
+#include "../../../Source/Parameters.h"
+#include "../../../Source/StoneMistressBank.h"
+#include "../../../Source/StoneMistressEngine.h"
+
+// Number of samples read from the mapped input and handed to the writer at once.
+#define RENDER_CHUNK_SIZE 16384
+
+struct RenderSettings
+{
+    double rate = Parameters::defaultRate;
+    double phaserDepth = Parameters::defaultPhaserDepth;
+    double chorusDepth = Parameters::defaultChorusDepth;
+    bool color = Parameters::defaultColor;
+    double phaserMix = Parameters::defaultPhaserMix;
+    double chorusMix = Parameters::defaultChorusMix;
+    int chorusVoices = Parameters::defaultChorusVoices;
+    int blockSize = 512;
+    int controlInterval = 1;
+    int oversampling = 1;
+    bool linearPhase = false;
+    bool parallelChannels = false; // See StoneMistressEngine::setParallelProcessing().
+    ChorusInterpolation::Kernel chorusInterpolation = ChorusInterpolation::pick(CHORUS_OFFLINE_ERROR);
+    File outputFolder;
+};
+
+// Collects the outcome of every job. Jobs run concurrently, so everything goes through the lock.
+struct RenderReport
+{
+    void succeeded(const File& file)
+    {
+        const ScopedLock sl(lock);
+        std::cout << "Rendered " << file.getFullPathName() << std::endl;
+    }
+
+    void failed(const File& file, const String& reason)
+    {
+        const ScopedLock sl(lock);
+        failures.add(file.getFullPathName() + ": " + reason);
+        std::cerr << "Failed " << file.getFullPathName() << ": " << reason << std::endl;
+    }
+
+    CriticalSection lock;
+    StringArray failures;
+};
+
+// An input file mapped into memory and the writer of its rendered copy, next to it in the output folder.
+struct RenderFile
+{
+    /** Returns an error message, empty if both are open. */
+    String open(AudioFormatManager& formatManager, const File& input, const File& outputFolder)
+    {
+        auto* format = formatManager.findFormatForFileExtension(input.getFileExtension());
+
+        if (format == nullptr)
+            return "unsupported file format";
+
+        reader.reset(format->createMemoryMappedReader(input));
+
+        if (reader == nullptr || ! reader->mapEntireFile())
+            return "could not memory-map the input file";
+
+        numChannels = static_cast<int>(reader->numChannels);
+
+        if (numChannels < 1 || numChannels > MAX_CHANNELS)
+            return "only files with 1 to " + String(MAX_CHANNELS) + " channels are supported";
+
+        auto outputFile = outputFolder.getChildFile(input.getFileName());
+
+        if (outputFile == input)
+            return "the output file would overwrite the input file";
+
+        outputFile.deleteFile();
+        std::unique_ptr<OutputStream> stream(outputFile.createOutputStream());
+
+        if (stream == nullptr)
+            return "could not open " + outputFile.getFullPathName();
+
+        writer.reset(format->createWriterFor(stream.get(), reader->sampleRate, reader->numChannels,
+                                             reader->bitsPerSample, reader->metadataValues, 0));
+        if (writer == nullptr)
+            return "could not create a writer for " + outputFile.getFullPathName();
+
+        stream.release(); // The writer owns the stream now.
+        return {};
+    }
+
+    std::unique_ptr<MemoryMappedAudioFormatReader> reader;
+    std::unique_ptr<AudioFormatWriter> writer;
+    int numChannels = 0;
+};
+
+/*
+ * Renders one file through the Stone Mistress chain.
+ * The input is read through a memory mapped reader, so the DSP never blocks on a read() call, and the output
+ * goes through a ThreadedWriter whose FIFO holds two chunks: while the writer thread flushes one chunk to disk
+ * the job is already processing the next one.
+*/
+class RenderJob : public ThreadPoolJob
+{
+public:
+
+    RenderJob(AudioFormatManager& fm, TimeSliceThread& wt, const File& input, const RenderSettings& s, RenderReport& r)
+        : ThreadPoolJob("Render " + input.getFileName()),
+        formatManager(fm),
+        writerThread(wt),
+        inputFile(input),
+        settings(s),
+        report(r)
+    {
+    }
+
+    JobStatus runJob() override
+    {
+        RenderFile file;
+        const auto error = file.open(formatManager, inputFile, settings.outputFolder);
+
+        if (error.isNotEmpty())
+            return fail(error);
+
+        auto& reader = file.reader;
+        const auto numChannels = file.numChannels;
+
+        StoneMistressEngine<float> engine(settings.rate, settings.phaserDepth, settings.chorusDepth);
+        engine.setColor(settings.color);
+        engine.setPhaserMix(settings.phaserMix);
+        engine.setChorusMix(settings.chorusMix);
+        engine.setChorusVoices(settings.chorusVoices);
+        engine.setPhaserControlInterval(settings.controlInterval);
+        engine.setOversampling(settings.oversampling, settings.linearPhase);
+        engine.setParallelProcessing(settings.parallelChannels);
+        engine.setChorusInterpolation(settings.chorusInterpolation);
+        engine.prepareToPlay(reader->sampleRate, settings.blockSize, numChannels);
+
+        AudioBuffer<float> chunk(numChannels, RENDER_CHUNK_SIZE);
+        const float* writePointers[MAX_CHANNELS] = {};
+
+        // The oversampling filters delay the output. The input is padded with that much silence at the end, and the
+        // same amount is dropped from the start of the output, so the rendered file lines up with the original.
+        const int latency = engine.getLatencyInSamples();
+        const auto lengthInSamples = reader->lengthInSamples + latency;
+
+        {
+            AudioFormatWriter::ThreadedWriter threadedWriter(file.writer.release(), writerThread, 2 * RENDER_CHUNK_SIZE);
+
+            for (int64 position = 0; position < lengthInSamples; position += RENDER_CHUNK_SIZE)
+            {
+                if (shouldExit())
+                    return jobHasFinished;
+
+                const int numThisTime = static_cast<int>(jmin<int64>(RENDER_CHUNK_SIZE, lengthInSamples - position));
+
+                reader->read(chunk.getArrayOfWritePointers(), numChannels, position, numThisTime); // Silence past the end.
+
+                for (int offset = 0; offset < numThisTime; offset += settings.blockSize)
+                {
+                    AudioBuffer<float> block(chunk.getArrayOfWritePointers(), numChannels, offset, jmin(settings.blockSize, numThisTime - offset));
+                    engine.processBlock(block);
+                }
+
+                const int numToSkip = static_cast<int>(jlimit<int64>(0, numThisTime, latency - position));
+
+                for (int ch = 0; ch < numChannels; ++ch)
+                    writePointers[ch] = chunk.getReadPointer(ch, numToSkip);
+
+                // The FIFO only fills up when the disk is slower than the DSP.
+                while (numToSkip < numThisTime && ! threadedWriter.write(writePointers, numThisTime - numToSkip))
+                    Thread::sleep(1);
+            }
+        } // ThreadedWriter flushes what is left in its FIFO when it goes out of scope.
+
+        report.succeeded(inputFile);
+        return jobHasFinished;
+    }
+
+private:
+
+    JobStatus fail(const String& reason)
+    {
+        report.failed(inputFile, reason);
+        return jobHasFinished;
+    }
+
+    AudioFormatManager& formatManager;
+    TimeSliceThread& writerThread;
+    const File inputFile;
+    const RenderSettings settings;
+    RenderReport& report;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(RenderJob)
+};
+
+/*
+ * Renders up to STONEMISTRESS_BANK_LANES mono or stereo files of the same sample rate at once, one per lane of a
+ * StoneMistressBank, read and written the same way as by a RenderJob. The bank has neither oversampling nor chorus
+ * voices, so canRender() tells which settings it can take. Every lane runs on its own: with the portable kernels a file
+ * comes out bit for bit the same whichever files it shares the bank with, the others may round differently where
+ * fewer tracks get a narrower register. Files that end early are rendered on silence until the longest one ends.
+*/
+class BankRenderJob : public ThreadPoolJob
+{
+public:
+
+    using Bank = StoneMistressBank<STONEMISTRESS_BANK_LANES>;
+
+    BankRenderJob(AudioFormatManager& fm, TimeSliceThread& wt, const Array<File>& inputs, const RenderSettings& s, RenderReport& r)
+        : ThreadPoolJob("Render " + String(inputs.size()) + " files"),
+        formatManager(fm),
+        writerThread(wt),
+        inputFiles(inputs),
+        settings(s),
+        report(r)
+    {
+        jassert(inputFiles.size() <= STONEMISTRESS_BANK_LANES);
+    }
+
+    static bool canRender(const RenderSettings& settings)
+    {
+        return settings.oversampling == 1 && settings.chorusVoices == 1;
+    }
+
+    static bool canRender(int numChannels) { return numChannels == 1 || numChannels == 2; }
+
+    JobStatus runJob() override
+    {
+        RenderFile files[STONEMISTRESS_BANK_LANES];
+        File rendered[STONEMISTRESS_BANK_LANES];
+        int numTracks = 0;
+
+        for (auto& input : inputFiles)
+        {
+            auto& file = files[numTracks];
+            auto error = file.open(formatManager, input, settings.outputFolder);
+
+            if (error.isEmpty() && ! canRender(file.numChannels))
+                error = "only mono and stereo files can be rendered in a bank";
+
+            if (error.isEmpty() && numTracks > 0 && file.reader->sampleRate != files[0].reader->sampleRate)
+                error = "the files of a bank must have the same sample rate";
+
+            if (error.isNotEmpty())
+            {
+                report.failed(input, error);
+                file = RenderFile();
+                continue;
+            }
+
+            rendered[numTracks++] = input;
+        }
+
+        if (numTracks == 0)
+            return jobHasFinished;
+
+        Bank bank(settings.rate, settings.phaserDepth, settings.chorusDepth);
+
+        for (int lane = 0; lane < numTracks; ++lane)
+        {
+            bank.setColor(lane, settings.color);
+            bank.setPhaserMix(lane, settings.phaserMix);
+            bank.setChorusMix(lane, settings.chorusMix);
+        }
+
+        bank.setPhaserControlInterval(settings.controlInterval);
+        bank.setChorusInterpolation(settings.chorusInterpolation);
+        bank.prepareToPlay(files[0].reader->sampleRate, settings.blockSize);
+
+        AudioBuffer<float> chunks[STONEMISTRESS_BANK_LANES];
+        AudioBuffer<float> blocks[STONEMISTRESS_BANK_LANES];
+        AudioBuffer<float>* blockPointers[STONEMISTRESS_BANK_LANES];
+        std::unique_ptr<AudioFormatWriter::ThreadedWriter> threadedWriters[STONEMISTRESS_BANK_LANES];
+        int64 lengthInSamples = 0;
+
+        for (int lane = 0; lane < numTracks; ++lane)
+        {
+            chunks[lane].setSize(files[lane].numChannels, RENDER_CHUNK_SIZE);
+            blockPointers[lane] = &blocks[lane];
+            threadedWriters[lane] = std::make_unique<AudioFormatWriter::ThreadedWriter>(files[lane].writer.release(), writerThread, 2 * RENDER_CHUNK_SIZE);
+            lengthInSamples = jmax(lengthInSamples, files[lane].reader->lengthInSamples);
+        }
+
+        for (int64 position = 0; position < lengthInSamples; position += RENDER_CHUNK_SIZE)
+        {
+            if (shouldExit())
+                return jobHasFinished;
+
+            const int numThisTime = static_cast<int>(jmin<int64>(RENDER_CHUNK_SIZE, lengthInSamples - position));
+
+            for (int lane = 0; lane < numTracks; ++lane)
+                files[lane].reader->read(chunks[lane].getArrayOfWritePointers(), files[lane].numChannels, position, numThisTime); // Silence past the end.
+
+            for (int offset = 0; offset < numThisTime; offset += settings.blockSize)
+            {
+                const auto blockSize = jmin(settings.blockSize, numThisTime - offset);
+
+                for (int lane = 0; lane < numTracks; ++lane)
+                    blocks[lane].setDataToReferTo(chunks[lane].getArrayOfWritePointers(), files[lane].numChannels, offset, blockSize);
+
+                bank.processBlock(blockPointers, numTracks, blockSize);
+            }
+
+            for (int lane = 0; lane < numTracks; ++lane)
+            {
+                const int numToWrite = static_cast<int>(jlimit<int64>(0, numThisTime, files[lane].reader->lengthInSamples - position));
+
+                // The FIFO only fills up when the disk is slower than the DSP.
+                while (numToWrite > 0 && ! threadedWriters[lane]->write(chunks[lane].getArrayOfReadPointers(), numToWrite))
+                    Thread::sleep(1);
+            }
+        }
+
+        // The ThreadedWriters flush what is left in their FIFOs when they are deleted.
+        for (int lane = 0; lane < numTracks; ++lane)
+        {
+            threadedWriters[lane].reset();
+            report.succeeded(rendered[lane]);
+        }
+
+        return jobHasFinished;
+    }
+
+private:
+
+    AudioFormatManager& formatManager;
+    TimeSliceThread& writerThread;
+    const Array<File> inputFiles;
+    const RenderSettings settings;
+    RenderReport& report;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(BankRenderJob)
+};